@@ -0,0 +1,523 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "AsyncAuth.h"
+
+enum {
+	kAsyncWorkersDefault = 4,
+	kAsyncHeapInitial    = 64
+};
+
+struct od_async_auth {
+	struct od_async_auth	*next;		/* in the job or the completion queue */
+	char			*user;
+	char			*password;	/* wiped and freed once verified */
+	od_async_callback_t	callback;
+	void			*ctx;
+	uint64_t		start;		/* us, CLOCK_MONOTONIC */
+	uint64_t		deadline;	/* us, when a blinded failure completes */
+	int			pending;	/* result waiting out the blinding window */
+	int			result;		/* PAM_INCOMPLETE until complete */
+	unsigned int		refs;		/* the caller's and the engine's */
+	bool			released;	/* by the caller */
+};
+
+struct od_async {
+	struct dir_backend	*backend;
+	struct od_async_params	params;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* a job was queued, or stopping */
+	pthread_cond_t		timer;		/* the earliest deadline moved, or stopping */
+	struct od_async_auth	*jobs, **jobs_tail;
+	struct od_async_auth	*done, **done_tail;
+	struct od_async_auth	**heap;		/* blinded failures, earliest deadline first */
+	size_t			heap_len, heap_cap;
+	int			fds[2];		/* completion queue not empty while readable */
+	bool			signalled;
+	bool			stopping;	/* workers */
+	bool			timer_stopping;
+	unsigned int		nworkers;
+	pthread_t		*workers;
+	pthread_t		timer_thread;
+	bool			timer_started;
+	uint32_t		in_flight;
+	struct od_async_stats	stats;
+};
+
+static uint64_t
+od_async_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* memset() through a volatile pointer is not optimized away */
+static void *(*const volatile od_async_memset)(void *, int, size_t) = memset;
+
+static void
+od_async_unref(struct od_async_auth *auth)
+{
+	if (0 != __atomic_sub_fetch(&auth->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (NULL != auth->password) {
+		od_async_memset(auth->password, 0, strlen(auth->password));
+		free(auth->password);
+	}
+	free(auth->user);
+	free(auth);
+}
+
+/* lock held; the queue was empty, so make the descriptor readable */
+static void
+od_async_signal(struct od_async *engine)
+{
+	if (engine->signalled)
+		return;
+	engine->signalled = true;
+	/* a full pipe is readable already */
+	(void)write(engine->fds[1], "", 1);
+}
+
+/* hands the result over and drops the engine's reference */
+static void
+od_async_complete(struct od_async *engine, struct od_async_auth *auth, int result)
+{
+	__atomic_store_n(&auth->result, result, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&engine->lock);
+	++engine->stats.completed;
+	--engine->in_flight;
+	if (NULL == auth->callback && !__atomic_load_n(&auth->released, __ATOMIC_ACQUIRE)) {
+		/* the queue takes over the engine's reference */
+		auth->next = NULL;
+		*engine->done_tail = auth;
+		engine->done_tail = &auth->next;
+		od_async_signal(engine);
+		pthread_mutex_unlock(&engine->lock);
+		return;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	if (NULL != auth->callback && !__atomic_load_n(&auth->released, __ATOMIC_ACQUIRE))
+		auth->callback(auth, auth->ctx);
+	od_async_unref(auth);
+}
+
+/* lock held */
+static void
+od_async_heap_swap(struct od_async *engine, size_t a, size_t b)
+{
+	struct od_async_auth *t = engine->heap[a];
+
+	engine->heap[a] = engine->heap[b];
+	engine->heap[b] = t;
+}
+
+/* lock held; false if the heap cannot grow */
+static bool
+od_async_heap_push(struct od_async *engine, struct od_async_auth *auth)
+{
+	struct od_async_auth **heap = NULL;
+	size_t i, parent;
+
+	if (engine->heap_len == engine->heap_cap) {
+		size_t cap = engine->heap_cap ? engine->heap_cap * 2 : kAsyncHeapInitial;
+
+		if (NULL == (heap = realloc(engine->heap, cap * sizeof(*heap))))
+			return false;
+		engine->heap = heap;
+		engine->heap_cap = cap;
+	}
+
+	i = engine->heap_len++;
+	engine->heap[i] = auth;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (engine->heap[parent]->deadline <= engine->heap[i]->deadline)
+			break;
+		od_async_heap_swap(engine, i, parent);
+		i = parent;
+	}
+
+	return true;
+}
+
+/* lock held, heap not empty */
+static struct od_async_auth *
+od_async_heap_pop(struct od_async *engine)
+{
+	struct od_async_auth *top = engine->heap[0];
+	size_t i = 0, child;
+
+	engine->heap[0] = engine->heap[--engine->heap_len];
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= engine->heap_len)
+			break;
+		if (child + 1 < engine->heap_len && engine->heap[child + 1]->deadline < engine->heap[child]->deadline)
+			++child;
+		if (engine->heap[i]->deadline <= engine->heap[child]->deadline)
+			break;
+		od_async_heap_swap(engine, i, child);
+		i = child;
+	}
+
+	return top;
+}
+
+static int
+od_async_verify(struct od_async *engine, struct od_async_auth *auth)
+{
+	struct dir_backend *backend = engine->backend;
+	void *record = NULL;
+	int retval;
+
+	retval = backend->ops->lookup(backend, auth->user, &record);
+	if (PAM_SUCCESS == retval) {
+		retval = backend->ops->verify_password(backend, record, auth->password);
+		backend->ops->release(backend, record);
+	}
+
+	return retval;
+}
+
+static void *
+od_async_worker(void *arg)
+{
+	struct od_async *engine = arg;
+	struct od_async_auth *auth = NULL;
+	uint64_t now, window;
+	struct timespec ts;
+	int result;
+
+	for (;;) {
+		pthread_mutex_lock(&engine->lock);
+		while (NULL == engine->jobs && !engine->stopping)
+			pthread_cond_wait(&engine->work, &engine->lock);
+		if (NULL == (auth = engine->jobs)) {
+			pthread_mutex_unlock(&engine->lock);
+			break;
+		}
+		if (NULL == (engine->jobs = auth->next))
+			engine->jobs_tail = &engine->jobs;
+		--engine->stats.queued;
+		pthread_mutex_unlock(&engine->lock);
+
+		/* nobody is waiting for an abandoned one */
+		if (__atomic_load_n(&auth->released, __ATOMIC_ACQUIRE)) {
+			od_async_complete(engine, auth, PAM_ABORT);
+			continue;
+		}
+
+		result = od_async_verify(engine, auth);
+		od_async_memset(auth->password, 0, strlen(auth->password));
+		now = od_async_now();
+
+		if (PAM_SUCCESS == result) {
+			if (NULL != engine->params.success)
+				engine->params.success(engine->params.ctx, now - auth->start);
+			od_async_complete(engine, auth, result);
+			continue;
+		}
+
+		window = (NULL != engine->params.window) ? engine->params.window(engine->params.ctx) : 0;
+		auth->deadline = auth->start + window;
+		auth->pending = result;
+		if (now >= auth->deadline) {
+			od_async_complete(engine, auth, result);
+			continue;
+		}
+
+		pthread_mutex_lock(&engine->lock);
+		if (od_async_heap_push(engine, auth)) {
+			++engine->stats.blinded;
+			++engine->stats.timers;
+			/* only a new earliest deadline needs the timer thread */
+			if (engine->heap[0] == auth)
+				pthread_cond_signal(&engine->timer);
+			pthread_mutex_unlock(&engine->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&engine->lock);
+
+		/* no room for a timer: blind the old way rather than not at all */
+		ts.tv_sec = (auth->deadline - now) / 1000000;
+		ts.tv_nsec = ((auth->deadline - now) % 1000000) * 1000;
+		while (0 != nanosleep(&ts, &ts) && EINTR == errno)
+			;
+		od_async_complete(engine, auth, result);
+	}
+
+	return NULL;
+}
+
+static void *
+od_async_timer(void *arg)
+{
+	struct od_async *engine = arg;
+	struct od_async_auth *auth = NULL;
+	struct timespec deadline;
+	uint64_t now, usec;
+
+	pthread_mutex_lock(&engine->lock);
+	for (;;) {
+		if (0 == engine->heap_len) {
+			if (engine->timer_stopping)
+				break;
+			pthread_cond_wait(&engine->timer, &engine->lock);
+			continue;
+		}
+
+		now = od_async_now();
+		if (engine->heap[0]->deadline <= now || engine->timer_stopping) {
+			auth = od_async_heap_pop(engine);
+			--engine->stats.timers;
+			pthread_mutex_unlock(&engine->lock);
+			od_async_complete(engine, auth, auth->pending);
+			pthread_mutex_lock(&engine->lock);
+			continue;
+		}
+
+		/* condition variables time out on the wall clock */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		usec = (uint64_t)deadline.tv_nsec / 1000 + (engine->heap[0]->deadline - now);
+		deadline.tv_sec += usec / 1000000;
+		deadline.tv_nsec = (usec % 1000000) * 1000;
+		pthread_cond_timedwait(&engine->timer, &engine->lock, &deadline);
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return NULL;
+}
+
+struct od_async *
+od_async_create(struct dir_backend *backend, const struct od_async_params *params)
+{
+	struct od_async *engine = NULL;
+	unsigned int i;
+	int j;
+
+	if (NULL == backend || NULL == params)
+		return NULL;
+	if (NULL == (engine = calloc(1, sizeof(*engine))))
+		return NULL;
+
+	engine->backend = backend;
+	engine->params = *params;
+	engine->nworkers = params->workers ? params->workers : kAsyncWorkersDefault;
+	engine->jobs_tail = &engine->jobs;
+	engine->done_tail = &engine->done;
+	engine->fds[0] = engine->fds[1] = -1;
+	pthread_mutex_init(&engine->lock, NULL);
+	pthread_cond_init(&engine->work, NULL);
+	pthread_cond_init(&engine->timer, NULL);
+
+	if (0 != pipe(engine->fds))
+		goto fail;
+	for (j = 0; j < 2; ++j) {
+		fcntl(engine->fds[j], F_SETFD, FD_CLOEXEC);
+		fcntl(engine->fds[j], F_SETFL, fcntl(engine->fds[j], F_GETFL) | O_NONBLOCK);
+	}
+
+	if (NULL == (engine->workers = calloc(engine->nworkers, sizeof(*engine->workers))))
+		goto fail;
+	if (0 != pthread_create(&engine->timer_thread, NULL, od_async_timer, engine))
+		goto fail;
+	engine->timer_started = true;
+	for (i = 0; i < engine->nworkers; ++i) {
+		if (0 != pthread_create(&engine->workers[i], NULL, od_async_worker, engine))
+			break;
+	}
+	engine->nworkers = i;
+	if (0 == engine->nworkers)
+		goto fail;
+
+	return engine;
+
+fail:
+	engine->backend = NULL;
+	od_async_destroy(engine);
+	return NULL;
+}
+
+void
+od_async_destroy(struct od_async *engine)
+{
+	struct od_async_auth *auth = NULL;
+	unsigned int i;
+
+	if (NULL == engine)
+		return;
+
+	pthread_mutex_lock(&engine->lock);
+	engine->stopping = true;
+	pthread_cond_broadcast(&engine->work);
+	pthread_mutex_unlock(&engine->lock);
+	for (i = 0; i < engine->nworkers; ++i)
+		pthread_join(engine->workers[i], NULL);
+
+	/* workers are gone, so nothing adds timers any more */
+	if (engine->timer_started) {
+		pthread_mutex_lock(&engine->lock);
+		engine->timer_stopping = true;
+		pthread_cond_broadcast(&engine->timer);
+		pthread_mutex_unlock(&engine->lock);
+		pthread_join(engine->timer_thread, NULL);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&engine->lock);
+		if (NULL != (auth = engine->jobs)) {
+			engine->jobs = auth->next;
+			--engine->stats.queued;
+		}
+		pthread_mutex_unlock(&engine->lock);
+		if (NULL == auth)
+			break;
+		od_async_complete(engine, auth, PAM_ABORT);
+	}
+
+	/* what was never collected stays readable through the caller's references */
+	while (NULL != (auth = engine->done)) {
+		engine->done = auth->next;
+		od_async_unref(auth);
+	}
+
+	if (engine->fds[0] >= 0)
+		close(engine->fds[0]);
+	if (engine->fds[1] >= 0)
+		close(engine->fds[1]);
+	if (NULL != engine->backend)
+		dir_backend_close(engine->backend);
+	free(engine->heap);
+	free(engine->workers);
+	pthread_cond_destroy(&engine->timer);
+	pthread_cond_destroy(&engine->work);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine);
+}
+
+struct od_async_auth *
+od_async_start(struct od_async *engine, const char *user, const char *password,
+	       od_async_callback_t callback, void *ctx)
+{
+	struct od_async_auth *auth = NULL;
+
+	if (NULL == engine || NULL == user || NULL == password)
+		return NULL;
+	if (NULL == (auth = calloc(1, sizeof(*auth))))
+		return NULL;
+	if (NULL == (auth->user = strdup(user)) || NULL == (auth->password = strdup(password))) {
+		free(auth->user);
+		free(auth);
+		return NULL;
+	}
+	auth->callback = callback;
+	auth->ctx = ctx;
+	auth->result = PAM_INCOMPLETE;
+	auth->refs = 2;
+	auth->start = od_async_now();
+
+	pthread_mutex_lock(&engine->lock);
+	if (engine->stopping) {
+		pthread_mutex_unlock(&engine->lock);
+		auth->refs = 1;
+		od_async_unref(auth);
+		return NULL;
+	}
+	*engine->jobs_tail = auth;
+	engine->jobs_tail = &auth->next;
+	++engine->stats.started;
+	++engine->stats.queued;
+	if (++engine->in_flight > engine->stats.peak_in_flight)
+		engine->stats.peak_in_flight = engine->in_flight;
+	pthread_cond_signal(&engine->work);
+	pthread_mutex_unlock(&engine->lock);
+
+	return auth;
+}
+
+int
+od_async_fd(struct od_async *engine)
+{
+	return (NULL != engine) ? engine->fds[0] : -1;
+}
+
+size_t
+od_async_collect(struct od_async *engine, struct od_async_auth **out, size_t max)
+{
+	struct od_async_auth *auth = NULL;
+	char buf[64];
+	size_t count = 0;
+
+	if (NULL == engine || NULL == out)
+		return 0;
+
+	pthread_mutex_lock(&engine->lock);
+	while (count < max && NULL != (auth = engine->done)) {
+		if (NULL == (engine->done = auth->next))
+			engine->done_tail = &engine->done;
+		/* the caller's own reference keeps it */
+		if (!__atomic_load_n(&auth->released, __ATOMIC_ACQUIRE))
+			out[count++] = auth;
+		od_async_unref(auth);
+	}
+	if (NULL == engine->done && engine->signalled) {
+		while (read(engine->fds[0], buf, sizeof(buf)) > 0)
+			;
+		engine->signalled = false;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return count;
+}
+
+int
+od_async_result(struct od_async_auth *auth)
+{
+	return (NULL != auth) ? __atomic_load_n(&auth->result, __ATOMIC_ACQUIRE) : PAM_SERVICE_ERR;
+}
+
+void *
+od_async_context(struct od_async_auth *auth)
+{
+	return (NULL != auth) ? auth->ctx : NULL;
+}
+
+const char *
+od_async_user(struct od_async_auth *auth)
+{
+	return (NULL != auth) ? auth->user : NULL;
+}
+
+void
+od_async_release(struct od_async_auth *auth)
+{
+	if (NULL == auth)
+		return;
+
+	__atomic_store_n(&auth->released, true, __ATOMIC_RELEASE);
+	od_async_unref(auth);
+}
+
+void
+od_async_get_stats(struct od_async *engine, struct od_async_stats *stats)
+{
+	if (NULL == engine || NULL == stats)
+		return;
+
+	pthread_mutex_lock(&engine->lock);
+	*stats = engine->stats;
+	pthread_mutex_unlock(&engine->lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Asynchronous password authentication for event-driven front ends.  A
+ * small pool of workers makes the blocking backend calls; a failure is
+ * then held back by a timer until its blinding window has passed, rather
+ * than by a sleeping thread.  Results come back through a callback or a
+ * completion queue whose descriptor polls readable while it is not empty.
+ * Nothing in here depends on CoreFoundation.
+ */
+
+#ifndef _ASYNCAUTH_H_
+#define _ASYNCAUTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Backend.h"
+
+struct od_async;
+struct od_async_auth;
+
+struct od_async_params {
+	unsigned int	workers;			/* threads calling the backend */
+	uint64_t	(*window)(void *ctx);		/* us a failure takes at least, from its start */
+	void		(*success)(void *ctx, uint64_t usec);	/* how long each success took */
+	void		*ctx;
+};
+
+typedef void (*od_async_callback_t)(struct od_async_auth *, void *ctx);
+
+struct od_async_stats {
+	uint64_t	started;
+	uint64_t	completed;
+	uint64_t	blinded;	/* failures held back by the timer */
+	uint32_t	queued;		/* waiting for a worker */
+	uint32_t	timers;		/* waiting out a blinding window */
+	uint32_t	peak_in_flight;
+};
+
+/* The engine takes the backend and closes it; on failure it stays the caller's. */
+struct od_async *od_async_create(struct dir_backend *, const struct od_async_params *);
+/* Completes whatever is still in flight with PAM_ABORT, or at once if only blinded. */
+void od_async_destroy(struct od_async *);
+
+/*
+ * Starts authenticating user with password, both copied.  With a callback,
+ * it is called once with the result, from an engine thread; otherwise the
+ * authentication goes to the completion queue.  NULL if out of memory.
+ */
+struct od_async_auth *od_async_start(struct od_async *, const char *user, const char *password,
+				     od_async_callback_t callback, void *ctx);
+
+/* readable while the completion queue holds an authentication */
+int od_async_fd(struct od_async *);
+/* takes up to max authentications off the completion queue, returns how many */
+size_t od_async_collect(struct od_async *, struct od_async_auth **out, size_t max);
+
+/* PAM status, PAM_INCOMPLETE until the authentication is complete */
+int od_async_result(struct od_async_auth *);
+void *od_async_context(struct od_async_auth *);
+const char *od_async_user(struct od_async_auth *);
+/* drops the caller's reference; an authentication still in flight is abandoned */
+void od_async_release(struct od_async_auth *);
+
+void od_async_get_stats(struct od_async *, struct od_async_stats *);
+
+#endif /* _ASYNCAUTH_H_ */
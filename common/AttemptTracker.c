@@ -0,0 +1,267 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "AttemptTracker.h"
+#include "SharedTable.h"
+
+#define OD_ATTEMPT_MAGIC 0x6f646661	/* "odfa" */
+#define OD_ATTEMPT_VERSION 1
+
+enum {
+	kAttemptHalflifeDefault = 15 * 60	/* s */
+};
+
+/* a counter decayed below this is as good as a free slot */
+static const double kAttemptForget = 0.05;
+
+struct od_attempt_tracker {
+	struct od_shared_table	shared;
+};
+
+/* the keys are only as unguessable as the secret in the file */
+static void
+od_attempt_reset(void *table)
+{
+	arc4random_buf(((struct od_attempt_table *)table)->secret, kODAttemptSecret);
+}
+
+static uint64_t
+od_attempt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void
+od_attempt_default_params(struct od_attempt_params *params)
+{
+	params->user_limit = 0;
+	params->source_limit = 0;
+	params->halflife = (uint64_t)kAttemptHalflifeDefault * 1000000;
+}
+
+struct od_attempt_tracker *
+od_attempt_open(const char *path)
+{
+	struct od_attempt_tracker *tracker = NULL;
+
+	if (NULL == (tracker = calloc(1, sizeof(*tracker))))
+		return NULL;
+
+	od_shared_table_init(&tracker->shared, path, sizeof(struct od_attempt_table), OD_ATTEMPT_MAGIC,
+			     OD_ATTEMPT_VERSION, kODSharedCreate | kODSharedPrivate, od_attempt_reset);
+	if (NULL == od_shared_table_peek(&tracker->shared)) {
+		od_shared_table_close(&tracker->shared);
+		free(tracker);
+		return NULL;
+	}
+
+	return tracker;
+}
+
+void
+od_attempt_close(struct od_attempt_tracker *tracker)
+{
+	if (NULL == tracker)
+		return;
+
+	od_shared_table_close(&tracker->shared);
+	free(tracker);
+}
+
+/* FNV-1a over the secret and the key material, then a 64 bit finalizer */
+static uint64_t
+od_attempt_hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t
+od_attempt_key(const struct od_attempt_table *table, char kind, const char *user, const char *rhost)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	h = od_attempt_hash_bytes(h, table->secret, sizeof(table->secret));
+	h = od_attempt_hash_bytes(h, &kind, 1);
+	if (NULL != user)
+		h = od_attempt_hash_bytes(h, user, strlen(user) + 1);
+	h = od_attempt_hash_bytes(h, rhost, strlen(rhost) + 1);
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return (0 != h) ? h : 1;
+}
+
+static double
+od_attempt_decayed(const struct od_attempt_entry *entry, uint64_t halflife, uint64_t now)
+{
+	/* an entry from the future was written before the clock restarted */
+	if (0 == entry->key || entry->updated > now)
+		return 0;
+	if (0 == halflife)
+		return entry->score;
+	return entry->score * exp2(-(double)(now - entry->updated) / (double)halflife);
+}
+
+/*
+ * Table must be locked.  The slot holding key, or when create is set one
+ * to hold it: a free or forgotten one, else the smallest counter nearby.
+ */
+static struct od_attempt_entry *
+od_attempt_find(struct od_attempt_table *table, uint64_t key, uint64_t halflife, uint64_t now, bool create)
+{
+	struct od_attempt_entry *entry = NULL, *victim = NULL;
+	double score, lowest = 0;
+	unsigned int i;
+
+	for (i = 0; i < kODAttemptProbe; ++i) {
+		entry = &table->entries[(key + i) % kODAttemptSlots];
+		if (key == entry->key)
+			return entry;
+		if (!create)
+			continue;
+		score = od_attempt_decayed(entry, halflife, now);
+		if (NULL == victim || score < lowest) {
+			victim = entry;
+			lowest = score;
+		}
+	}
+	if (NULL == victim)
+		return NULL;
+
+	if (lowest >= kAttemptForget)
+		++table->evictions;
+	victim->key = key;
+	victim->score = 0;
+	victim->updated = now;
+
+	return victim;
+}
+
+static double
+od_attempt_score(struct od_attempt_table *table, uint64_t key, uint64_t halflife, uint64_t now)
+{
+	struct od_attempt_entry *entry = od_attempt_find(table, key, halflife, now, false);
+
+	return (NULL != entry) ? od_attempt_decayed(entry, halflife, now) : 0;
+}
+
+static void
+od_attempt_add(struct od_attempt_table *table, uint64_t key, uint64_t halflife, uint64_t now)
+{
+	struct od_attempt_entry *entry = od_attempt_find(table, key, halflife, now, true);
+
+	entry->score = od_attempt_decayed(entry, halflife, now) + 1;
+	entry->updated = now;
+}
+
+bool
+od_attempt_blocked(struct od_attempt_tracker *tracker, const char *user, const char *rhost,
+		   const struct od_attempt_params *params)
+{
+	struct od_attempt_table *table = NULL;
+	uint64_t now = od_attempt_now(), pair, source;
+	bool blocked = false;
+
+	if (NULL == tracker || NULL == user || NULL == rhost || NULL == params)
+		return false;
+	if (0 == params->user_limit && 0 == params->source_limit)
+		return false;
+
+	if (NULL == (table = od_shared_table_lock(&tracker->shared)))
+		return false;
+	pair = od_attempt_key(table, 'u', user, rhost);
+	source = od_attempt_key(table, 's', NULL, rhost);
+
+	if (0 != params->user_limit && od_attempt_score(table, pair, params->halflife, now) >= params->user_limit)
+		blocked = true;
+	if (0 != params->source_limit && od_attempt_score(table, source, params->halflife, now) >= params->source_limit)
+		blocked = true;
+
+	/* keep a source that does not let up over its limit */
+	if (blocked) {
+		od_attempt_add(table, pair, params->halflife, now);
+		od_attempt_add(table, source, params->halflife, now);
+		++table->blocked;
+	}
+
+	od_shared_table_unlock(&tracker->shared);
+
+	return blocked;
+}
+
+void
+od_attempt_failed(struct od_attempt_tracker *tracker, const char *user, const char *rhost,
+		  const struct od_attempt_params *params)
+{
+	struct od_attempt_table *table = NULL;
+	uint64_t now = od_attempt_now();
+
+	if (NULL == tracker || NULL == user || NULL == rhost || NULL == params)
+		return;
+
+	if (NULL == (table = od_shared_table_lock(&tracker->shared)))
+		return;
+	od_attempt_add(table, od_attempt_key(table, 'u', user, rhost), params->halflife, now);
+	od_attempt_add(table, od_attempt_key(table, 's', NULL, rhost), params->halflife, now);
+	++table->failures;
+	od_shared_table_unlock(&tracker->shared);
+}
+
+void
+od_attempt_succeeded(struct od_attempt_tracker *tracker, const char *user, const char *rhost)
+{
+	struct od_attempt_table *table = NULL;
+	struct od_attempt_entry *entry = NULL;
+
+	if (NULL == tracker || NULL == user || NULL == rhost)
+		return;
+
+	if (NULL == (table = od_shared_table_lock(&tracker->shared)))
+		return;
+	entry = od_attempt_find(table, od_attempt_key(table, 'u', user, rhost), 0, 0, false);
+	if (NULL != entry)
+		memset(entry, 0, sizeof(*entry));
+	od_shared_table_unlock(&tracker->shared);
+}
+
+/* Counters and table occupancy, for monitoring */
+int
+od_attempt_copy_stats(struct od_attempt_tracker *tracker, struct od_attempt_stats *out)
+{
+	struct od_attempt_table *table = NULL;
+	unsigned int i;
+
+	if (NULL == tracker || NULL == out)
+		return PAM_SERVICE_ERR;
+
+	memset(out, 0, sizeof(*out));
+	if (NULL == (table = od_shared_table_lock(&tracker->shared)))
+		return PAM_SERVICE_ERR;
+	out->failures = table->failures;
+	out->blocked = table->blocked;
+	out->evictions = table->evictions;
+	for (i = 0; i < kODAttemptSlots; ++i) {
+		if (0 != table->entries[i].key)
+			++out->tracked;
+	}
+	od_shared_table_unlock(&tracker->shared);
+
+	return PAM_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+ * Failed authentication attempts by user and remote host, shared by every
+ * process on the system.  Counters decay exponentially, so a source that
+ * stops failing is forgotten on its own; pam_opendirectory refuses sources
+ * over their limit without asking the directory.  Nothing in here depends
+ * on CoreFoundation.
+ */
+
+#ifndef _ATTEMPTTRACKER_H_
+#define _ATTEMPTTRACKER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OD_ATTEMPT_PATH "/var/run/pam_opendirectory.attempts"
+
+enum {
+	kODAttemptSlots  = 4096,
+	kODAttemptProbe  = 16,		/* slots searched for a key before evicting */
+	kODAttemptSecret = 16
+};
+
+struct od_attempt_params {
+	double		user_limit;	/* failures of one user from one host, 0 for no limit */
+	double		source_limit;	/* failures of any user from one host, 0 for no limit */
+	uint64_t	halflife;	/* us for a counter to decay by half */
+};
+
+struct od_attempt_entry {
+	uint64_t	key;		/* keyed hash, 0 for a free slot */
+	double		score;		/* failures as of updated */
+	uint64_t	updated;	/* CLOCK_MONOTONIC us */
+};
+
+struct od_attempt_table {
+	uint32_t	magic;
+	uint32_t	version;
+	uint8_t		secret[kODAttemptSecret];
+	uint64_t	failures;	/* recorded */
+	uint64_t	blocked;	/* refused without a directory call */
+	uint64_t	evictions;
+	struct od_attempt_entry entries[kODAttemptSlots];
+};
+
+struct od_attempt_stats {
+	uint64_t	failures;
+	uint64_t	blocked;
+	uint64_t	evictions;
+	uint32_t	tracked;	/* slots in use */
+};
+
+struct od_attempt_tracker;
+
+/*
+ * Maps the table at path, creating it if needed, or falls back to memory
+ * private to the process when the file cannot be used.
+ */
+struct od_attempt_tracker *od_attempt_open(const char *path);
+void od_attempt_close(struct od_attempt_tracker *);
+
+void od_attempt_default_params(struct od_attempt_params *);
+
+/*
+ * true when user at rhost, or rhost as a whole, is over its limit; the
+ * refused attempt then counts as another failure.
+ */
+bool od_attempt_blocked(struct od_attempt_tracker *, const char *user, const char *rhost,
+			const struct od_attempt_params *);
+void od_attempt_failed(struct od_attempt_tracker *, const char *user, const char *rhost,
+		       const struct od_attempt_params *);
+/* forgets user's failures from rhost; those of the host as a whole stay */
+void od_attempt_succeeded(struct od_attempt_tracker *, const char *user, const char *rhost);
+
+int od_attempt_copy_stats(struct od_attempt_tracker *, struct od_attempt_stats *);
+
+#endif /* _ATTEMPTTRACKER_H_ */
@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "AuthAuthority.h"
+
+/*
+ * Authentication authority values look like "version;tag;data;data;...".
+ * They are split once into a struct od_authauthority: the entry array
+ * followed by a copy of the values in which every ';' has been replaced
+ * by a NUL, so each field slice is also a C string.  Tags match exactly,
+ * except pubkeyhash, which copyHashMatchedKeychain() has always matched
+ * without regard to case.  pam_smartcard's Kerberosv5 lookup is caseless
+ * as well; it compares fields[1] itself so that od_principal_for_user()
+ * keeps its exact match.
+ */
+static const struct {
+	const char	*name;
+	int		tag;
+	bool		caseless;
+} od_authauthority_tags[] = {
+	{ "basic",			kODAuthAuthTagBasic,		false },
+	{ "ShadowHash",			kODAuthAuthTagShadowHash,	false },
+	{ "ApplePasswordServer",	kODAuthAuthTagPasswordServer,	false },
+	{ "Kerberosv5",			kODAuthAuthTagKerberosv5,	false },
+	{ "Kerberosv5Cert",		kODAuthAuthTagKerberosv5Cert,	false },
+	{ "pubkeyhash",			kODAuthAuthTagPubkeyHash,	true },
+	{ "NetLogon",			kODAuthAuthTagNetLogon,		false },
+	{ "LocalCachedUser",		kODAuthAuthTagLocalCachedUser,	false },
+	{ "DisabledUser",		kODAuthAuthTagDisabledUser,	false },
+	{ "SecureToken",		kODAuthAuthTagSecureToken,	false },
+};
+
+static int
+od_authauthority_tag(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(od_authauthority_tags) / sizeof(od_authauthority_tags[0]); ++i) {
+		if (0 == (od_authauthority_tags[i].caseless ? strcasecmp : strcmp)(name, od_authauthority_tags[i].name))
+			return od_authauthority_tags[i].tag;
+	}
+
+	return kODAuthAuthTagUnknown;
+}
+
+struct od_authauthority *
+od_authauthority_parse(const char *const *values, size_t count, size_t *size)
+{
+	struct od_authauthority *aa = NULL;
+	size_t i, total = 0, nvalues = 0, len;
+	char *buffer = NULL;
+	uint32_t offset = 0;
+
+	if (NULL == values || NULL == size)
+		return NULL;
+
+	for (i = 0; i < count; ++i) {
+		if (NULL == values[i])
+			continue;
+		total += strlen(values[i]) + 1;
+		++nvalues;
+	}
+
+	*size = sizeof(*aa) + nvalues * sizeof(aa->entries[0]) + total;
+	aa = calloc(1, *size);
+	if (NULL == aa)
+		return NULL;
+	buffer = (char *)&aa->entries[nvalues];
+
+	for (i = 0; i < count; ++i) {
+		struct od_authauthority_entry *entry = NULL;
+		uint32_t start = offset, pos;
+
+		if (NULL == values[i])
+			continue;
+
+		len = strlen(values[i]);
+		memcpy(buffer + offset, values[i], len);
+		offset += (uint32_t)len;
+		buffer[offset++] = '\0';
+
+		entry = &aa->entries[aa->count++];
+		entry->fields[0].offset = start;
+		entry->nfields = 1;
+		for (pos = start; pos < offset - 1; ++pos) {
+			if (';' != buffer[pos])
+				continue;
+			/* anything past the last slot stays in the last field */
+			if (entry->nfields == kODAuthAuthMaxFields)
+				break;
+			buffer[pos] = '\0';
+			entry->fields[entry->nfields - 1].length = pos - entry->fields[entry->nfields - 1].offset;
+			entry->fields[entry->nfields++].offset = pos + 1;
+		}
+		entry->fields[entry->nfields - 1].length = offset - 1 - entry->fields[entry->nfields - 1].offset;
+		if (entry->nfields > 1)
+			entry->tag = od_authauthority_tag(buffer + entry->fields[1].offset);
+	}
+
+	return aa;
+}
+
+/* Returns "" for fields the entry does not have */
+const char *
+od_authauthority_field(const struct od_authauthority *aa, const struct od_authauthority_entry *entry, unsigned int index)
+{
+	if (NULL == aa || NULL == entry || index >= entry->nfields)
+		return "";
+
+	return (const char *)&aa->entries[aa->count] + entry->fields[index].offset;
+}
+
+/* Next entry after prev (or the first one when prev is NULL) carrying tag */
+const struct od_authauthority_entry *
+od_authauthority_find(const struct od_authauthority *aa, int tag, const struct od_authauthority_entry *prev)
+{
+	const struct od_authauthority_entry *entry = NULL;
+
+	if (NULL == aa)
+		return NULL;
+
+	for (entry = (NULL != prev) ? prev + 1 : aa->entries; entry < &aa->entries[aa->count]; ++entry) {
+		if (entry->tag == tag)
+			return entry;
+	}
+
+	return NULL;
+}
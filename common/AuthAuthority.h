@@ -0,0 +1,56 @@
+/*
+ * Parsed kODAttributeTypeAuthenticationAuthority values.  Nothing in here
+ * depends on CoreFoundation so the parser also builds off macOS.  An
+ * entry's tag says nothing of its version: callers that only accept
+ * unversioned values, like ";DisabledUser;" and ";NetLogon;", check that
+ * fields[0] is empty.
+ */
+
+#ifndef _AUTHAUTHORITY_H_
+#define _AUTHAUTHORITY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	kODAuthAuthTagUnknown = 0,
+	kODAuthAuthTagBasic,
+	kODAuthAuthTagShadowHash,
+	kODAuthAuthTagPasswordServer,
+	kODAuthAuthTagKerberosv5,
+	kODAuthAuthTagKerberosv5Cert,
+	kODAuthAuthTagPubkeyHash,
+	kODAuthAuthTagNetLogon,
+	kODAuthAuthTagLocalCachedUser,
+	kODAuthAuthTagDisabledUser,
+	kODAuthAuthTagSecureToken
+};
+
+enum {
+	kODAuthAuthMaxFields = 8
+};
+
+struct od_authauthority_slice {
+	uint32_t offset;
+	uint32_t length;
+};
+
+/* fields[0] is the version, fields[1] the tag name, then the tag's data */
+struct od_authauthority_entry {
+	int32_t tag;
+	uint32_t nfields;
+	struct od_authauthority_slice fields[kODAuthAuthMaxFields];
+};
+
+struct od_authauthority {
+	uint32_t count;
+	struct od_authauthority_entry entries[];
+	/* followed by the field strings */
+};
+
+/* Returns one malloc()ed block of *size bytes, release it with free() */
+struct od_authauthority *od_authauthority_parse(const char *const *values, size_t count, size_t *size);
+const char *od_authauthority_field(const struct od_authauthority *, const struct od_authauthority_entry *, unsigned int);
+const struct od_authauthority_entry *od_authauthority_find(const struct od_authauthority *, int, const struct od_authauthority_entry *);
+
+#endif /* _AUTHAUTHORITY_H_ */
@@ -0,0 +1,265 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "Backend.h"
+
+struct dir_backend *
+dir_backend_open(const char *spec)
+{
+#ifdef DIR_FILE_BACKEND
+	struct dir_backend *backend = NULL;
+	char *path = NULL, *options = NULL;
+#endif
+
+	if (NULL == spec || 0 == strcmp(spec, "opendirectory")) {
+#ifdef __APPLE__
+		return od_backend_open();
+#else
+		return NULL;
+#endif
+	}
+
+#ifndef DIR_FILE_BACKEND
+	return NULL;
+#else
+	if (0 != strncmp(spec, "file:", 5))
+		return NULL;
+
+	path = strdup(spec + 5);
+	if (NULL == path)
+		return NULL;
+	if (NULL != (options = strchr(path, '?')))
+		*options++ = '\0';
+	backend = dir_file_backend_open(path, options);
+	free(path);
+
+	return backend;
+#endif
+}
+
+void
+dir_backend_close(struct dir_backend *backend)
+{
+	if (NULL != backend)
+		backend->ops->close(backend);
+}
+
+void
+dir_values_free(char **values, size_t count)
+{
+	size_t i;
+
+	if (NULL == values)
+		return;
+	for (i = 0; i < count; ++i)
+		free(values[i]);
+	free(values);
+}
+
+enum {
+	kDirCacheBuckets = 64
+};
+
+struct dir_cache_entry {
+	struct dir_cache_entry	*next;
+	void			*value;
+	uint64_t		expires;
+	int			retval;
+	bool			inflight;
+	bool			linked;
+	unsigned int		refs;
+	char			key[];
+};
+
+struct dir_cache {
+	pthread_mutex_t		lock;
+	pthread_cond_t		done;
+	unsigned int		max_entries;
+	void *			(*retain)(void *);
+	void			(*release)(void *);
+	struct dir_cache_stats	counters;
+	struct dir_cache_entry	*buckets[kDirCacheBuckets];
+};
+
+static uint64_t
+dir_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* FNV-1a */
+static struct dir_cache_entry **
+dir_cache_bucket(struct dir_cache *cache, const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; '\0' != *key; ++key)
+		hash = (hash ^ (uint8_t)*key) * 16777619u;
+
+	return &cache->buckets[hash % kDirCacheBuckets];
+}
+
+struct dir_cache *
+dir_cache_create(unsigned int max_entries, void *(*retain)(void *), void (*release)(void *))
+{
+	struct dir_cache *cache = NULL;
+
+	if (NULL == retain || NULL == release)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (NULL == cache)
+		return NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->done, NULL);
+	cache->max_entries = max_entries;
+	cache->retain = retain;
+	cache->release = release;
+
+	return cache;
+}
+
+/* cache->lock must be held */
+static void
+dir_cache_entry_release(struct dir_cache *cache, struct dir_cache_entry *entry)
+{
+	if (0 != --entry->refs)
+		return;
+	if (NULL != entry->value)
+		cache->release(entry->value);
+	free(entry);
+}
+
+/* cache->lock must be held */
+static void
+dir_cache_remove(struct dir_cache *cache, struct dir_cache_entry *entry)
+{
+	struct dir_cache_entry **link = NULL;
+
+	if (!entry->linked)
+		return;
+
+	for (link = dir_cache_bucket(cache, entry->key); *link != entry; link = &(*link)->next)
+		;
+	*link = entry->next;
+	entry->linked = false;
+	--cache->counters.entries;
+	dir_cache_entry_release(cache, entry);
+}
+
+/* cache->lock must be held */
+static void
+dir_cache_purge(struct dir_cache *cache, uint64_t now)
+{
+	struct dir_cache_entry *entry = NULL, *next = NULL;
+	unsigned int i;
+
+	for (i = 0; i < kDirCacheBuckets; ++i) {
+		for (entry = cache->buckets[i]; NULL != entry; entry = next) {
+			next = entry->next;
+			if (!entry->inflight && entry->expires <= now)
+				dir_cache_remove(cache, entry);
+		}
+	}
+}
+
+int
+dir_cache_lookup(struct dir_cache *cache, const char *key, uint64_t ttl, dir_cache_fetch_t fetch, void *ctx, void **value)
+{
+	int retval = PAM_SERVICE_ERR;
+	struct dir_cache_entry **bucket = NULL, *entry = NULL;
+	uint64_t now = dir_cache_now();
+	size_t keylen;
+
+	if (NULL == cache || NULL == key || NULL == fetch || NULL == value)
+		return PAM_SERVICE_ERR;
+
+	pthread_mutex_lock(&cache->lock);
+
+	bucket = dir_cache_bucket(cache, key);
+	for (entry = *bucket; NULL != entry; entry = entry->next) {
+		if (0 == strcmp(entry->key, key))
+			break;
+	}
+
+	if (NULL != entry && !entry->inflight && entry->expires > now) {
+		++cache->counters.hits;
+		*value = cache->retain(entry->value);
+		pthread_mutex_unlock(&cache->lock);
+		return PAM_SUCCESS;
+	}
+
+	if (NULL != entry && entry->inflight) {
+		++cache->counters.coalesced;
+		++entry->refs;
+		while (entry->inflight)
+			pthread_cond_wait(&cache->done, &cache->lock);
+		retval = entry->retval;
+		if (PAM_SUCCESS == retval)
+			*value = cache->retain(entry->value);
+		dir_cache_entry_release(cache, entry);
+		pthread_mutex_unlock(&cache->lock);
+		return retval;
+	}
+
+	++cache->counters.misses;
+	if (NULL != entry)
+		dir_cache_remove(cache, entry);
+	if (cache->counters.entries >= cache->max_entries)
+		dir_cache_purge(cache, now);
+
+	entry = NULL;
+	keylen = strlen(key);
+	if (cache->counters.entries < cache->max_entries &&
+	    NULL != (entry = calloc(1, sizeof(*entry) + keylen + 1))) {
+		memcpy(entry->key, key, keylen + 1);
+		/* one reference for the table, one for this thread */
+		entry->refs = 2;
+		entry->inflight = true;
+		entry->linked = true;
+		entry->next = *bucket;
+		*bucket = entry;
+		++cache->counters.entries;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	retval = fetch(ctx, key, value);
+	if (NULL == entry)
+		return retval;
+
+	pthread_mutex_lock(&cache->lock);
+	entry->retval = retval;
+	entry->inflight = false;
+	if (PAM_SUCCESS == retval) {
+		entry->value = cache->retain(*value);
+		entry->expires = dir_cache_now() + ttl;
+	} else {
+		dir_cache_remove(cache, entry);
+	}
+	dir_cache_entry_release(cache, entry);
+	pthread_cond_broadcast(&cache->done);
+	pthread_mutex_unlock(&cache->lock);
+
+	return retval;
+}
+
+void
+dir_cache_get_stats(struct dir_cache *cache, struct dir_cache_stats *stats)
+{
+	if (NULL == cache || NULL == stats)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->counters;
+	pthread_mutex_unlock(&cache->lock);
+}
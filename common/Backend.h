@@ -0,0 +1,95 @@
+/*
+ * Directory backends.  A backend looks up user records and answers
+ * attribute, account policy and password questions about them.  The
+ * OpenDirectory backend lives in Common.c; FileBackend.c serves records
+ * from a flat file and, like the record cache below, needs nothing but
+ * POSIX, so both can be built and measured off macOS.  The file backend
+ * is only for the programs in tests/: the modules are built without it
+ * and without DIR_FILE_BACKEND, so they do not accept a "file:" spec.
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* attribute names, the same strings as the matching kODAttributeType constants */
+#define kDirAttrRecordName		"dsAttrTypeStandard:RecordName"
+#define kDirAttrAuthenticationAuthority	"dsAttrTypeStandard:AuthenticationAuthority"
+#define kDirAttrHomeDirectory		"dsAttrTypeStandard:HomeDirectory"
+#define kDirAttrNFSHomeDirectory	"dsAttrTypeStandard:NFSHomeDirectory"
+#define kDirAttrUserShell		"dsAttrTypeStandard:UserShell"
+#define kDirAttrUniqueID		"dsAttrTypeStandard:UniqueID"
+
+struct dir_backend;
+struct od_authauthority;
+
+/*
+ * Every call returns a PAM status.  Records are opaque and owned by the
+ * backend; lookup() hands out a reference that is dropped with release().
+ */
+struct dir_backend_ops {
+	const char	*name;
+	int		(*lookup)(struct dir_backend *, const char *name, void **record);
+	/* *values is NULL if the record has no such attribute, else free it with dir_values_free() */
+	int		(*copy_values)(struct dir_backend *, void *record, const char *attribute, char ***values, size_t *count);
+	/*
+	 * May be NULL, for the first of the values copy_values() returns.  The
+	 * first value, in buf or, when it does not fit, in *allocated for the
+	 * caller to free(); *value is NULL if the record has no such attribute.
+	 */
+	int		(*view_value)(struct dir_backend *, void *record, const char *attribute,
+				      char *buf, size_t buflen, char **value, char **allocated);
+	int		(*check_policy)(struct dir_backend *, void *record);
+	int		(*verify_password)(struct dir_backend *, void *record, const char *password);
+	/* may be NULL, for parsing the values copy_values() returns; see UserRecord.h */
+	int		(*copy_authauthority)(struct dir_backend *, void *record, struct od_authauthority **aa);
+	void *		(*retain)(struct dir_backend *, void *record);
+	void		(*release)(struct dir_backend *, void *record);
+	void		(*close)(struct dir_backend *);
+};
+
+struct dir_backend {
+	const struct dir_backend_ops	*ops;
+	void				*ctx;
+};
+
+/*
+ * spec is "opendirectory" (the default), or with DIR_FILE_BACKEND also
+ * "file:<path>[?<option>=<value>&...]"
+ */
+struct dir_backend *dir_backend_open(const char *spec);
+void dir_backend_close(struct dir_backend *);
+void dir_values_free(char **values, size_t count);
+
+#ifdef DIR_FILE_BACKEND
+struct dir_backend *dir_file_backend_open(const char *path, const char *options);
+#endif
+#ifdef __APPLE__
+/* Without a PAM handle: the async engine's, with the default lookup and policy settings */
+struct dir_backend *od_backend_open(void);
+#endif
+
+/*
+ * Name-keyed cache of reference counted values.  Entries live for the ttl
+ * given to the lookup that filled them.  While a fetch for a key is in
+ * flight, other threads asking for the same key wait for its result
+ * instead of fetching it themselves.  Only successful fetches are kept.
+ */
+struct dir_cache;
+
+struct dir_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t coalesced;	/* misses that waited for a fetch already in flight */
+	uint64_t entries;
+};
+
+typedef int (*dir_cache_fetch_t)(void *ctx, const char *key, void **value);
+
+struct dir_cache *dir_cache_create(unsigned int max_entries, void *(*retain)(void *), void (*release)(void *));
+int dir_cache_lookup(struct dir_cache *, const char *key, uint64_t ttl, dir_cache_fetch_t fetch, void *ctx, void **value);
+void dir_cache_get_stats(struct dir_cache *, struct dir_cache_stats *);
+
+#endif /* _BACKEND_H_ */
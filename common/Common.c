@@ -1,6 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
@@ -13,164 +23,2343 @@
 #include <OpenDirectory/OpenDirectoryPriv.h>
 #include <ServerInformation/ServerInformation.h>
 
+#include "Backend.h"
 #include "Common.h"
 #include "Logging.h"
+#include "SharedTable.h"
+#include "UserRecord.h"
 
 #ifdef PAM_USE_OS_LOG
 PAM_DEFINE_LOG(Common)
 #define PAM_LOG PAM_LOG_Common()
 #endif
 
+/*
+ * A lookup that misses while directory nodes are unreachable is retried with
+ * capped exponential backoff until the per-call deadline ("lookup_timeout"
+ * seconds) runs out.
+ */
 enum {
-	kWaitSeconds       =  1,
-	kMaxIterationCount = 30
+	kRetryInitialDelay    =  100000,	/* us */
+	kRetryMaxDelay        = 2000000,	/* us */
+	kLookupTimeoutDefault =      30	/* s */
 };
 
+static uint64_t
+od_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* when to send a lookup to a second node as well, see od_record_copy_hedged() */
+struct od_hedge {
+	unsigned int	percentile;	/* of recent lookup times, 0 disables hedging */
+	double		rate;		/* hedges per lookup at most */
+	char		node[kODHedgeNodeNameMax];	/* the replica hedged on */
+};
+
+/* per-call settings taken from the calling module's options */
+struct od_lookup_params {
+	uint64_t	ttl;		/* us, 0 disables the process-wide cache */
+	uint64_t	timeout;	/* us */
+	uint64_t	cooldown;	/* us */
+	CFArrayRef	attributes;	/* projection, NULL for kODRecordDefaultAttributes */
+	struct od_admission admission;
+	struct od_hedge hedge;
+};
+
+/* pam_set_data() key for the user records shared by every module in a transaction */
+#define PAM_OD_RECORD_DATA "od_record"
+/* pam_set_data() key for their parsed authentication authorities */
+#define PAM_OD_AUTHAUTHORITY_DATA "od_authauthority"
+/* pam_set_data() key for the attributes the stack declared it will read */
+#define PAM_OD_ATTRIBUTES_DATA "od_record_attributes"
+/* pam_set_data() key for the attributes each record was loaded with */
+#define PAM_OD_PROJECTION_DATA "od_record_projection"
+
 int
 cstring_to_cfstring(const char *val, CFStringRef *buffer)
 {
-	int retval = PAM_BUF_ERR;
+	int retval = PAM_BUF_ERR;
+
+	if (NULL == val || NULL == buffer) {
+		_LOG_DEBUG("NULL argument passed");
+		retval = PAM_SERVICE_ERR;
+		goto cleanup;
+	}
+
+	*buffer = CFStringCreateWithCString(kCFAllocatorDefault, val, kCFStringEncodingUTF8);
+	if (NULL == *buffer) {
+		_LOG_DEBUG("CFStringCreateWithCString() failed");
+		retval = PAM_BUF_ERR;
+		goto cleanup;
+	}
+
+	retval =  PAM_SUCCESS;
+
+cleanup:
+	if (PAM_SUCCESS != retval)
+		_LOG_ERROR("failed: %d", retval);
+
+	return retval;
+}
+
+/*
+ * Borrow a UTF-8 view of val.  The string's own storage is used when it is
+ * already ASCII or UTF-8, then the caller's buffer; only values that do not
+ * fit are copied to the heap, in which case *allocated must be freed.
+ */
+const char *
+cfstring_cstring_view(const CFStringRef val, char *buf, size_t buflen, char **allocated)
+{
+	const char *ptr = NULL;
+	CFIndex len = 0, used = 0;
+	CFRange range;
+
+	if (NULL == val || NULL == allocated) {
+		_LOG_DEBUG("NULL argument passed");
+		return NULL;
+	}
+	*allocated = NULL;
+
+	if (NULL != (ptr = CFStringGetCStringPtr(val, kCFStringEncodingUTF8)) ||
+	    NULL != (ptr = CFStringGetCStringPtr(val, kCFStringEncodingASCII)))
+		return ptr;
+
+	/* UTF-8 never needs fewer bytes than there are UTF-16 units */
+	len = CFStringGetLength(val);
+	if (NULL != buf && (size_t)len < buflen &&
+	    CFStringGetCString(val, buf, (CFIndex)buflen, kCFStringEncodingUTF8))
+		return buf;
+
+	range = CFRangeMake(0, len);
+	if (len != CFStringGetBytes(val, range, kCFStringEncodingUTF8, 0, false, NULL, 0, &used)) {
+		_LOG_DEBUG("CFStringGetBytes failed.");
+		return NULL;
+	}
+	*allocated = malloc(used + 1);
+	if (NULL == *allocated) {
+		_LOG_DEBUG("malloc() failed");
+		return NULL;
+	}
+	CFStringGetBytes(val, range, kCFStringEncodingUTF8, 0, false, (UInt8 *)*allocated, used, NULL);
+	(*allocated)[used] = '\0';
+
+	return *allocated;
+}
+
+int
+cfstring_to_cstring(const CFStringRef val, char **buffer)
+{
+	char stackbuf[CFSTRING_VIEW_BUFSIZE];
+	char *allocated = NULL;
+	const char *view = NULL;
+	int retval = PAM_BUF_ERR;
+
+	if (NULL == val || NULL == buffer) {
+		_LOG_DEBUG("NULL argument passed");
+		retval = PAM_SERVICE_ERR;
+		goto cleanup;
+	}
+
+	view = cfstring_cstring_view(val, stackbuf, sizeof(stackbuf), &allocated);
+	if (NULL == view) {
+		_LOG_DEBUG("cfstring_cstring_view failed.");
+		retval = PAM_BUF_ERR;
+		goto cleanup;
+	}
+
+	/* hand over the heap copy if there is one, otherwise copy exactly what is needed */
+	*buffer = (NULL != allocated) ? allocated : strdup(view);
+	if (NULL == *buffer) {
+		_LOG_DEBUG("strdup() failed");
+		retval = PAM_BUF_ERR;
+		goto cleanup;
+	}
+
+	retval = PAM_SUCCESS;
+
+cleanup:
+	if (PAM_SUCCESS != retval)
+		_LOG_ERROR("failed: %d", retval);
+
+	return retval;
+}
+
+static void
+od_record_data_cleanup(__unused pam_handle_t *pamh, void *data, __unused int pam_end_status)
+{
+	CFReleaseSafe(data);
+}
+
+/*
+ * Every module in a stack (opendirectory, krb5, mount, ntlm, smartcard)
+ * looks up the same user.  The first lookup in a transaction is kept in
+ * the PAM handle and handed out to all later callers.
+ */
+static CFMutableDictionaryRef
+od_record_data_get(pam_handle_t *pamh, bool create)
+{
+	CFMutableDictionaryRef records = NULL;
+
+	if (NULL == pamh)
+		return NULL;
+
+	if (PAM_SUCCESS == pam_get_data(pamh, PAM_OD_RECORD_DATA, (void *)&records) && NULL != records)
+		return records;
+
+	if (!create)
+		return NULL;
+
+	records = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (NULL == records) {
+		_LOG_DEBUG("CFDictionaryCreateMutable() failed");
+		return NULL;
+	}
+	if (PAM_SUCCESS != pam_set_data(pamh, PAM_OD_RECORD_DATA, records, od_record_data_cleanup)) {
+		_LOG_DEBUG("pam_set_data() failed");
+		CFRelease(records);
+		return NULL;
+	}
+
+	return records;
+}
+
+void
+od_record_invalidate(pam_handle_t *pamh)
+{
+	const void *parsed = NULL, *projections = NULL;
+
+	if (NULL != od_record_data_get(pamh, false))
+		pam_set_data(pamh, PAM_OD_RECORD_DATA, NULL, NULL);
+	if (NULL != pamh && PAM_SUCCESS == pam_get_data(pamh, PAM_OD_AUTHAUTHORITY_DATA, &parsed) && NULL != parsed)
+		pam_set_data(pamh, PAM_OD_AUTHAUTHORITY_DATA, NULL, NULL);
+	if (NULL != pamh && PAM_SUCCESS == pam_get_data(pamh, PAM_OD_PROJECTION_DATA, &projections) && NULL != projections)
+		pam_set_data(pamh, PAM_OD_PROJECTION_DATA, NULL, NULL);
+}
+
+/*
+ * The authentication search node is opened once per process and shared by
+ * every lookup.  It is dropped when the directory reports that the node or
+ * its session went away, and forgotten in the child after fork() since the
+ * underlying connection belongs to the parent.
+ */
+static pthread_mutex_t od_search_node_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t od_search_node_once = PTHREAD_ONCE_INIT;
+static ODNodeRef od_search_node = NULL;
+
+static void
+od_search_node_prefork(void)
+{
+	pthread_mutex_lock(&od_search_node_lock);
+}
+
+static void
+od_search_node_postfork_parent(void)
+{
+	pthread_mutex_unlock(&od_search_node_lock);
+}
+
+static void
+od_search_node_postfork_child(void)
+{
+	/* not released: the connection is not ours to tear down */
+	od_search_node = NULL;
+	pthread_mutex_unlock(&od_search_node_lock);
+}
+
+static void
+od_search_node_init(void)
+{
+	od_atfork(od_search_node_prefork, od_search_node_postfork_parent, od_search_node_postfork_child);
+}
+
+static ODNodeRef
+od_search_node_copy(CFErrorRef *cferror)
+{
+	ODNodeRef node = NULL;
+
+	pthread_once(&od_search_node_once, od_search_node_init);
+
+	pthread_mutex_lock(&od_search_node_lock);
+	if (NULL == od_search_node) {
+		od_search_node = ODNodeCreateWithNodeType(kCFAllocatorDefault,
+							  kODSessionDefault,
+							  eDSAuthenticationSearchNodeName,
+							  cferror);
+		if (NULL != od_search_node && NULL != cferror && NULL != *cferror)
+			CFReleaseNull(od_search_node);
+	}
+	if (NULL != od_search_node)
+		node = (ODNodeRef)CFRetain(od_search_node);
+	pthread_mutex_unlock(&od_search_node_lock);
+
+	return node;
+}
+
+static void
+od_search_node_reset(ODNodeRef stale)
+{
+	pthread_mutex_lock(&od_search_node_lock);
+	if (stale == od_search_node)
+		CFReleaseNull(od_search_node);
+	pthread_mutex_unlock(&od_search_node_lock);
+}
+
+static bool
+od_error_node_invalid(CFErrorRef cferror)
+{
+	if (NULL == cferror)
+		return false;
+
+	switch (CFErrorGetCode(cferror)) {
+		case kODErrorSessionDaemonNotRunning:
+		case kODErrorSessionDaemonRefused:
+		case kODErrorNodeUnknownName:
+		case kODErrorNodeConnectionFailed:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Circuit breaker for unreachable directory nodes.  The state of each node
+ * lives in a small table mapped from OD_BREAKER_PATH so that every process
+ * using these modules sees the same view.  A node that is seen unreachable
+ * by kBreakerThreshold lookups in a row trips its breaker.  Lookups then walk
+ * the search path themselves and skip the nodes whose breaker is open, so a
+ * user found further down the path is still found; a miss while nodes are
+ * skipped is not proof that the user does not exist.  Once
+ * "breaker_cooldown" seconds have passed, a single lookup tries the node
+ * again and closes its breaker if it came back.  Processes that cannot open
+ * the shared table keep a private one.
+ */
+#define OD_BREAKER_PATH "/var/run/pam_opendirectory.breaker"
+#define OD_BREAKER_MAGIC 0x6f646272	/* "odbr" */
+
+enum {
+	kBreakerSlots            =  16,
+	kBreakerNodeNameMax      = 128,
+	kBreakerThreshold        =   3,
+	kBreakerCooldownDefault  =  30	/* s */
+};
+
+enum {
+	kBreakerClosed = 0,
+	kBreakerOpen,
+	kBreakerHalfOpen
+};
+
+struct od_breaker_slot {
+	char		node[kBreakerNodeNameMax];
+	uint32_t	state;
+	uint32_t	failures;	/* lookups in a row that found the node unreachable */
+	uint64_t	changed;	/* us, CLOCK_MONOTONIC */
+};
+
+struct od_breaker_table {
+	uint32_t	magic;
+	uint32_t	open;		/* slots not closed, read without the lock */
+	struct od_breaker_slot slots[kBreakerSlots];
+};
+
+static struct od_shared_table od_breaker_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_BREAKER_PATH, sizeof(struct od_breaker_table), OD_BREAKER_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, NULL);
+
+/* returns with the table locked */
+static struct od_breaker_table *
+od_breaker_lock_table(void)
+{
+	return od_shared_table_lock(&od_breaker_shared);
+}
+
+static void
+od_breaker_unlock_table(void)
+{
+	od_shared_table_unlock(&od_breaker_shared);
+}
+
+/* table must be locked */
+static void
+od_breaker_set_state(struct od_breaker_table *table, struct od_breaker_slot *slot, uint32_t state, uint64_t now)
+{
+	if (kBreakerClosed == slot->state && kBreakerClosed != state)
+		++table->open;
+	else if (kBreakerClosed != slot->state && kBreakerClosed == state)
+		--table->open;
+	slot->state = state;
+	slot->changed = now;
+	if (kBreakerClosed == state)
+		slot->failures = 0;
+}
+
+/* table must be locked */
+static struct od_breaker_slot *
+od_breaker_find(struct od_breaker_table *table, CFStringRef name, bool create)
+{
+	char node[kBreakerNodeNameMax];
+	int i;
+
+	if (NULL == name || CFGetTypeID(name) != CFStringGetTypeID() ||
+	    !CFStringGetCString(name, node, sizeof(node), kCFStringEncodingUTF8))
+		return NULL;
+
+	for (i = 0; i < kBreakerSlots; ++i) {
+		if ('\0' != table->slots[i].node[0] && 0 == strcmp(table->slots[i].node, node))
+			return &table->slots[i];
+	}
+	for (i = 0; i < kBreakerSlots && create; ++i) {
+		if ('\0' == table->slots[i].node[0]) {
+			strlcpy(table->slots[i].node, node, sizeof(table->slots[i].node));
+			return &table->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Decide how the next lookup should go.  Returns the names of the nodes it
+ * must skip, or NULL when there are none.  A node whose cooldown has passed
+ * is moved to half-open and left off the list: the caller has been picked to
+ * try it.  *probing is set when that happened.
+ */
+CF_RETURNS_RETAINED
+static CFArrayRef
+od_breaker_enter(uint64_t cooldown, bool *probing)
+{
+	struct od_breaker_table *table = NULL;
+	CFMutableArrayRef skip = NULL;
+	uint64_t now = od_now_usec();
+	int i;
+
+	*probing = false;
+	if (NULL == (table = od_shared_table_peek(&od_breaker_shared)) ||
+	    0 == __atomic_load_n(&table->open, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	if (NULL == (table = od_breaker_lock_table()))
+		return NULL;
+
+	for (i = 0; i < kBreakerSlots; ++i) {
+		struct od_breaker_slot *slot = &table->slots[i];
+		CFStringRef name = NULL;
+
+		if (kBreakerClosed == slot->state)
+			continue;
+		/* a half-open slot whose prober went away is up for grabs again */
+		if (now - slot->changed >= cooldown) {
+			_LOG_DEBUG("probing %s", slot->node);
+			od_breaker_set_state(table, slot, kBreakerHalfOpen, now);
+			*probing = true;
+			continue;
+		}
+		if (NULL == skip && NULL == (skip = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks)))
+			break;
+		name = CFStringCreateWithCString(kCFAllocatorDefault, slot->node, kCFStringEncodingUTF8);
+		if (NULL != name) {
+			CFArrayAppendValue(skip, name);
+			CFRelease(name);
+		}
+	}
+
+	od_breaker_unlock_table();
+
+	return skip;
+}
+
+/* Whether any of the nodes has its breaker open, so waiting for it is pointless */
+static bool
+od_breaker_any_open(CFArrayRef nodes)
+{
+	struct od_breaker_table *table = NULL;
+	struct od_breaker_slot *slot = NULL;
+	CFIndex i, count = (NULL != nodes) ? CFArrayGetCount(nodes) : 0;
+	bool open = false;
+
+	if (0 == count || NULL == (table = od_shared_table_peek(&od_breaker_shared)) ||
+	    0 == __atomic_load_n(&table->open, __ATOMIC_ACQUIRE))
+		return false;
+
+	if (NULL == (table = od_breaker_lock_table()))
+		return false;
+	for (i = 0; i < count && !open; ++i) {
+		slot = od_breaker_find(table, CFArrayGetValueAtIndex(nodes, i), false);
+		open = (NULL != slot && kBreakerOpen == slot->state);
+	}
+	od_breaker_unlock_table();
+
+	return open;
+}
+
+/*
+ * Feed what one lookup ended with, the result of
+ * ODNodeCopyUnreachableSubnodeNames(), into the table; call it once per
+ * lookup however often that retried.  Listed nodes count a failure, and a
+ * half-open one is opened again.  Every other node counts a success: a
+ * half-open breaker is closed and the failure count of a closed one starts
+ * over.  Open breakers this lookup did not try are left alone.
+ */
+static void
+od_breaker_update(CFArrayRef unreachable)
+{
+	struct od_breaker_table *table = NULL;
+	CFIndex i, count = (NULL != unreachable) ? CFArrayGetCount(unreachable) : 0;
+	uint64_t now = od_now_usec();
+	bool seen[kBreakerSlots] = { false };
+	int j;
+
+	if (NULL == (table = od_breaker_lock_table()))
+		return;
+
+	for (i = 0; i < count; ++i) {
+		struct od_breaker_slot *slot = od_breaker_find(table, CFArrayGetValueAtIndex(unreachable, i), true);
+
+		if (NULL == slot || seen[slot - table->slots])
+			continue;
+
+		seen[slot - table->slots] = true;
+		if (kBreakerOpen == slot->state)
+			continue;
+		++slot->failures;
+		if (kBreakerHalfOpen == slot->state || slot->failures >= kBreakerThreshold) {
+			_LOG_DEBUG("breaker for %s open", slot->node);
+			od_breaker_set_state(table, slot, kBreakerOpen, now);
+		}
+	}
+
+	for (j = 0; j < kBreakerSlots; ++j) {
+		struct od_breaker_slot *slot = &table->slots[j];
+
+		if ('\0' == slot->node[0] || seen[j] || kBreakerOpen == slot->state)
+			continue;
+		if (kBreakerHalfOpen == slot->state)
+			_LOG_DEBUG("breaker for %s closed", slot->node);
+		od_breaker_set_state(table, slot, kBreakerClosed, now);
+		slot->node[0] = '\0';
+	}
+
+	od_breaker_unlock_table();
+}
+
+/*
+ * Failed authentications are padded to look like slow successful ones.
+ * How slow that is comes from a histogram of successful authentication
+ * times shared by all processes, kept over two rolling periods: the
+ * blinding window is its 99.9th percentile plus "blinding_margin", within
+ * "blinding_floor" and "blinding_ceiling" (all in ms).  Until enough
+ * successes have been seen the ceiling is used.
+ */
+#define OD_LATENCY_MAGIC 0x6f646c74	/* "odlt" */
+
+enum {
+	kLatencyPeriod          = 600,		/* s */
+	kLatencyMinSamples      = 1000,
+	kBlindingMarginDefault  = 100,		/* ms */
+	kBlindingFloorDefault   = 250,		/* ms */
+	kBlindingCeilingDefault = 2000		/* ms */
+};
+
+static void
+od_latency_reset(void *table)
+{
+	((struct od_latency_histogram *)table)->started = od_now_usec();
+}
+
+static struct od_shared_table od_latency_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_LATENCY_PATH, sizeof(struct od_latency_histogram), OD_LATENCY_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, od_latency_reset);
+
+/* starts a new period once the current one is over; hist must be locked */
+static void
+od_latency_roll(struct od_latency_histogram *hist, uint64_t now)
+{
+	/* a start time in the future means the clock restarted since the file was written */
+	if (OD_LATENCY_MAGIC != hist->magic || hist->started > now ||
+	    now - hist->started >= 2 * (uint64_t)kLatencyPeriod * 1000000) {
+		memset(hist, 0, sizeof(*hist));
+		hist->magic = OD_LATENCY_MAGIC;
+		hist->started = now;
+	} else if (now - hist->started >= (uint64_t)kLatencyPeriod * 1000000) {
+		hist->current ^= 1;
+		memset(hist->counts[hist->current], 0, sizeof(hist->counts[hist->current]));
+		hist->samples[hist->current] = 0;
+		hist->started = now;
+	}
+}
+
+/* returns with the histogram locked and its periods rolled over */
+static struct od_latency_histogram *
+od_latency_lock_table(uint64_t now)
+{
+	struct od_latency_histogram *hist = NULL;
+
+	if (NULL == (hist = od_shared_table_lock(&od_latency_shared)))
+		return NULL;
+	od_latency_roll(hist, now);
+
+	return hist;
+}
+
+static void
+od_latency_unlock_table(void)
+{
+	od_shared_table_unlock(&od_latency_shared);
+}
+
+/* 8 linear buckets per power of two, so each bucket is within 12.5% of its values */
+static unsigned int
+od_latency_bucket(uint64_t usec)
+{
+	unsigned int msb;
+
+	if (usec < 8)
+		return (unsigned int)usec;
+
+	msb = 63 - __builtin_clzll(usec);
+	if (msb > 25)
+		return kODLatencyBuckets - 1;
+
+	return (msb - 2) * 8 + (unsigned int)((usec >> (msb - 3)) & 7);
+}
+
+/* Smallest latency (us) above every value counted in bucket */
+uint64_t
+od_latency_bucket_limit(unsigned int bucket)
+{
+	if (bucket < 8)
+		return bucket + 1;
+
+	return (uint64_t)(9 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/* Upper bound of the permille-th percentile over both periods, rounded up to a bucket */
+static uint64_t
+od_latency_percentile(const struct od_latency_histogram *hist, unsigned int permille)
+{
+	uint64_t total = hist->samples[0] + hist->samples[1];
+	uint64_t rank = total - total * (1000 - permille) / 1000, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < kODLatencyBuckets; ++i) {
+		seen += hist->counts[0][i] + hist->counts[1][i];
+		if (seen >= rank)
+			break;
+	}
+
+	return od_latency_bucket_limit(i < kODLatencyBuckets ? i : kODLatencyBuckets - 1);
+}
+
+void
+od_blinding_record(uint64_t usec)
+{
+	struct od_latency_histogram *hist = od_latency_lock_table(od_now_usec());
+
+	if (NULL == hist)
+		return;
+
+	++hist->counts[hist->current][od_latency_bucket(usec)];
+	++hist->samples[hist->current];
+	od_latency_unlock_table();
+}
+
+static uint64_t
+od_blinding_option(pam_handle_t *pamh, const char *name, uint64_t def)
+{
+	const char *opt = NULL;
+
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, name)))
+		return strtoull(opt, NULL, 10) * 1000;
+
+	return def * 1000;
+}
+
+uint64_t
+od_blinding_window(pam_handle_t *pamh)
+{
+	struct od_latency_histogram *hist = NULL;
+	uint64_t margin = od_blinding_option(pamh, "blinding_margin", kBlindingMarginDefault);
+	uint64_t lower = od_blinding_option(pamh, "blinding_floor", kBlindingFloorDefault);
+	uint64_t upper = od_blinding_option(pamh, "blinding_ceiling", kBlindingCeilingDefault);
+	uint64_t total, window = upper;
+
+	if (lower > upper)
+		lower = upper;
+
+	if (NULL == (hist = od_latency_lock_table(od_now_usec())))
+		return upper;
+
+	total = hist->samples[0] + hist->samples[1];
+	if (total >= kLatencyMinSamples) {
+		window = od_latency_percentile(hist, 999) + margin;
+		if (window < lower)
+			window = lower;
+		if (window > upper)
+			window = upper;
+	}
+	hist->window = window;
+	od_latency_unlock_table();
+
+	_LOG_DEBUG("blinding window %llu us from %llu successful authentications", window, total);
+
+	return window;
+}
+
+/* Snapshot of the shared histogram, for monitoring */
+int
+od_blinding_copy_histogram(struct od_latency_histogram *out)
+{
+	struct od_latency_histogram *hist = NULL;
+
+	if (NULL == out)
+		return PAM_SERVICE_ERR;
+	if (NULL == (hist = od_latency_lock_table(od_now_usec())))
+		return PAM_SERVICE_ERR;
+
+	*out = *hist;
+	od_latency_unlock_table();
+
+	return PAM_SUCCESS;
+}
+
+/*
+ * A directory call run on a thread of its own, so the caller can give up
+ * waiting for it.  Whichever of the thread and the caller finishes last
+ * disposes of the argument.
+ */
+struct od_task {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	refs;
+	bool		done;
+	int		result;
+	int		(*fn)(void *);
+	void		*arg;
+	void		(*dispose)(void *);
+};
+
+static void
+od_task_unref(struct od_task *task)
+{
+	bool last;
+
+	pthread_mutex_lock(&task->lock);
+	last = (0 == --task->refs);
+	pthread_mutex_unlock(&task->lock);
+	if (!last)
+		return;
+
+	if (NULL != task->dispose)
+		task->dispose(task->arg);
+	pthread_cond_destroy(&task->cond);
+	pthread_mutex_destroy(&task->lock);
+	free(task);
+}
+
+static void *
+od_task_main(void *arg)
+{
+	struct od_task *task = arg;
+	int result = task->fn(task->arg);
+
+	pthread_mutex_lock(&task->lock);
+	task->result = result;
+	task->done = true;
+	pthread_cond_broadcast(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+	od_task_unref(task);
+
+	return NULL;
+}
+
+struct od_task *
+od_task_start(int (*fn)(void *), void *arg, void (*dispose)(void *))
+{
+	struct od_task *task = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (NULL == fn || NULL == (task = calloc(1, sizeof(*task))))
+		return NULL;
+
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->cond, NULL);
+	task->refs = 2;
+	task->fn = fn;
+	task->arg = arg;
+	task->dispose = dispose;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, od_task_main, task);
+	pthread_attr_destroy(&attr);
+	if (0 != err) {
+		_LOG_ERROR("unable to start a directory task: %d", err);
+		/* the caller still owns arg */
+		pthread_cond_destroy(&task->cond);
+		pthread_mutex_destroy(&task->lock);
+		free(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+/* PAM_SUCCESS with *result set once the task is done, PAM_AUTHINFO_UNAVAIL if it is still running */
+int
+od_task_wait(struct od_task *task, uint64_t timeout, int *result)
+{
+	struct timespec deadline;
+	uint64_t usec;
+	int retval;
+
+	if (NULL == task)
+		return PAM_SERVICE_ERR;
+
+	/* condition variables time out on the wall clock */
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	usec = (uint64_t)deadline.tv_nsec / 1000 + timeout;
+	deadline.tv_sec += usec / 1000000;
+	deadline.tv_nsec = (usec % 1000000) * 1000;
+
+	pthread_mutex_lock(&task->lock);
+	while (!task->done) {
+		if (kODTaskWaitForever == timeout)
+			pthread_cond_wait(&task->cond, &task->lock);
+		else if (ETIMEDOUT == pthread_cond_timedwait(&task->cond, &task->lock, &deadline))
+			break;
+	}
+	retval = task->done ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL;
+	if (task->done && NULL != result)
+		*result = task->result;
+	pthread_mutex_unlock(&task->lock);
+
+	return retval;
+}
+
+/* the task's argument must not be touched after this */
+void
+od_task_release(struct od_task *task)
+{
+	if (NULL != task)
+		od_task_unref(task);
+}
+
+/*
+ * Admission control for the blocking directory calls.  With
+ * "admission_limit" set, at most that many of them run at once across the
+ * system; without it nobody is held back.  Callers
+ * beyond that queue in a table shared by all processes and are admitted
+ * by priority class, oldest first within a class.  A caller still queued
+ * after "admission_deadline" ms gives up with PAM_AUTHINFO_UNAVAIL rather
+ * than add to the load.  Entries of processes that died, or that have run
+ * longer than kAdmissionLease, are reclaimed.
+ */
+#define OD_ADMISSION_MAGIC 0x6f646163	/* "odac" */
+
+enum {
+	kAdmissionFree = 0,
+	kAdmissionWaiting,
+	kAdmissionRunning
+};
+
+enum {
+	kAdmissionDeadlineDefault = 5000,	/* ms */
+	kAdmissionPoll            = 5000,	/* us */
+	kAdmissionLease           =  120	/* s */
+};
+
+struct od_admission_entry {
+	uint64_t	ticket;
+	uint64_t	since;		/* us, CLOCK_MONOTONIC, queued or admitted */
+	int32_t		pid;
+	uint16_t	state;
+	uint16_t	priority;
+};
+
+struct od_admission_table {
+	uint32_t	magic;
+	uint32_t	peak_depth;
+	uint64_t	next_ticket;
+	struct od_admission_stats_class classes[kODAdmissionClasses];
+	struct od_admission_entry entries[kODAdmissionEntries];
+};
+
+static void
+od_admission_reset(void *table)
+{
+	((struct od_admission_table *)table)->next_ticket = 1;
+}
+
+static struct od_shared_table od_admission_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_ADMISSION_PATH, sizeof(struct od_admission_table), OD_ADMISSION_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, od_admission_reset);
+
+/* returns with the table locked */
+static struct od_admission_table *
+od_admission_lock_table(void)
+{
+	return od_shared_table_lock(&od_admission_shared);
+}
+
+static void
+od_admission_unlock_table(void)
+{
+	od_shared_table_unlock(&od_admission_shared);
+}
+
+/* table must be locked; frees entries whose owner is gone and counts the rest */
+static void
+od_admission_reap(struct od_admission_table *table, uint64_t now, unsigned int *running, unsigned int *waiting)
+{
+	struct od_admission_entry *entry = NULL;
+	int i;
+
+	*running = *waiting = 0;
+	for (i = 0; i < kODAdmissionEntries; ++i) {
+		entry = &table->entries[i];
+		if (kAdmissionFree == entry->state)
+			continue;
+		if ((0 != kill(entry->pid, 0) && ESRCH == errno) ||
+		    (kAdmissionRunning == entry->state && now - entry->since >= (uint64_t)kAdmissionLease * 1000000)) {
+			_LOG_DEBUG("reclaiming admission entry of process %d", entry->pid);
+			entry->state = kAdmissionFree;
+			continue;
+		}
+		if (kAdmissionRunning == entry->state)
+			++*running;
+		else
+			++*waiting;
+	}
+}
+
+/* table must be locked; how many queued entries go before self */
+static unsigned int
+od_admission_ahead(const struct od_admission_table *table, const struct od_admission_entry *self)
+{
+	const struct od_admission_entry *entry = NULL;
+	unsigned int ahead = 0;
+	int i;
+
+	for (i = 0; i < kODAdmissionEntries; ++i) {
+		entry = &table->entries[i];
+		if (kAdmissionWaiting != entry->state || entry == self)
+			continue;
+		if (entry->priority < self->priority ||
+		    (entry->priority == self->priority && entry->ticket < self->ticket))
+			++ahead;
+	}
+
+	return ahead;
+}
+
+static const struct {
+	const char	*service;
+	int		priority;
+} od_admission_services[] = {
+	{ "loginwindow",	kODAdmissionInteractive },
+	{ "screensaver",	kODAdmissionInteractive },
+	{ "authorization",	kODAdmissionInteractive },
+	{ "login",		kODAdmissionInteractive },
+	{ "sshd",		kODAdmissionInteractive },
+	{ "cron",		kODAdmissionBatch },
+	{ "atrun",		kODAdmissionBatch },
+	{ "sudo",		kODAdmissionBatch },
+};
+
+static const struct od_admission od_admission_defaults = {
+	.priority = kODAdmissionNormal,
+	.limit = 0,
+	.deadline = (uint64_t)kAdmissionDeadlineDefault * 1000,
+};
+
+/*
+ * Settings for the calling module.  The class comes from the
+ * "admission_priority" option (interactive, normal or batch), else from
+ * the service name.
+ */
+void
+od_admission_init(pam_handle_t *pamh, struct od_admission *admission)
+{
+	const char *opt = NULL;
+	const void *service = NULL;
+	size_t i;
+
+	*admission = od_admission_defaults;
+	if (NULL == pamh)
+		return;
+
+	if (NULL != (opt = openpam_get_option(pamh, "admission_limit")))
+		admission->limit = (unsigned int)strtoul(opt, NULL, 10);
+	if (NULL != (opt = openpam_get_option(pamh, "admission_deadline")))
+		admission->deadline = strtoull(opt, NULL, 10) * 1000;
+
+	if (NULL != (opt = openpam_get_option(pamh, "admission_priority"))) {
+		if (0 == strcmp(opt, "interactive"))
+			admission->priority = kODAdmissionInteractive;
+		else if (0 == strcmp(opt, "batch"))
+			admission->priority = kODAdmissionBatch;
+		return;
+	}
+	if (PAM_SUCCESS != pam_get_item(pamh, PAM_SERVICE, &service) || NULL == service)
+		return;
+	for (i = 0; i < sizeof(od_admission_services) / sizeof(od_admission_services[0]); ++i) {
+		if (0 == strcmp(od_admission_services[i].service, service)) {
+			admission->priority = od_admission_services[i].priority;
+			break;
+		}
+	}
+}
+
+/*
+ * Waits for a turn to call the directory.  Returns PAM_SUCCESS with *ticket
+ * to hand to od_admission_leave(), or PAM_AUTHINFO_UNAVAIL when the queue
+ * is full or the deadline passed.  A limit of 0 admits everyone.
+ */
+int
+od_admission_enter(const struct od_admission *admission, uint64_t *ticket)
+{
+	struct od_admission_table *table = NULL;
+	struct od_admission_entry *self = NULL;
+	struct od_admission_stats_class *stats = NULL;
+	uint64_t start = od_now_usec(), now = start;
+	unsigned int running = 0, waiting = 0;
+	int priority = admission->priority;
+	int i;
+
+	*ticket = 0;
+	if (0 == admission->limit)
+		return PAM_SUCCESS;
+	if (priority < 0 || priority >= kODAdmissionClasses)
+		priority = kODAdmissionNormal;
+	if (NULL == (table = od_admission_lock_table()))
+		return PAM_SUCCESS;
+	stats = &table->classes[priority];
+
+	od_admission_reap(table, now, &running, &waiting);
+	for (i = 0; i < kODAdmissionEntries && NULL == self; ++i) {
+		if (kAdmissionFree == table->entries[i].state)
+			self = &table->entries[i];
+	}
+	if (NULL == self) {
+		++stats->rejected;
+		od_admission_unlock_table();
+		_LOG_ERROR("directory admission queue full");
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	self->ticket = table->next_ticket++;
+	self->since = now;
+	self->pid = getpid();
+	self->priority = (uint16_t)priority;
+	self->state = kAdmissionWaiting;
+	if (waiting + 1 > table->peak_depth)
+		table->peak_depth = waiting + 1;
+
+	for (;;) {
+		if (running + od_admission_ahead(table, self) < admission->limit) {
+			self->state = kAdmissionRunning;
+			self->since = now;
+			*ticket = self->ticket;
+			++stats->admitted;
+			stats->wait_usec += now - start;
+			if (now - start > stats->max_wait_usec)
+				stats->max_wait_usec = now - start;
+			od_admission_unlock_table();
+			if (now != start)
+				_LOG_DEBUG("admitted after %llu us in a queue of %u", now - start, waiting);
+			return PAM_SUCCESS;
+		}
+		if (now - start >= admission->deadline) {
+			self->state = kAdmissionFree;
+			++stats->rejected;
+			od_admission_unlock_table();
+			_LOG_ERROR("gave up on the directory after %llu us in a queue of %u", now - start, waiting);
+			return PAM_AUTHINFO_UNAVAIL;
+		}
+		od_admission_unlock_table();
+
+		usleep(kAdmissionPoll / 2 + arc4random_uniform(kAdmissionPoll / 2 + 1));
+
+		now = od_now_usec();
+		if (NULL == (table = od_admission_lock_table()))
+			return PAM_SUCCESS;
+		od_admission_reap(table, now, &running, &waiting);
+	}
+}
+
+void
+od_admission_leave(uint64_t ticket)
+{
+	struct od_admission_table *table = NULL;
+	int i;
+
+	if (0 == ticket || NULL == (table = od_admission_lock_table()))
+		return;
+
+	for (i = 0; i < kODAdmissionEntries; ++i) {
+		if (ticket == table->entries[i].ticket && kAdmissionRunning == table->entries[i].state) {
+			table->entries[i].state = kAdmissionFree;
+			break;
+		}
+	}
+	od_admission_unlock_table();
+}
+
+/* Queue depth, concurrency and per-class waits, for monitoring */
+int
+od_admission_copy_stats(struct od_admission_stats *out)
+{
+	struct od_admission_table *table = NULL;
+	unsigned int running = 0, waiting = 0;
+
+	if (NULL == out)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_admission_lock_table()))
+		return PAM_SERVICE_ERR;
+
+	od_admission_reap(table, od_now_usec(), &running, &waiting);
+	out->running = running;
+	out->depth = waiting;
+	out->peak_depth = table->peak_depth;
+	memcpy(out->classes, table->classes, sizeof(out->classes));
+	od_admission_unlock_table();
+
+	return PAM_SUCCESS;
+}
+
+/*
+ * Membership cache refreshes.  Every account check used to reset the
+ * membership cache TTL of the user's UID; a table shared by all processes
+ * remembers when each UID was last refreshed, and with what TTL, so a
+ * refresh within "refresh_coalesce" percent of the TTL of the last one is
+ * skipped.
+ */
+#define OD_MEMBERSHIP_MAGIC 0x6f646d62	/* "odmb" */
+
+enum {
+	kMembershipSlots           = 256,
+	kMembershipCoalesceDefault = 10	/* % of the TTL */
+};
+
+struct od_membership_slot {
+	uint32_t	uid;
+	uint32_t	ttl;		/* s, 0 for a free slot */
+	uint64_t	refreshed;	/* us, CLOCK_MONOTONIC */
+};
+
+struct od_membership_table {
+	uint32_t	magic;
+	uint32_t	reserved;
+	struct od_membership_stats stats;
+	struct od_membership_slot slots[kMembershipSlots];
+};
+
+static struct od_shared_table od_membership_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_MEMBERSHIP_PATH, sizeof(struct od_membership_table), OD_MEMBERSHIP_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, NULL);
+
+/* returns with the table locked */
+static struct od_membership_table *
+od_membership_lock_table(void)
+{
+	return od_shared_table_lock(&od_membership_shared);
+}
+
+static void
+od_membership_unlock_table(void)
+{
+	od_shared_table_unlock(&od_membership_shared);
+}
+
+/*
+ * Whether uid's membership TTL should be set to ttl seconds now.  A yes is
+ * recorded as a refresh, so the caller must go on to make it.
+ */
+bool
+od_membership_refresh_due(pam_handle_t *pamh, uid_t uid, unsigned int ttl)
+{
+	struct od_membership_table *table = NULL;
+	struct od_membership_slot *slot = NULL, *oldest = NULL;
+	const char *opt = NULL;
+	uint64_t now = od_now_usec(), window;
+	unsigned long coalesce = kMembershipCoalesceDefault;
+	bool due = true;
+	int i;
+
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, "refresh_coalesce")))
+		coalesce = strtoul(opt, NULL, 10);
+	if (coalesce > 100)
+		coalesce = 100;
+	window = (uint64_t)ttl * 1000000 * coalesce / 100;
+
+	if (NULL == (table = od_membership_lock_table()))
+		return true;
+
+	for (i = 0; i < kMembershipSlots && NULL == slot; ++i) {
+		if (0 != table->slots[i].ttl && uid == table->slots[i].uid)
+			slot = &table->slots[i];
+		else if (NULL == oldest || table->slots[i].refreshed < oldest->refreshed)
+			oldest = &table->slots[i];
+	}
+
+	/* a refresh from before the clock restarted, or with another TTL, does not count */
+	if (NULL != slot && ttl == slot->ttl && slot->refreshed <= now && now - slot->refreshed < window)
+		due = false;
+
+	if (due) {
+		if (NULL == slot)
+			slot = oldest;
+		slot->uid = (uint32_t)uid;
+		slot->ttl = ttl;
+		slot->refreshed = now;
+		++table->stats.issued;
+	} else {
+		++table->stats.skipped;
+	}
+	od_membership_unlock_table();
+
+	return due;
+}
+
+/* Refreshes issued and skipped, for monitoring */
+int
+od_membership_copy_stats(struct od_membership_stats *out)
+{
+	struct od_membership_table *table = NULL;
+
+	if (NULL == out)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_membership_lock_table()))
+		return PAM_SERVICE_ERR;
+
+	*out = table->stats;
+	od_membership_unlock_table();
+
+	return PAM_SUCCESS;
+}
+
+/*
+ * Hedged lookups.  With "hedge_lookups", a record lookup on the search
+ * path that has not answered within the "hedge_percentile" (95th by
+ * default) of recent lookup times is also sent to "hedge_node", a replica
+ * of the first directory node in the search path, and whichever finds the
+ * record first wins.  The hedge asks the local nodes ahead of that node
+ * first, so it finds the same record the search path would; a miss is
+ * always left to the search path.  Hedges are capped at "hedge_rate"
+ * percent of lookups (5 by default), with a small burst allowance, so a
+ * slow directory does not get twice the load, and wait for admission like
+ * any other lookup.  Lookup times, the allowance and per-node hedge counts
+ * are shared by all processes in OD_HEDGE_PATH.
+ */
+#define OD_HEDGE_MAGIC 0x6f646864	/* "odhd" */
+
+enum {
+	kHedgePercentileDefault = 95,
+	kHedgeRateDefault       = 5,	/* % of lookups */
+	kHedgeBurst             = 5,
+	kHedgeMinSamples        = 100
+};
+
+struct od_hedge_table {
+	uint32_t	magic;
+	uint32_t	reserved;
+	double		tokens;		/* hedges that may be sent right now */
+	struct od_hedge_stats stats;
+	struct od_latency_histogram latency;	/* search path lookups */
+};
+
+static void
+od_hedge_reset(void *table)
+{
+	((struct od_hedge_table *)table)->tokens = kHedgeBurst;
+}
+
+static struct od_shared_table od_hedge_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_HEDGE_PATH, sizeof(struct od_hedge_table), OD_HEDGE_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, od_hedge_reset);
+
+/* returns with the table locked and its periods rolled over */
+static struct od_hedge_table *
+od_hedge_lock_table(uint64_t now)
+{
+	struct od_hedge_table *table = NULL;
+
+	if (NULL == (table = od_shared_table_lock(&od_hedge_shared)))
+		return NULL;
+	od_latency_roll(&table->latency, now);
+
+	return table;
+}
+
+static void
+od_hedge_unlock_table(void)
+{
+	od_shared_table_unlock(&od_hedge_shared);
+}
+
+static void
+od_hedge_init(pam_handle_t *pamh, struct od_hedge *hedge)
+{
+	const char *opt = NULL;
+
+	hedge->percentile = 0;
+	hedge->rate = 0;
+	hedge->node[0] = '\0';
+	if (NULL == pamh || NULL == openpam_get_option(pamh, "hedge_lookups"))
+		return;
+	if (NULL == (opt = openpam_get_option(pamh, "hedge_node")) ||
+	    strlcpy(hedge->node, opt, sizeof(hedge->node)) >= sizeof(hedge->node)) {
+		_LOG_DEBUG("hedge_lookups without a usable hedge_node, not hedging");
+		hedge->node[0] = '\0';
+		return;
+	}
+
+	hedge->percentile = kHedgePercentileDefault;
+	hedge->rate = kHedgeRateDefault / 100.0;
+	if (NULL != (opt = openpam_get_option(pamh, "hedge_percentile")))
+		hedge->percentile = (unsigned int)strtoul(opt, NULL, 10);
+	if (NULL != (opt = openpam_get_option(pamh, "hedge_rate")))
+		hedge->rate = strtod(opt, NULL) / 100;
+	if (hedge->percentile > 99)
+		hedge->percentile = 99;
+}
+
+/* table must be locked; the node's slot, taking a free one if it has none */
+static struct od_hedge_node_stats *
+od_hedge_node_slot(struct od_hedge_table *table, const char *node)
+{
+	int i;
+
+	for (i = 0; i < kODHedgeNodes; ++i) {
+		if (0 == strcmp(table->stats.nodes[i].node, node))
+			return &table->stats.nodes[i];
+	}
+	for (i = 0; i < kODHedgeNodes; ++i) {
+		if ('\0' == table->stats.nodes[i].node[0]) {
+			strlcpy(table->stats.nodes[i].node, node, sizeof(table->stats.nodes[i].node));
+			return &table->stats.nodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Counts a hedged lookup and returns how long (us) to wait before hedging it, 0 for not at all */
+static uint64_t
+od_hedge_begin(const struct od_hedge *hedge)
+{
+	struct od_hedge_table *table = NULL;
+	uint64_t delay = 0;
+
+	if (NULL == (table = od_hedge_lock_table(od_now_usec())))
+		return 0;
+
+	++table->stats.lookups;
+	table->tokens += hedge->rate;
+	if (table->tokens > kHedgeBurst)
+		table->tokens = kHedgeBurst;
+	/* no guessing at a percentile from a handful of lookups */
+	if (table->latency.samples[0] + table->latency.samples[1] >= kHedgeMinSamples) {
+		delay = od_latency_percentile(&table->latency, hedge->percentile * 10);
+		table->stats.delay = delay;
+	}
+	od_hedge_unlock_table();
+
+	return delay;
+}
+
+static void
+od_hedge_record(uint64_t usec)
+{
+	struct od_hedge_table *table = od_hedge_lock_table(od_now_usec());
+
+	if (NULL == table)
+		return;
+
+	++table->latency.counts[table->latency.current][od_latency_bucket(usec)];
+	++table->latency.samples[table->latency.current];
+	od_hedge_unlock_table();
+}
+
+/* takes a hedge from the allowance, if there is one left */
+static bool
+od_hedge_allow(const char *node)
+{
+	struct od_hedge_table *table = NULL;
+	struct od_hedge_node_stats *slot = NULL;
+	bool allowed = false;
+
+	if (NULL == (table = od_hedge_lock_table(od_now_usec())))
+		return false;
+
+	if (table->tokens >= 1) {
+		table->tokens -= 1;
+		++table->stats.hedges;
+		if (NULL != (slot = od_hedge_node_slot(table, node)))
+			++slot->hedges;
+		allowed = true;
+	} else {
+		++table->stats.capped;
+	}
+	od_hedge_unlock_table();
+
+	return allowed;
+}
+
+static void
+od_hedge_won(const char *node)
+{
+	struct od_hedge_table *table = NULL;
+	struct od_hedge_node_stats *slot = NULL;
+
+	if (NULL == (table = od_hedge_lock_table(od_now_usec())))
+		return;
+
+	if (NULL != (slot = od_hedge_node_slot(table, node))) {
+		++slot->wins;
+		_LOG_DEBUG("hedge on %s won, %llu of %llu", node, slot->wins, slot->hedges);
+	}
+	od_hedge_unlock_table();
+}
+
+/* Lookup and hedge counts and the current delay, for monitoring */
+int
+od_hedge_copy_stats(struct od_hedge_stats *out)
+{
+	struct od_hedge_table *table = NULL;
+
+	if (NULL == out)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_hedge_lock_table(od_now_usec())))
+		return PAM_SERVICE_ERR;
+
+	*out = table->stats;
+	od_hedge_unlock_table();
+
+	return PAM_SUCCESS;
+}
+
+/*
+ * The lookups of one hedged request.  Each runs on a task of its own,
+ * holds a reference and takes an admission ticket of its own, so a lookup
+ * abandoned by the caller still counts against the limit until it is
+ * back.  The first record found is kept and the rest dropped when they
+ * come in.  A lookup that is still running when the caller returns cannot
+ * be interrupted and is abandoned the same way; one admitted only after
+ * the race was decided does not call the directory at all.
+ */
+struct od_hedge_race {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	refs;
+	unsigned int	running;	/* lookups not back yet */
+	ODRecordRef	record;		/* first one found */
+	bool		hedge_won;
+	CFErrorRef	error;		/* from the search path */
+	int		status;		/* of the search path's admission */
+	ODNodeRef	search;
+	CFStringRef	cfUser;
+	CFArrayRef	attrs;
+	struct od_admission admission;
+};
+
+struct od_hedge_lookup {
+	struct od_hedge_race *race;
+	ODNodeRef	node;
+	bool		hedge;		/* false for the search path */
+};
+
+static void
+od_hedge_race_unref(struct od_hedge_race *race)
+{
+	bool last;
+
+	pthread_mutex_lock(&race->lock);
+	last = (0 == --race->refs);
+	pthread_mutex_unlock(&race->lock);
+	if (!last)
+		return;
+
+	CFReleaseSafe(race->record);
+	CFReleaseSafe(race->error);
+	CFReleaseSafe(race->search);
+	CFReleaseSafe(race->cfUser);
+	CFReleaseSafe(race->attrs);
+	pthread_cond_destroy(&race->cond);
+	pthread_mutex_destroy(&race->lock);
+	free(race);
+}
+
+/*
+ * The hedge's answer: the record from the local nodes ahead of the first
+ * directory node in the search path, as the search path would find it,
+ * else from the replica.  NULL when the search path has no directory node.
+ */
+CF_RETURNS_RETAINED
+static ODRecordRef
+od_hedge_copy_record(struct od_hedge_race *race, ODNodeRef replica)
+{
+	CFArrayRef names = ODNodeCopySubnodeNames(race->search, NULL);
+	ODRecordRef record = NULL;
+	CFIndex i, count;
+	bool directory = false;
+
+	count = (NULL != names) ? CFArrayGetCount(names) : 0;
+	for (i = 0; i < count && NULL == record && !directory; ++i) {
+		CFStringRef name = CFArrayGetValueAtIndex(names, i);
+		ODNodeRef node = NULL;
+
+		if (NULL == name || CFGetTypeID(name) != CFStringGetTypeID())
+			continue;
+		if (!CFStringHasPrefix(name, CFSTR("/Local/"))) {
+			directory = true;
+		} else if (NULL != (node = ODNodeCreateWithName(kCFAllocatorDefault, kODSessionDefault, name, NULL))) {
+			record = ODNodeCopyRecord(node, kODRecordTypeUsers, race->cfUser, race->attrs, NULL);
+			CFRelease(node);
+		}
+	}
+	CFReleaseSafe(names);
+	if (NULL != record || !directory)
+		return record;
+
+	return ODNodeCopyRecord(replica, kODRecordTypeUsers, race->cfUser, race->attrs, NULL);
+}
+
+static int
+od_hedge_lookup_main(void *arg)
+{
+	struct od_hedge_lookup *lookup = arg;
+	struct od_hedge_race *race = lookup->race;
+	CFErrorRef error = NULL;
+	uint64_t start = 0, ticket = 0;
+	ODRecordRef record = NULL;
+	int status;
+	bool decided;
+
+	status = od_admission_enter(&race->admission, &ticket);
+	pthread_mutex_lock(&race->lock);
+	decided = (NULL != race->record);
+	pthread_mutex_unlock(&race->lock);
+
+	if (PAM_SUCCESS != status) {
+		_LOG_DEBUG("%s not admitted", lookup->hedge ? "hedge" : "lookup");
+	} else if (!decided) {
+		start = od_now_usec();
+		if (lookup->hedge)
+			record = od_hedge_copy_record(race, lookup->node);
+		else
+			record = ODNodeCopyRecord(lookup->node, kODRecordTypeUsers, race->cfUser, race->attrs, &error);
+		/* slow answers count too, even when a hedge already won */
+		if (!lookup->hedge)
+			od_hedge_record(od_now_usec() - start);
+	}
+	od_admission_leave(ticket);
+
+	pthread_mutex_lock(&race->lock);
+	if (NULL != record && NULL == race->record) {
+		race->record = record;
+		race->hedge_won = lookup->hedge;
+		record = NULL;
+	}
+	if (!lookup->hedge) {
+		race->status = status;
+		race->error = error;
+		error = NULL;
+	}
+	--race->running;
+	pthread_cond_broadcast(&race->cond);
+	pthread_mutex_unlock(&race->lock);
+
+	CFReleaseSafe(record);
+	CFReleaseSafe(error);
+
+	return PAM_SUCCESS;
+}
+
+static void
+od_hedge_lookup_dispose(void *arg)
+{
+	struct od_hedge_lookup *lookup = arg;
+
+	CFReleaseSafe(lookup->node);
+	od_hedge_race_unref(lookup->race);
+	free(lookup);
+}
+
+static bool
+od_hedge_race_start(struct od_hedge_race *race, ODNodeRef node, bool hedge)
+{
+	struct od_hedge_lookup *lookup = NULL;
+	struct od_task *task = NULL;
+
+	if (NULL == (lookup = calloc(1, sizeof(*lookup))))
+		return false;
+	lookup->race = race;
+	lookup->node = (ODNodeRef)CFRetain(node);
+	lookup->hedge = hedge;
+
+	pthread_mutex_lock(&race->lock);
+	++race->refs;
+	++race->running;
+	pthread_mutex_unlock(&race->lock);
+
+	if (NULL == (task = od_task_start(od_hedge_lookup_main, lookup, od_hedge_lookup_dispose))) {
+		pthread_mutex_lock(&race->lock);
+		--race->running;
+		pthread_mutex_unlock(&race->lock);
+		od_hedge_lookup_dispose(lookup);
+		return false;
+	}
+	/* the race is what gets waited on */
+	od_task_release(task);
+
+	return true;
+}
+
+/* true once a record was found or every lookup is back */
+static bool
+od_hedge_race_wait(struct od_hedge_race *race, uint64_t timeout)
+{
+	struct timespec deadline;
+	uint64_t usec;
+	bool settled;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	usec = (uint64_t)deadline.tv_nsec / 1000 + timeout;
+	deadline.tv_sec += usec / 1000000;
+	deadline.tv_nsec = (usec % 1000000) * 1000;
+
+	pthread_mutex_lock(&race->lock);
+	while (NULL == race->record && 0 != race->running) {
+		if (kODTaskWaitForever == timeout)
+			pthread_cond_wait(&race->cond, &race->lock);
+		else if (ETIMEDOUT == pthread_cond_timedwait(&race->cond, &race->lock, &deadline))
+			break;
+	}
+	settled = (NULL != race->record || 0 == race->running);
+	pthread_mutex_unlock(&race->lock);
+
+	return settled;
+}
+
+/* ODNodeCopyRecord() under an admission ticket; *status says whether it was admitted */
+CF_RETURNS_RETAINED
+static ODRecordRef
+od_record_copy_admitted(ODNodeRef cfNode, CFStringRef cfUser, CFArrayRef attrs,
+			const struct od_admission *admission, int *status, CFErrorRef *cferror)
+{
+	ODRecordRef record = NULL;
+	uint64_t ticket = 0;
+
+	if (PAM_SUCCESS != (*status = od_admission_enter(admission, &ticket)))
+		return NULL;
+	record = ODNodeCopyRecord(cfNode, kODRecordTypeUsers, cfUser, attrs, cferror);
+	od_admission_leave(ticket);
+
+	return record;
+}
+
+/*
+ * ODNodeCopyRecord() on the search node, hedged on the replica once it is
+ * slow.  Each lookup is admitted on its own; *status is not PAM_SUCCESS
+ * when no record was found because the search path was not admitted.
+ */
+CF_RETURNS_RETAINED
+static ODRecordRef
+od_record_copy_hedged(ODNodeRef cfNode, CFStringRef cfUser, CFArrayRef attrs, const struct od_hedge *hedge,
+		      const struct od_admission *admission, int *status, CFErrorRef *cferror)
+{
+	struct od_hedge_race *race = NULL;
+	ODRecordRef record = NULL;
+	CFStringRef hedgeName = NULL;
+	ODNodeRef hedgeNode = NULL;
+	const char *node = hedge->node;
+	uint64_t delay = od_hedge_begin(hedge);
+	bool hedge_won = false;
+
+	*status = PAM_SUCCESS;
+	if (NULL == (race = calloc(1, sizeof(*race))))
+		return od_record_copy_admitted(cfNode, cfUser, attrs, admission, status, cferror);
+	pthread_mutex_init(&race->lock, NULL);
+	pthread_cond_init(&race->cond, NULL);
+	race->refs = 1;
+	race->search = (ODNodeRef)CFRetain(cfNode);
+	race->cfUser = (CFStringRef)CFRetain(cfUser);
+	race->attrs = (CFArrayRef)CFRetain(attrs);
+	race->admission = *admission;
+
+	if (!od_hedge_race_start(race, cfNode, false)) {
+		od_hedge_race_unref(race);
+		return od_record_copy_admitted(cfNode, cfUser, attrs, admission, status, cferror);
+	}
+
+	if (0 != delay && !od_hedge_race_wait(race, delay) &&
+	    PAM_SUCCESS == cstring_to_cfstring(node, &hedgeName) &&
+	    NULL != (hedgeNode = ODNodeCreateWithName(kCFAllocatorDefault, kODSessionDefault, hedgeName, NULL))) {
+		if (!od_hedge_allow(node))
+			_LOG_DEBUG("no answer after %llu us, hedge allowance used up", delay);
+		else if (od_hedge_race_start(race, hedgeNode, true))
+			_LOG_DEBUG("no answer after %llu us, hedging on %s", delay, node);
+	}
+	od_hedge_race_wait(race, kODTaskWaitForever);
+
+	pthread_mutex_lock(&race->lock);
+	if (NULL != race->record) {
+		record = (ODRecordRef)CFRetain(race->record);
+		hedge_won = race->hedge_won;
+	} else {
+		*status = race->status;
+		if (NULL != cferror && NULL != race->error)
+			*cferror = (CFErrorRef)CFRetain(race->error);
+	}
+	pthread_mutex_unlock(&race->lock);
+
+	if (hedge_won)
+		od_hedge_won(node);
+
+	CFReleaseSafe(hedgeNode);
+	CFReleaseSafe(hedgeName);
+	od_hedge_race_unref(race);
+
+	return record;
+}
+
+/*
+ * ODNodeCopyRecord() on the nodes of the search path in order, leaving out
+ * the ones in skip.  Used while breakers are open; not hedged.
+ */
+CF_RETURNS_RETAINED
+static ODRecordRef
+od_record_copy_skipping(ODNodeRef search, CFArrayRef skip, CFStringRef cfUser, CFArrayRef attrs, CFErrorRef *cferror)
+{
+	CFArrayRef names = ODNodeCopySubnodeNames(search, cferror);
+	ODRecordRef record = NULL;
+	CFIndex i, count, skipped = CFArrayGetCount(skip);
 
-	if (NULL == val || NULL == buffer) {
-		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
-		goto cleanup;
+	count = (NULL != names) ? CFArrayGetCount(names) : 0;
+	for (i = 0; i < count && NULL == record; ++i) {
+		CFStringRef name = CFArrayGetValueAtIndex(names, i);
+		ODNodeRef node = NULL;
+
+		if (NULL == name || CFGetTypeID(name) != CFStringGetTypeID() ||
+		    CFArrayContainsValue(skip, CFRangeMake(0, skipped), name))
+			continue;
+		if (NULL == (node = ODNodeCreateWithName(kCFAllocatorDefault, kODSessionDefault, name, NULL)))
+			continue;
+		record = ODNodeCopyRecord(node, kODRecordTypeUsers, cfUser, attrs, NULL);
+		CFRelease(node);
 	}
+	CFReleaseSafe(names);
 
-	*buffer = CFStringCreateWithCString(kCFAllocatorDefault, val, kCFStringEncodingUTF8);
-	if (NULL == *buffer) {
-		_LOG_DEBUG("CFStringCreateWithCString() failed");
-		retval = PAM_BUF_ERR;
-		goto cleanup;
+	return record;
+}
+
+/*
+ * Attribute projection.  Every lookup asks for the attributes the modules
+ * read themselves plus whatever the stack declared: the "record_attributes"
+ * option and od_record_declare_attributes() calls, collected in the PAM
+ * handle.  Reading anything else makes OpenDirectory go back to the node
+ * for it; those late fetches are counted so missing declarations show up.
+ */
+static uint64_t od_record_late_fetches = 0;
+
+CF_RETURNS_RETAINED
+static CFArrayRef
+od_record_default_attributes(void)
+{
+	CFTypeRef cfVals[] = {
+		kODAttributeTypeAuthenticationAuthority,
+		kODAttributeTypeHomeDirectory,
+		kODAttributeTypeNFSHomeDirectory,
+		kODAttributeTypeUserShell,
+		kODAttributeTypeUniqueID,
+	};
+
+	return CFArrayCreate(kCFAllocatorDefault, cfVals, sizeof(cfVals) / sizeof(cfVals[0]), &kCFTypeArrayCallBacks);
+}
+
+static bool
+od_record_default_attribute(CFStringRef attribute)
+{
+	return CFEqual(attribute, kODAttributeTypeAuthenticationAuthority) ||
+	       CFEqual(attribute, kODAttributeTypeHomeDirectory) ||
+	       CFEqual(attribute, kODAttributeTypeNFSHomeDirectory) ||
+	       CFEqual(attribute, kODAttributeTypeUserShell) ||
+	       CFEqual(attribute, kODAttributeTypeUniqueID);
+}
+
+static void
+od_attributes_append(CFMutableArrayRef attrs, CFArrayRef more)
+{
+	CFIndex i, count;
+
+	if (NULL == more)
+		return;
+
+	count = CFArrayGetCount(more);
+	for (i = 0; i < count; ++i) {
+		CFTypeRef attr = CFArrayGetValueAtIndex(more, i);
+
+		if (NULL != attr && CFGetTypeID(attr) == CFStringGetTypeID() &&
+		    !CFArrayContainsValue(attrs, CFRangeMake(0, CFArrayGetCount(attrs)), attr))
+			CFArrayAppendValue(attrs, attr);
 	}
+}
 
-	retval =  PAM_SUCCESS;
+static CFMutableArrayRef
+od_record_declared_get(pam_handle_t *pamh, bool create)
+{
+	CFMutableArrayRef declared = NULL;
 
-cleanup:
-	if (PAM_SUCCESS != retval)
-		_LOG_ERROR("failed: %d", retval);
+	if (NULL == pamh)
+		return NULL;
 
-	return retval;
+	if (PAM_SUCCESS == pam_get_data(pamh, PAM_OD_ATTRIBUTES_DATA, (void *)&declared) && NULL != declared)
+		return declared;
+
+	if (!create)
+		return NULL;
+
+	declared = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	if (NULL == declared) {
+		_LOG_DEBUG("CFArrayCreateMutable() failed");
+		return NULL;
+	}
+	if (PAM_SUCCESS != pam_set_data(pamh, PAM_OD_ATTRIBUTES_DATA, declared, od_record_data_cleanup)) {
+		_LOG_DEBUG("pam_set_data() failed");
+		CFRelease(declared);
+		return NULL;
+	}
+
+	return declared;
 }
 
+/* Adds attributes to what every later lookup in this transaction asks for */
 int
-cfstring_to_cstring(const CFStringRef val, char **buffer)
+od_record_declare_attributes(pam_handle_t *pamh, CFArrayRef attributes)
 {
-	CFIndex maxlen = 0;
-	int retval = PAM_BUF_ERR;
+	CFMutableArrayRef declared = NULL;
 
-	if (NULL == val || NULL == buffer) {
+	if (NULL == pamh || NULL == attributes) {
 		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
-		goto cleanup;
+		return PAM_SERVICE_ERR;
 	}
 
-	maxlen = CFStringGetMaximumSizeForEncoding(CFStringGetLength(val), kCFStringEncodingUTF8);
-	*buffer = calloc(maxlen + 1, sizeof(char));
-	if (NULL == *buffer) {
-		_LOG_DEBUG("malloc() failed");
-		retval = PAM_BUF_ERR;
-		goto cleanup;
+	if (NULL == (declared = od_record_declared_get(pamh, true)))
+		return PAM_BUF_ERR;
+	od_attributes_append(declared, attributes);
+
+	return PAM_SUCCESS;
+}
+
+/* Picks up the "record_attributes" option, a comma separated attribute list */
+static void
+od_record_declare_option(pam_handle_t *pamh)
+{
+	const char *opt = NULL;
+	CFStringRef cfOpt = NULL;
+	CFArrayRef attrs = NULL;
+
+	if (NULL == pamh || NULL == (opt = openpam_get_option(pamh, "record_attributes")))
+		return;
+
+	if (PAM_SUCCESS != cstring_to_cfstring(opt, &cfOpt))
+		return;
+	attrs = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, cfOpt, CFSTR(","));
+	if (NULL != attrs)
+		od_record_declare_attributes(pamh, attrs);
+
+	CFReleaseSafe(attrs);
+	CFRelease(cfOpt);
+}
+
+CF_RETURNS_RETAINED
+static CFArrayRef
+od_record_projection_create(pam_handle_t *pamh, CFArrayRef attributes)
+{
+	CFMutableArrayRef projection = NULL;
+	CFArrayRef defaults = od_record_default_attributes();
+
+	if (NULL == defaults)
+		return NULL;
+
+	projection = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, defaults);
+	CFRelease(defaults);
+	if (NULL == projection)
+		return NULL;
+
+	od_attributes_append(projection, od_record_declared_get(pamh, false));
+	od_attributes_append(projection, attributes);
+
+	return projection;
+}
+
+/*
+ * The attributes each record of the transaction is known to have loaded,
+ * kept in the PAM handle next to the records, so that reading an
+ * attribute does not have to ask the record what it holds.
+ */
+static CFArrayRef
+od_record_projection_get(pam_handle_t *pamh, ODRecordRef record)
+{
+	CFMutableDictionaryRef projections = NULL;
+
+	if (NULL == pamh || NULL == record ||
+	    PAM_SUCCESS != pam_get_data(pamh, PAM_OD_PROJECTION_DATA, (void *)&projections) || NULL == projections)
+		return NULL;
+
+	return CFDictionaryGetValue(projections, record);
+}
+
+static void
+od_record_projection_add(pam_handle_t *pamh, ODRecordRef record, CFArrayRef attributes)
+{
+	CFMutableDictionaryRef projections = NULL;
+	CFMutableArrayRef loaded = NULL;
+
+	if (NULL == pamh || NULL == record || NULL == attributes)
+		return;
+
+	if (PAM_SUCCESS != pam_get_data(pamh, PAM_OD_PROJECTION_DATA, (void *)&projections) || NULL == projections) {
+		projections = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+							&kCFTypeDictionaryValueCallBacks);
+		if (NULL == projections)
+			return;
+		if (PAM_SUCCESS != pam_set_data(pamh, PAM_OD_PROJECTION_DATA, projections, od_record_data_cleanup)) {
+			_LOG_DEBUG("pam_set_data() failed");
+			CFRelease(projections);
+			return;
+		}
 	}
 
-	if (CFStringGetCString(val, *buffer, maxlen + 1, kCFStringEncodingUTF8)) {
-		retval =  PAM_SUCCESS;
-	} else {
-		_LOG_DEBUG("CFStringGetCString failed.");
-		free(*buffer);
-		*buffer = NULL;
+	if (NULL == (loaded = (CFMutableArrayRef)CFDictionaryGetValue(projections, record))) {
+		if (NULL == (loaded = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks)))
+			return;
+		CFDictionarySetValue(projections, record, loaded);
+		CFRelease(loaded);
+	}
+	od_attributes_append(loaded, attributes);
+}
+
+/*
+ * A record shared by the transaction or the cache may have been fetched by
+ * a module that asked for less.  Bring in whatever the caller's projection
+ * lacks with one request rather than one per attribute.  Only a record this
+ * transaction has not seen yet is asked what it already holds.
+ */
+static void
+od_record_complete(pam_handle_t *pamh, ODRecordRef record, CFArrayRef attributes)
+{
+	CFDictionaryRef loaded = NULL, details = NULL;
+	CFArrayRef known = NULL;
+	CFMutableArrayRef missing = NULL;
+	CFIndex i, count;
+
+	if (NULL == attributes || 0 == (count = CFArrayGetCount(attributes)))
+		return;
+
+	if (NULL == (known = od_record_projection_get(pamh, record)))
+		loaded = ODRecordCopyDetails(record, NULL, NULL);
+	missing = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	if (NULL == missing)
+		goto cleanup;
+
+	for (i = 0; i < count; ++i) {
+		CFTypeRef attr = CFArrayGetValueAtIndex(attributes, i);
+		bool have;
+
+		if (NULL != known)
+			have = CFArrayContainsValue(known, CFRangeMake(0, CFArrayGetCount(known)), attr);
+		else
+			have = (NULL != loaded && CFDictionaryContainsKey(loaded, attr));
+		if (!have)
+			CFArrayAppendValue(missing, attr);
 	}
+	if (0 != CFArrayGetCount(missing)) {
+		__atomic_add_fetch(&od_record_late_fetches, (uint64_t)CFArrayGetCount(missing), __ATOMIC_RELAXED);
+		_LOG_DEBUG("fetching %ld attribute(s) missing from the shared record", CFArrayGetCount(missing));
+		details = ODRecordCopyDetails(record, missing, NULL);
+	}
+	od_record_projection_add(pamh, record, attributes);
 
 cleanup:
-	if (PAM_SUCCESS != retval)
-		_LOG_ERROR("failed: %d", retval);
+	CFReleaseSafe(details);
+	CFReleaseSafe(missing);
+	CFReleaseSafe(loaded);
+}
 
-	return retval;
+/*
+ * Called before reading an attribute; counts it if the record was loaded
+ * without it.  Records the handle did not load are not counted.
+ */
+static void
+od_record_note_attribute(pam_handle_t *pamh, ODRecordRef record, CFStringRef attribute)
+{
+	CFArrayRef loaded = NULL, fetched = NULL;
+	char buf[CFSTRING_VIEW_BUFSIZE];
+	char *allocated = NULL;
+
+	/* every projection starts with the defaults */
+	if (od_record_default_attribute(attribute))
+		return;
+
+	if (NULL == (loaded = od_record_projection_get(pamh, record)) ||
+	    CFArrayContainsValue(loaded, CFRangeMake(0, CFArrayGetCount(loaded)), attribute))
+		return;
+
+	__atomic_add_fetch(&od_record_late_fetches, 1, __ATOMIC_RELAXED);
+	_LOG_DEBUG("%s was not declared, fetching it separately",
+		   cfstring_cstring_view(attribute, buf, sizeof(buf), &allocated));
+	free(allocated);
+
+	/* the record keeps it once fetched */
+	fetched = CFArrayCreate(kCFAllocatorDefault, (const void **)&attribute, 1, &kCFTypeArrayCallBacks);
+	od_record_projection_add(pamh, record, fetched);
+	CFReleaseSafe(fetched);
 }
 
-int
-od_record_create(pam_handle_t *pamh, ODRecordRef *record, CFStringRef cfUser)
+void
+od_record_get_attribute_stats(struct od_record_attribute_stats *stats)
+{
+	if (NULL == stats)
+		return;
+
+	stats->late_fetches = __atomic_load_n(&od_record_late_fetches, __ATOMIC_RELAXED);
+}
+
+static const struct od_lookup_params od_lookup_defaults = {
+	.ttl = 0,
+	.timeout = (uint64_t)kLookupTimeoutDefault * 1000000,
+	.cooldown = (uint64_t)kBreakerCooldownDefault * 1000000,
+	.admission = {
+		.priority = kODAdmissionNormal,
+		.limit = 0,
+		.deadline = (uint64_t)kAdmissionDeadlineDefault * 1000,
+	},
+};
+
+static int
+od_record_fetch(ODRecordRef *record, CFStringRef cfUser, const struct od_lookup_params *params)
 {
 	int retval = PAM_SERVICE_ERR;
-	const int attr_num = 5;
 
 	ODNodeRef cfNode = NULL;
 	CFErrorRef cferror = NULL;
-	CFArrayRef attrs = NULL;
-	CFTypeRef cfVals[attr_num];
+	CFArrayRef attrs = NULL, skip = NULL, unreachable_nodes = NULL;
 
-	if (NULL == record || NULL == cfUser) {
-		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
+	unsigned int attempts = 0;
+	uint64_t deadline = od_now_usec() + params->timeout;
+	uint64_t delay = kRetryInitialDelay, waited = 0;
+	bool node_reopened = false, probing = false, unreachable = false;
+	uint64_t ticket = 0;
+
+	attrs = (NULL != params->attributes) ? CFRetain(params->attributes) : od_record_default_attributes();
+	if (NULL == attrs) {
+		_LOG_DEBUG("CFArrayCreate() failed");
+		retval = PAM_BUF_ERR;
 		goto cleanup;
 	}
 
-	int current_iterations = 0;
-
-	cfNode = ODNodeCreateWithNodeType(kCFAllocatorDefault,
-					  kODSessionDefault,
-					  eDSAuthenticationSearchNodeName,
-					  &cferror);
-	if (NULL == cfNode || NULL != cferror) {
+	cfNode = od_search_node_copy(&cferror);
+	if (NULL == cfNode) {
 		_LOG_ERROR("ODNodeCreateWithNodeType failed.");
 		retval = PAM_SERVICE_ERR;
 		goto cleanup;
 	}
 
-	cfVals[0] = kODAttributeTypeAuthenticationAuthority;
-	cfVals[1] = kODAttributeTypeHomeDirectory;
-	cfVals[2] = kODAttributeTypeNFSHomeDirectory;
-	cfVals[3] = kODAttributeTypeUserShell;
-	cfVals[4] = kODAttributeTypeUniqueID;
-	attrs = CFArrayCreate(kCFAllocatorDefault, cfVals, (CFIndex)attr_num, &kCFTypeArrayCallBacks);
-	if (NULL == attrs) {
-		_LOG_DEBUG("CFArrayCreate() failed");
-		retval = PAM_BUF_ERR;
-		goto cleanup;
-	}
+	if (NULL != (skip = od_breaker_enter(params->cooldown, &probing)))
+		_LOG_DEBUG("skipping %ld directory node(s) with an open breaker", CFArrayGetCount(skip));
 
-	while (current_iterations <= kMaxIterationCount) {
+	for (;;) {
 		CFIndex unreachable_count = 0;
-		CFArrayRef unreachable_nodes = ODNodeCopyUnreachableSubnodeNames(cfNode, NULL);
+		uint64_t now = 0, wait = 0;
+
+		++attempts;
+		CFReleaseNull(cferror);
+		if (NULL == skip && 0 != params->hedge.percentile) {
+			/* the lookups of the race are admitted one by one */
+			*record = od_record_copy_hedged(cfNode, cfUser, attrs, &params->hedge, &params->admission,
+							&retval, &cferror);
+			if (PAM_SUCCESS != retval)
+				goto cleanup;
+		} else {
+			if (PAM_SUCCESS != (retval = od_admission_enter(&params->admission, &ticket)))
+				goto cleanup;
+			if (NULL != skip)
+				*record = od_record_copy_skipping(cfNode, skip, cfUser, attrs, &cferror);
+			else
+				*record = ODNodeCopyRecord(cfNode, kODRecordTypeUsers, cfUser, attrs, &cferror);
+			od_admission_leave(ticket);
+		}
+		if (*record)
+			break;
+
+		if (od_error_node_invalid(cferror) && !node_reopened) {
+			_LOG_DEBUG("search node is no longer valid, reopening");
+			node_reopened = true;
+			od_search_node_reset(cfNode);
+			CFReleaseNull(cfNode);
+			CFReleaseNull(cferror);
+			cfNode = od_search_node_copy(&cferror);
+			if (NULL == cfNode) {
+				_LOG_ERROR("ODNodeCreateWithNodeType failed.");
+				retval = PAM_SERVICE_ERR;
+				goto cleanup;
+			}
+			continue;
+		}
+
+		/* only a miss is worth asking whether part of the search path is down */
+		CFReleaseNull(unreachable_nodes);
+		unreachable_nodes = ODNodeCopyUnreachableSubnodeNames(cfNode, NULL);
 		if (unreachable_nodes) {
 			unreachable_count = CFArrayGetCount(unreachable_nodes);
-			CFRelease(unreachable_nodes);
 			_LOG_DEBUG("%lu OD nodes unreachable.", unreachable_count);
 		}
-
-		*record = ODNodeCopyRecord(cfNode, kODRecordTypeUsers, cfUser, attrs, &cferror);
-		if (*record)
+		unreachable = (0 != unreachable_count);
+		if (!unreachable)
+			break;
+		if (od_breaker_any_open(unreachable_nodes)) {
+			_LOG_DEBUG("directory breaker open, stop waiting");
 			break;
-		if (0 == unreachable_count)
+		}
+
+		now = od_now_usec();
+		if (now >= deadline) {
+			_LOG_DEBUG("lookup deadline reached");
 			break;
+		}
+
+		/* equal jitter: half the delay plus a random share of the other half */
+		wait = delay / 2 + arc4random_uniform((uint32_t)(delay / 2) + 1);
+		if (wait > deadline - now)
+			wait = deadline - now;
+		_LOG_DEBUG("Waiting %llu us for nodes to become reachable", wait);
+		usleep((useconds_t)wait);
+		waited += wait;
+
+		delay *= 2;
+		if (delay > kRetryMaxDelay)
+			delay = kRetryMaxDelay;
+	}
 
-		_LOG_DEBUG("Waiting %d seconds for nodes to become reachable", kWaitSeconds);
-		sleep(kWaitSeconds);
-		++current_iterations;
+	_LOG_DEBUG("lookup took %u attempt(s), waited %llu us", attempts, waited);
+
+	/*
+	 * One lookup is one failure or success for the breakers, however often
+	 * it retried.  A hit only needs to ask after probed or missing nodes.
+	 */
+	if (NULL != *record && (probing || NULL != unreachable_nodes)) {
+		CFReleaseNull(unreachable_nodes);
+		unreachable_nodes = ODNodeCopyUnreachableSubnodeNames(cfNode, NULL);
+		od_breaker_update(unreachable_nodes);
+	} else if (NULL == *record) {
+		od_breaker_update(unreachable_nodes);
 	}
 
 	if (*record) {
 		retval = PAM_SUCCESS;
+	} else if (unreachable || NULL != skip) {
+		/* the user may well be on a node that never answered or was skipped */
+		retval = PAM_AUTHINFO_UNAVAIL;
 	} else {
 		retval = PAM_USER_UNKNOWN;
 	}
 
 cleanup:
+	CFReleaseSafe(unreachable_nodes);
+	CFReleaseSafe(skip);
 	CFReleaseSafe(attrs);
 	CFReleaseSafe(cferror);
 	CFReleaseSafe(cfNode);
 
+	return retval;
+}
+
+/*
+ * Process-wide user record cache, keyed by record name, with entries that
+ * live for "record_cache_ttl" seconds.  Records used for password
+ * operations never come from here.
+ */
+enum {
+	kRecordCacheMaxEntries = 256
+};
+
+static pthread_once_t od_record_cache_once = PTHREAD_ONCE_INIT;
+static struct dir_cache *od_record_cache = NULL;
+
+static void *
+od_record_cache_retain(void *record)
+{
+	return (void *)CFRetain(record);
+}
+
+static void
+od_record_cache_release(void *record)
+{
+	CFRelease(record);
+}
+
+static void
+od_record_cache_init(void)
+{
+	od_record_cache = dir_cache_create(kRecordCacheMaxEntries, od_record_cache_retain, od_record_cache_release);
+}
+
+struct od_record_cache_fetch {
+	CFStringRef			cfUser;
+	const struct od_lookup_params	*params;
+};
+
+static int
+od_record_cache_fetch(void *ctx, __unused const char *key, void **value)
+{
+	struct od_record_cache_fetch *fetch = ctx;
+
+	return od_record_fetch((ODRecordRef *)value, fetch->cfUser, fetch->params);
+}
+
+static int
+od_record_cache_lookup(ODRecordRef *record, CFStringRef cfUser, const struct od_lookup_params *params)
+{
+	struct od_record_cache_fetch fetch = { .cfUser = cfUser, .params = params };
+	char buf[CFSTRING_VIEW_BUFSIZE];
+	char *allocated = NULL;
+	const char *key = NULL;
+	int retval = PAM_SERVICE_ERR;
+
+	pthread_once(&od_record_cache_once, od_record_cache_init);
+	if (NULL == od_record_cache ||
+	    NULL == (key = cfstring_cstring_view(cfUser, buf, sizeof(buf), &allocated)))
+		return od_record_fetch(record, cfUser, params);
+
+	retval = dir_cache_lookup(od_record_cache, key, params->ttl, od_record_cache_fetch, &fetch, (void **)record);
+	free(allocated);
+
+	return retval;
+}
+
+void
+od_record_cache_get_stats(struct od_record_cache_stats *stats)
+{
+	struct dir_cache_stats counters = { 0 };
+
+	if (NULL == stats)
+		return;
+
+	pthread_once(&od_record_cache_once, od_record_cache_init);
+	dir_cache_get_stats(od_record_cache, &counters);
+	stats->hits = counters.hits;
+	stats->misses = counters.misses;
+	stats->coalesced = counters.coalesced;
+	stats->entries = counters.entries;
+}
+
+enum {
+	kODRecordNoCache = 1 << 0	/* bypass the process-wide cache */
+};
+
+/* params.attributes is retained */
+static void
+od_lookup_params_init(pam_handle_t *pamh, CFArrayRef attributes, struct od_lookup_params *params)
+{
+	const char *opt = NULL;
+
+	*params = od_lookup_defaults;
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, "record_cache_ttl")))
+		params->ttl = strtoull(opt, NULL, 10) * 1000000;
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, "lookup_timeout")))
+		params->timeout = strtoull(opt, NULL, 10) * 1000000;
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, "breaker_cooldown")))
+		params->cooldown = strtoull(opt, NULL, 10) * 1000000;
+
+	params->attributes = od_record_projection_create(pamh, attributes);
+	od_admission_init(pamh, &params->admission);
+	od_hedge_init(pamh, &params->hedge);
+}
+
+/* records fetched directly are fresh enough to share with the rest of the stack */
+static void
+od_record_publish(pam_handle_t *pamh, CFStringRef cfUser, ODRecordRef record)
+{
+	CFMutableDictionaryRef records = od_record_data_get(pamh, true);
+
+	if (NULL != records)
+		CFDictionarySetValue(records, cfUser, record);
+}
+
+static int
+od_record_lookup(pam_handle_t *pamh, ODRecordRef *record, CFStringRef cfUser, CFArrayRef attributes, int flags)
+{
+	int retval = PAM_SERVICE_ERR;
+	CFMutableDictionaryRef records = NULL;
+	ODRecordRef shared = NULL;
+	struct od_lookup_params params = od_lookup_defaults;
+
+	if (NULL == record || NULL == cfUser) {
+		_LOG_DEBUG("NULL argument passed");
+		retval = PAM_SERVICE_ERR;
+		goto cleanup;
+	}
+
+	od_record_declare_option(pamh);
+	if (NULL != pamh && NULL != attributes)
+		od_record_declare_attributes(pamh, attributes);
+
+	records = od_record_data_get(pamh, false);
+	if (NULL != records && NULL != (shared = (ODRecordRef)CFDictionaryGetValue(records, cfUser))) {
+		_LOG_DEBUG("using user record from this transaction");
+		*record = (ODRecordRef)CFRetain(shared);
+		od_record_complete(pamh, *record, attributes);
+		retval = PAM_SUCCESS;
+		goto cleanup;
+	}
+
+	od_lookup_params_init(pamh, attributes, &params);
+
+	if (0 == params.ttl || (flags & kODRecordNoCache)) {
+		retval = od_record_fetch(record, cfUser, &params);
+		if (PAM_SUCCESS != retval)
+			goto cleanup;
+		od_record_projection_add(pamh, *record, params.attributes);
+		od_record_publish(pamh, cfUser, *record);
+	} else {
+		struct od_record_cache_stats stats;
+
+		retval = od_record_cache_lookup(record, cfUser, &params);
+		if (PAM_SUCCESS == retval)
+			od_record_complete(pamh, *record, params.attributes);
+		od_record_cache_get_stats(&stats);
+		_LOG_DEBUG("record cache: %llu hits, %llu misses, %llu coalesced, %llu entries",
+			   stats.hits, stats.misses, stats.coalesced, stats.entries);
+	}
+
+cleanup:
 	if (PAM_SUCCESS != retval) {
 		_LOG_ERROR("failed: %d", retval);
 		if (record != NULL)
 			CFReleaseNull(*record);
 	}
 
+	CFReleaseSafe(params.attributes);
+
 	return retval;
 }
 
 int
-od_record_create_cstring(pam_handle_t *pamh, ODRecordRef *record, const char *user)
+od_record_create(pam_handle_t *pamh, ODRecordRef *record, CFStringRef cfUser)
+{
+	return od_record_lookup(pamh, record, cfUser, NULL, 0);
+}
+
+static int
+od_record_create_cstring_flags(pam_handle_t *pamh, ODRecordRef *record, const char *user, CFArrayRef attributes, int flags)
 {
 	int retval = PAM_SUCCESS;
 	CFStringRef cfUser = NULL;
@@ -182,7 +2371,7 @@ od_record_create_cstring(pam_handle_t *pamh, ODRecordRef *record, const char *us
 	}
 
 	if (PAM_SUCCESS != (retval = cstring_to_cfstring(user, &cfUser)) ||
-	    PAM_SUCCESS != (retval = od_record_create(pamh, record, cfUser))) {
+	    PAM_SUCCESS != (retval = od_record_lookup(pamh, record, cfUser, attributes, flags))) {
 		_LOG_DEBUG("od_record_create() failed");
 		goto cleanup;
 	}
@@ -194,14 +2383,145 @@ cleanup:
 			CFReleaseNull(*record);
 	}
 
-	CFReleaseSafe(cfUser);
+	CFReleaseSafe(cfUser);
+
+	return retval;
+}
+
+int
+od_record_create_cstring(pam_handle_t *pamh, ODRecordRef *record, const char *user)
+{
+	return od_record_create_cstring_flags(pamh, record, user, NULL, 0);
+}
+
+/* Like od_record_create_cstring(), making sure attributes are loaded as well */
+int
+od_record_create_cstring_attrs(pam_handle_t *pamh, ODRecordRef *record, const char *user, CFArrayRef attributes)
+{
+	return od_record_create_cstring_flags(pamh, record, user, attributes, 0);
+}
+
+/* For password verification and changes; never served from the process-wide cache */
+int
+od_record_create_cstring_for_auth(pam_handle_t *pamh, ODRecordRef *record, const char *user)
+{
+	return od_record_create_cstring_flags(pamh, record, user, NULL, kODRecordNoCache);
+}
+
+/*
+ * The lookup of od_record_create_cstring_for_auth() run on a worker thread,
+ * so it can overlap the password conversation.  Everything that needs the
+ * PAM handle happens on the calling thread, before and after.
+ */
+struct od_record_prefetch {
+	CFStringRef		cfUser;
+	struct od_lookup_params	params;
+	ODRecordRef		record;		/* already in the transaction, else fetched */
+	bool			shared;
+	int			retval;
+	void			(*then)(ODRecordRef);
+	struct od_task		*task;
+};
+
+static void
+od_record_prefetch_dispose(void *arg)
+{
+	struct od_record_prefetch *prefetch = arg;
+
+	CFReleaseSafe(prefetch->cfUser);
+	CFReleaseSafe(prefetch->params.attributes);
+	CFReleaseSafe(prefetch->record);
+	free(prefetch);
+}
+
+static int
+od_record_prefetch_main(void *arg)
+{
+	struct od_record_prefetch *prefetch = arg;
+
+	if (NULL == prefetch->record)
+		prefetch->retval = od_record_fetch(&prefetch->record, prefetch->cfUser, &prefetch->params);
+	if (PAM_SUCCESS == prefetch->retval && NULL != prefetch->then)
+		prefetch->then(prefetch->record);
+
+	return prefetch->retval;
+}
+
+/*
+ * Starts looking up user and, once found, calls then(record) on the worker.
+ * Returns NULL if no worker could be started; do the lookup in line then.
+ */
+struct od_record_prefetch *
+od_record_prefetch_start(pam_handle_t *pamh, const char *user, void (*then)(ODRecordRef))
+{
+	struct od_record_prefetch *prefetch = NULL;
+	CFMutableDictionaryRef records = NULL;
+	ODRecordRef shared = NULL;
+
+	if (NULL == user || NULL == (prefetch = calloc(1, sizeof(*prefetch))))
+		return NULL;
+	prefetch->then = then;
+	prefetch->retval = PAM_SUCCESS;
+	if (PAM_SUCCESS != cstring_to_cfstring(user, &prefetch->cfUser))
+		goto fail;
+
+	od_record_declare_option(pamh);
+	records = od_record_data_get(pamh, false);
+	if (NULL != records && NULL != (shared = (ODRecordRef)CFDictionaryGetValue(records, prefetch->cfUser))) {
+		_LOG_DEBUG("using user record from this transaction");
+		prefetch->record = (ODRecordRef)CFRetain(shared);
+		prefetch->shared = true;
+	} else {
+		od_lookup_params_init(pamh, NULL, &prefetch->params);
+	}
+
+	prefetch->task = od_task_start(od_record_prefetch_main, prefetch, od_record_prefetch_dispose);
+	if (NULL == prefetch->task)
+		goto fail;
+
+	return prefetch;
+
+fail:
+	od_record_prefetch_dispose(prefetch);
+	return NULL;
+}
+
+/* Waits for the lookup and hands over the record like od_record_create_cstring_for_auth() */
+int
+od_record_prefetch_finish(pam_handle_t *pamh, struct od_record_prefetch *prefetch, ODRecordRef *record)
+{
+	int retval = PAM_SERVICE_ERR;
+
+	if (NULL == prefetch || NULL == record)
+		return PAM_SERVICE_ERR;
+
+	*record = NULL;
+	if (PAM_SUCCESS == od_task_wait(prefetch->task, kODTaskWaitForever, &retval) && PAM_SUCCESS == retval) {
+		*record = (ODRecordRef)CFRetain(prefetch->record);
+		if (!prefetch->shared) {
+			od_record_projection_add(pamh, *record, prefetch->params.attributes);
+			od_record_publish(pamh, prefetch->cfUser, *record);
+		}
+	}
+	if (PAM_SUCCESS != retval)
+		_LOG_ERROR("failed: %d", retval);
+
+	od_task_release(prefetch->task);
 
 	return retval;
 }
 
+/* For when the record is no longer wanted; the worker finishes on its own */
+void
+od_record_prefetch_cancel(struct od_record_prefetch *prefetch)
+{
+	if (NULL != prefetch)
+		od_task_release(prefetch->task);
+}
+
 /* Can return NULL */
 int
-od_record_attribute_create_cfarray(ODRecordRef record, CFStringRef attrib,  CFArrayRef *out)
+od_record_attribute_create_cfarray(pam_handle_t *pamh, ODRecordRef record, CFStringRef attrib,  CFArrayRef *out)
 {
 	int retval = PAM_SUCCESS;
 
@@ -211,6 +2531,7 @@ od_record_attribute_create_cfarray(ODRecordRef record, CFStringRef attrib,  CFAr
 		goto cleanup;
 	}
 
+	od_record_note_attribute(pamh, record, attrib);
 	*out = ODRecordCopyValues(record, attrib, NULL);
 
 cleanup:
@@ -222,7 +2543,7 @@ cleanup:
 
 /* Can return NULL */
 int
-od_record_attribute_create_cfstring(ODRecordRef record, CFStringRef attrib,  CFStringRef *out)
+od_record_attribute_create_cfstring(pam_handle_t *pamh, ODRecordRef record, CFStringRef attrib,  CFStringRef *out)
 {
 	int retval = PAM_SERVICE_ERR;
 	CFTypeRef cval = NULL;
@@ -236,7 +2557,7 @@ od_record_attribute_create_cfstring(ODRecordRef record, CFStringRef attrib,  CFS
 	}
 
 	*out = NULL;
-	retval = od_record_attribute_create_cfarray(record, attrib, &vals);
+	retval = od_record_attribute_create_cfarray(pamh, record, attrib, &vals);
 	if (PAM_SUCCESS != retval) {
 		_LOG_DEBUG("od_record_attribute_create_cfarray() failed");
 		goto cleanup;
@@ -248,10 +2569,11 @@ od_record_attribute_create_cfstring(ODRecordRef record, CFStringRef attrib,  CFS
 
 	count = CFArrayGetCount(vals);
 	if (1 != count) {
-		char *attr_cstr = NULL;
-		cfstring_to_cstring(attrib, &attr_cstr);
-		_LOG_DEBUG("returned %lx attributes for %s", count, attr_cstr);
-		free(attr_cstr);
+		char attr_buf[CFSTRING_VIEW_BUFSIZE];
+		char *attr_alloc = NULL;
+		_LOG_DEBUG("returned %lx attributes for %s", count,
+			   cfstring_cstring_view(attrib, attr_buf, sizeof(attr_buf), &attr_alloc));
+		free(attr_alloc);
 	}
 
 	for (i = 0; i < count; ++i) {
@@ -284,41 +2606,130 @@ cleanup:
 	return retval;
 }
 
-/* Can return NULL */
-int
-od_record_attribute_create_cstring(ODRecordRef record, CFStringRef attrib,  char **out)
+/*
+ * Parsed authentication authority values are kept in the PAM handle next
+ * to the record they came from, wrapped in a CFData so they can live in a
+ * CFDictionary.
+ */
+CF_RETURNS_RETAINED
+CFDataRef
+od_authauthority_create(CFArrayRef values)
 {
-	int retval = PAM_SERVICE_ERR;
-	CFStringRef val = NULL;
-
-	if (NULL == record || NULL == attrib || NULL == out) {
-		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
+	CFDataRef data = NULL;
+	struct od_authauthority *aa = NULL;
+	CFIndex i, count = 0;
+	const char **cvalues = NULL;
+	char **allocated = NULL;
+	size_t size = 0;
+
+	if (NULL == values)
+		return NULL;
+
+	count = CFArrayGetCount(values);
+	cvalues = calloc(count + 1, sizeof(*cvalues));
+	allocated = calloc(count + 1, sizeof(*allocated));
+	if (NULL == cvalues || NULL == allocated) {
+		_LOG_DEBUG("calloc() failed");
 		goto cleanup;
 	}
 
-	retval = od_record_attribute_create_cfstring(record, attrib, &val);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfstring() failed");
+	for (i = 0; i < count; ++i) {
+		CFTypeRef val = CFArrayGetValueAtIndex(values, i);
+
+		if (NULL == val || CFGetTypeID(val) != CFStringGetTypeID())
+			continue;
+		/* each value needs its own storage, so no shared stack buffer */
+		cvalues[i] = cfstring_cstring_view(val, NULL, 0, &allocated[i]);
+	}
+
+	aa = od_authauthority_parse(cvalues, count, &size);
+	if (NULL == aa) {
+		_LOG_DEBUG("od_authauthority_parse() failed");
 		goto cleanup;
 	}
 
-	if (NULL != val) {
-		retval = cfstring_to_cstring(val, out);
-		if (PAM_SUCCESS != retval) {
-			_LOG_DEBUG("cfstring_to_cstring() failed");
-			goto cleanup;
-		}
+	data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *)aa, size, kCFAllocatorMalloc);
+	if (NULL == data) {
+		_LOG_DEBUG("CFDataCreateWithBytesNoCopy() failed");
+		free(aa);
 	}
 
 cleanup:
-	if (PAM_SUCCESS != retval) {
-		free(out);
+	if (NULL != allocated) {
+		for (i = 0; i < count; ++i)
+			free(allocated[i]);
 	}
+	free(allocated);
+	free(cvalues);
 
-	CFReleaseSafe(val);
+	return data;
+}
 
-	return retval;
+const struct od_authauthority *
+od_authauthority_get(CFDataRef data)
+{
+	return (NULL != data) ? (const struct od_authauthority *)CFDataGetBytePtr(data) : NULL;
+}
+
+CF_RETURNS_RETAINED
+CFDataRef
+od_record_copy_authauthority(pam_handle_t *pamh, ODRecordRef record)
+{
+	CFMutableDictionaryRef parsed = NULL;
+	CFArrayRef vals = NULL;
+	CFDataRef data = NULL;
+
+	if (NULL == record)
+		return NULL;
+
+	if (NULL != pamh &&
+	    PAM_SUCCESS == pam_get_data(pamh, PAM_OD_AUTHAUTHORITY_DATA, (void *)&parsed) && NULL != parsed &&
+	    NULL != (data = CFDictionaryGetValue(parsed, record)))
+		return (CFDataRef)CFRetain(data);
+
+	if (PAM_SUCCESS != od_record_attribute_create_cfarray(pamh, record, kODAttributeTypeAuthenticationAuthority, &vals) || NULL == vals)
+		return NULL;
+	data = od_authauthority_create(vals);
+	CFRelease(vals);
+	if (NULL == data || NULL == pamh)
+		return data;
+
+	if (NULL == parsed) {
+		parsed = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		if (NULL == parsed)
+			return data;
+		if (PAM_SUCCESS != pam_set_data(pamh, PAM_OD_AUTHAUTHORITY_DATA, parsed, od_record_data_cleanup)) {
+			CFRelease(parsed);
+			return data;
+		}
+	}
+	CFDictionarySetValue(parsed, record, data);
+
+	return data;
+}
+
+/* PAM status for a failed ODRecordAuthenticationAllowed() or ODRecordVerifyPassword() */
+static int
+od_credentials_error(CFErrorRef oderror)
+{
+	switch (CFErrorGetCode(oderror)) {
+		case kODErrorCredentialsAccountNotFound:
+			return PAM_USER_UNKNOWN;
+		case kODErrorCredentialsAccountDisabled:
+		case kODErrorCredentialsAccountInactive:
+			return PAM_PERM_DENIED;
+		case kODErrorCredentialsPasswordExpired:
+		case kODErrorCredentialsPasswordChangeRequired:
+			return PAM_NEW_AUTHTOK_REQD;
+		case kODErrorCredentialsInvalid:
+			return PAM_AUTH_ERR;
+		case kODErrorCredentialsAccountTemporarilyLocked :
+			return PAM_APPLE_ACCT_TEMP_LOCK;
+		case kODErrorCredentialsAccountLocked :
+			return PAM_APPLE_ACCT_LOCKED;
+		default:
+			return PAM_AUTH_ERR;
+	}
 }
 
 int
@@ -334,279 +2745,530 @@ od_record_check_pwpolicy(ODRecordRef record)
 	}
 
     if (!ODRecordAuthenticationAllowed(record, &oderror)) {
-        switch (CFErrorGetCode(oderror)) {
-			case kODErrorCredentialsAccountNotFound:
-				retval = PAM_USER_UNKNOWN;
-				break;
-			case kODErrorCredentialsAccountDisabled:
-			case kODErrorCredentialsAccountInactive:
-				retval = PAM_PERM_DENIED;
-				break;
-			case kODErrorCredentialsPasswordExpired:
-			case kODErrorCredentialsPasswordChangeRequired:
-				retval = PAM_NEW_AUTHTOK_REQD;
-				break;
-			case kODErrorCredentialsInvalid:
-				retval = PAM_AUTH_ERR;
-				break;
-			case kODErrorCredentialsAccountTemporarilyLocked :
-				retval = PAM_APPLE_ACCT_TEMP_LOCK;
-				break;
-			case kODErrorCredentialsAccountLocked :
-				retval = PAM_APPLE_ACCT_LOCKED;
-				break;
-			default:
-				retval = PAM_AUTH_ERR;
-				break;
-		}
-
+        retval = od_credentials_error(oderror);
     } else {
         retval = PAM_SUCCESS;
     }
 
 cleanup:
 	_LOG_DEBUG("retval: %d", retval);
+	CFReleaseSafe(oderror);
 	return retval;
 }
 
-int
-od_record_check_authauthority(ODRecordRef record)
+static int
+od_record_check_pwpolicy_admitted(ODRecordRef record, const struct od_admission *admission)
 {
-	int retval = PAM_PERM_DENIED;
-	CFStringRef authauth = NULL;
+	uint64_t ticket = 0;
+	int retval;
 
-	if (NULL == record) {
-		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
-		goto cleanup;
-	}
+	if (PAM_SUCCESS != (retval = od_admission_enter(admission, &ticket)))
+		return retval;
+	retval = od_record_check_pwpolicy(record);
+	od_admission_leave(ticket);
 
-	retval = od_record_attribute_create_cfstring(record, kODAttributeTypeAuthenticationAuthority, &authauth);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfstring() failed");
-		goto cleanup;
+	return retval;
+}
+
+/*
+ * Policy answers for the account management module, shared by all
+ * processes in OD_POLICY_PATH so that sudo and cron, which check one
+ * account per process, find what the last check learned.  The file is
+ * root's; other callers keep their answers in private memory.  Only
+ * PAM_SUCCESS is kept, keyed by record name, and a check uses an answer
+ * no older than its own "policy_cache_ttl" seconds.  A user's entry goes,
+ * in every process, as soon as one sees them fail to authenticate or
+ * change their password; a check that was under way then does not keep
+ * its answer.
+ */
+#define OD_POLICY_PATH "/var/run/pam_opendirectory.policy"
+#define OD_POLICY_MAGIC 0x6f64706f	/* "odpo" */
+
+enum {
+	kPolicyCacheSlots   = 256,
+	kPolicyCacheNameMax = 128
+};
+
+struct od_policy_slot {
+	char		name[kPolicyCacheNameMax];
+	uint64_t	allowed;	/* us, CLOCK_MONOTONIC, 0 for a free slot */
+};
+
+struct od_policy_table {
+	uint32_t	magic;
+	uint32_t	reserved;
+	uint64_t	invalidations;	/* so a check under way can tell */
+	uint64_t	hits;
+	uint64_t	misses;
+	struct od_policy_slot slots[kPolicyCacheSlots];
+};
+
+static struct od_shared_table od_policy_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_POLICY_PATH, sizeof(struct od_policy_table), OD_POLICY_MAGIC, 0,
+				    kODSharedCreate | kODSharedPrivate, NULL);
+
+/* table locked */
+static struct od_policy_slot *
+od_policy_find(struct od_policy_table *table, const char *name)
+{
+	int i;
+
+	for (i = 0; i < kPolicyCacheSlots; ++i) {
+		if (0 != table->slots[i].allowed && 0 == strcmp(name, table->slots[i].name))
+			return &table->slots[i];
 	}
-	if (NULL == authauth) {
-		retval = PAM_SUCCESS;
-		goto cleanup;
+	return NULL;
+}
+
+/* table locked */
+static void
+od_policy_forget(struct od_policy_table *table, const char *name)
+{
+	struct od_policy_slot *slot = NULL;
+
+	if (NULL != (slot = od_policy_find(table, name)))
+		memset(slot, 0, sizeof(*slot));
+	++table->invalidations;
+}
+
+/* whether name was allowed within ttl; if not, *invalidations is where a check starts from */
+static bool
+od_policy_cache_hit(const char *name, uint64_t ttl, uint64_t *invalidations)
+{
+	struct od_policy_table *table = NULL;
+	struct od_policy_slot *slot = NULL;
+	uint64_t now = od_now_usec();
+	bool hit = false;
+
+	if (NULL == (table = od_shared_table_lock(&od_policy_shared)))
+		return false;
+
+	/* an answer from before the clock restarted does not count */
+	slot = od_policy_find(table, name);
+	if (NULL != slot && slot->allowed <= now && now - slot->allowed < ttl) {
+		++table->hits;
+		hit = true;
+	} else {
+		++table->misses;
+		*invalidations = table->invalidations;
 	}
-	if (!CFStringHasPrefix(authauth, CFSTR(kDSValueAuthAuthorityDisabledUser))) {
-		retval = PAM_SUCCESS;
+	od_shared_table_unlock(&od_policy_shared);
+
+	return hit;
+}
+
+static void
+od_policy_cache_store(const char *name, uint64_t invalidations)
+{
+	struct od_policy_table *table = NULL;
+	struct od_policy_slot *slot = NULL;
+	int i;
+
+	if (NULL == (table = od_shared_table_lock(&od_policy_shared)))
+		return;
+
+	if (invalidations == table->invalidations) {
+		/* the user's own slot, else a free one, else the oldest answer */
+		if (NULL == (slot = od_policy_find(table, name))) {
+			slot = &table->slots[0];
+			for (i = 1; i < kPolicyCacheSlots && 0 != slot->allowed; ++i) {
+				if (table->slots[i].allowed < slot->allowed)
+					slot = &table->slots[i];
+			}
+		}
+		strlcpy(slot->name, name, sizeof(slot->name));
+		slot->allowed = od_now_usec();
 	}
+	od_shared_table_unlock(&od_policy_shared);
+}
 
-cleanup:
-	if (PAM_SUCCESS != retval) {
-		_LOG_ERROR("failed: %d", retval);
+static int
+od_record_check_pwpolicy_cached(ODRecordRef record, const struct od_admission *admission, uint64_t ttl)
+{
+	char buf[CFSTRING_VIEW_BUFSIZE];
+	char *allocated = NULL;
+	const char *name = NULL;
+	uint64_t invalidations = 0;
+	int retval = PAM_SERVICE_ERR;
+
+	if (0 == ttl || NULL == record)
+		return od_record_check_pwpolicy_admitted(record, admission);
+
+	name = cfstring_cstring_view(ODRecordGetRecordName(record), buf, sizeof(buf), &allocated);
+	if (NULL == name || strlen(name) >= kPolicyCacheNameMax) {
+		free(allocated);
+		return od_record_check_pwpolicy_admitted(record, admission);
 	}
 
-	CFReleaseSafe(authauth);
+	if (od_policy_cache_hit(name, ttl, &invalidations)) {
+		retval = PAM_SUCCESS;
+	} else {
+		retval = od_record_check_pwpolicy_admitted(record, admission);
+		if (PAM_SUCCESS == retval)
+			od_policy_cache_store(name, invalidations);
+	}
+	free(allocated);
 
 	return retval;
 }
 
-int
-od_record_check_homedir(ODRecordRef record)
+/* drops the answer kept for user and, when given, for record's own name */
+void
+od_policy_cache_invalidate(const char *user, ODRecordRef record)
+{
+	struct od_policy_table *table = NULL;
+	char buf[CFSTRING_VIEW_BUFSIZE];
+	char *allocated = NULL;
+	const char *name = NULL;
+
+	if (NULL != record)
+		name = cfstring_cstring_view(ODRecordGetRecordName(record), buf, sizeof(buf), &allocated);
+
+	if (NULL != (table = od_shared_table_lock(&od_policy_shared))) {
+		if (NULL != user)
+			od_policy_forget(table, user);
+		if (NULL != name)
+			od_policy_forget(table, name);
+		od_shared_table_unlock(&od_policy_shared);
+	}
+	free(allocated);
+}
+
+void
+od_policy_cache_get_stats(struct od_record_cache_stats *stats)
+{
+	struct od_policy_table *table = NULL;
+	int i;
+
+	if (NULL == stats)
+		return;
+	memset(stats, 0, sizeof(*stats));
+	if (NULL == (table = od_shared_table_lock(&od_policy_shared)))
+		return;
+
+	stats->hits = table->hits;
+	stats->misses = table->misses;
+	for (i = 0; i < kPolicyCacheSlots; ++i) {
+		if (0 != table->slots[i].allowed)
+			++stats->entries;
+	}
+	od_shared_table_unlock(&od_policy_shared);
+}
+
+/*
+ * OpenDirectory behind the dir_backend interface; records are ODRecordRefs.
+ * The backend of a PAM handle, ctx, looks records up and answers policy
+ * questions with the handle's options and keeps what it found with the
+ * handle, as od_record_create_cstring() does.  Without a handle lookups
+ * go straight to the shared search node with the default deadline and
+ * breaker cooldown.
+ */
+static int
+od_backend_lookup(struct dir_backend *backend, const char *name, void **record)
 {
 	int retval = PAM_SERVICE_ERR;
-	CFStringRef tmp = NULL;
+	CFStringRef cfUser = NULL;
 
 	if (NULL == record) {
 		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
-		goto cleanup;
+		return PAM_SERVICE_ERR;
 	}
 
-	retval = od_record_attribute_create_cfstring(record, kODAttributeTypeNFSHomeDirectory, &tmp);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfstring() failed");
-		goto cleanup;
-	}
+	if (NULL != backend->ctx)
+		return od_record_create_cstring(backend->ctx, (ODRecordRef *)record, name);
 
-	/* Allow NULL home directories */
-	if (NULL == tmp) {
-		retval = PAM_SUCCESS;
+	if (PAM_SUCCESS == (retval = cstring_to_cfstring(name, &cfUser)))
+		retval = od_record_fetch((ODRecordRef *)record, cfUser, &od_lookup_defaults);
+
+	CFReleaseSafe(cfUser);
+
+	return retval;
+}
+
+static int
+od_backend_copy_values(struct dir_backend *backend, void *record, const char *attribute,
+		       char ***values, size_t *count)
+{
+	int retval = PAM_SERVICE_ERR;
+	CFStringRef cfAttribute = NULL;
+	CFArrayRef vals = NULL;
+	CFIndex i, n;
+
+	if (NULL == record || NULL == values || NULL == count) {
+		_LOG_DEBUG("NULL argument passed");
+		retval = PAM_SERVICE_ERR;
 		goto cleanup;
 	}
+	*values = NULL;
+	*count = 0;
 
-	/* Do not allow login with '/dev/null' home */
-	if (kCFCompareEqualTo == CFStringCompare(tmp, CFSTR("/dev/null"), 0)) {
-		_LOG_DEBUG("home directory is /dev/null");
-		retval = PAM_PERM_DENIED;
+	if (PAM_SUCCESS != (retval = cstring_to_cfstring(attribute, &cfAttribute)) ||
+	    PAM_SUCCESS != (retval = od_record_attribute_create_cfarray(backend->ctx, record, cfAttribute, &vals)) ||
+	    NULL == vals)
 		goto cleanup;
-	}
 
-	if (kCFCompareEqualTo == CFStringCompare(tmp, CFSTR("99"), 0)) {
-		_LOG_DEBUG("home directory is 99");
-		retval = PAM_PERM_DENIED;
+	n = CFArrayGetCount(vals);
+	*values = calloc(n, sizeof(**values));
+	if (NULL == *values) {
+		retval = PAM_BUF_ERR;
 		goto cleanup;
 	}
+	for (i = 0; i < n; ++i) {
+		CFTypeRef val = CFArrayGetValueAtIndex(vals, i);
 
+		if (NULL == val || CFGetTypeID(val) != CFStringGetTypeID())
+			continue;
+		if (PAM_SUCCESS != (retval = cfstring_to_cstring(val, &(*values)[*count])))
+			goto cleanup;
+		++*count;
+	}
 	retval = PAM_SUCCESS;
 
 cleanup:
-	if (PAM_SUCCESS != retval)
-		_LOG_ERROR("failed: %d", retval);
-
-	CFReleaseSafe(tmp);
+	if (PAM_SUCCESS != retval && NULL != values && NULL != count) {
+		dir_values_free(*values, *count);
+		*values = NULL;
+		*count = 0;
+	}
+	CFReleaseSafe(vals);
+	CFReleaseSafe(cfAttribute);
 
 	return retval;
 }
 
-int
-od_record_check_shell(ODRecordRef record)
+/* the first value, copied into buf unless it does not fit */
+static int
+od_backend_view_value(struct dir_backend *backend, void *record, const char *attribute,
+		      char *buf, size_t buflen, char **value, char **allocated)
 {
-	int retval = PAM_PERM_DENIED;
-	CFStringRef cfstr = NULL;
+	int retval = PAM_SERVICE_ERR;
+	CFStringRef cfAttribute = NULL, val = NULL;
+	const char *view = NULL;
 
-	if (NULL == record) {
+	if (NULL == record || NULL == value || NULL == allocated) {
 		_LOG_DEBUG("NULL argument passed");
-		retval = PAM_SERVICE_ERR;
-		goto cleanup;
+		return PAM_SERVICE_ERR;
 	}
+	*value = *allocated = NULL;
 
-	retval = od_record_attribute_create_cfstring(record, kODAttributeTypeUserShell, &cfstr);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfstring() failed");
+	if (PAM_SUCCESS != (retval = cstring_to_cfstring(attribute, &cfAttribute)) ||
+	    PAM_SUCCESS != (retval = od_record_attribute_create_cfstring(backend->ctx, record, cfAttribute, &val)) ||
+	    NULL == val)
 		goto cleanup;
-	}
 
-	if (NULL == cfstr) {
-		retval = PAM_SUCCESS;
+	if (NULL == (view = cfstring_cstring_view(val, buf, buflen, allocated))) {
+		retval = PAM_BUF_ERR;
 		goto cleanup;
 	}
-
-	if (CFStringCompare(cfstr, CFSTR("/usr/bin/false"), 0) == kCFCompareEqualTo) {
-		_LOG_DEBUG("user shell is /bin/false");
-		retval = PAM_PERM_DENIED;
+	/* the string's own storage goes with val */
+	if (view != buf && view != *allocated) {
+		if (NULL != buf && strlcpy(buf, view, buflen) < buflen)
+			view = buf;
+		else if (NULL == (view = *allocated = strdup(view)))
+			retval = PAM_BUF_ERR;
 	}
+	*value = (char *)view;
 
 cleanup:
-	if (PAM_SUCCESS != retval)
-		_LOG_ERROR("failed: %d", retval);
-
-	CFReleaseSafe(cfstr);
+	CFReleaseSafe(val);
+	CFReleaseSafe(cfAttribute);
 
 	return retval;
 }
 
-int
-od_string_from_record(ODRecordRef record, CFStringRef attrib,  char **out)
+static int
+od_backend_check_policy(struct dir_backend *backend, void *record)
+{
+	pam_handle_t *pamh = backend->ctx;
+	struct od_admission admission;
+	uint64_t policy_ttl = 0;
+	const char *opt = NULL;
+
+	if (NULL == pamh)
+		return od_record_check_pwpolicy(record);
+
+	od_admission_init(pamh, &admission);
+	if (NULL != (opt = openpam_get_option(pamh, "policy_cache_ttl")))
+		policy_ttl = strtoull(opt, NULL, 10) * 1000000;
+
+	return od_record_check_pwpolicy_cached(record, &admission, policy_ttl);
+}
+
+static int
+od_backend_verify_password(struct dir_backend *backend, void *record, const char *password)
 {
 	int retval = PAM_SERVICE_ERR;
-	CFStringRef val = NULL;
+	CFStringRef cfPassword = NULL;
+	CFErrorRef oderror = NULL;
+	struct od_admission admission;
+	uint64_t ticket = 0;
+	bool verified;
 
 	if (NULL == record) {
-		_LOG_DEBUG("%s - NULL ODRecord passed.", __func__);
-		goto cleanup;
+		_LOG_DEBUG("NULL argument passed");
+		return PAM_SERVICE_ERR;
 	}
 
-	retval = od_record_attribute_create_cfstring(record, attrib, &val);
-	if (PAM_SUCCESS != retval) {
+	if (PAM_SUCCESS != (retval = cstring_to_cfstring(password, &cfPassword)))
 		goto cleanup;
-	}
 
-	if (val)
-		retval = cfstring_to_cstring(val, out);
+	/* the handle's admission options; without one nobody is held back */
+	od_admission_init(backend->ctx, &admission);
+	if (PAM_SUCCESS != (retval = od_admission_enter(&admission, &ticket)))
+		goto cleanup;
+	verified = ODRecordVerifyPassword(record, cfPassword, &oderror);
+	od_admission_leave(ticket);
+	if (!verified)
+		retval = od_credentials_error(oderror);
 
 cleanup:
-	CFReleaseSafe(val);
+	CFReleaseSafe(cfPassword);
+	CFReleaseSafe(oderror);
+
+	return retval;
+}
+
+/* a copy of the authorities parsed once per handle */
+static int
+od_backend_copy_authauthority(struct dir_backend *backend, void *record, struct od_authauthority **aa)
+{
+	CFDataRef authdata = NULL;
+	int retval = PAM_SUCCESS;
+
+	*aa = NULL;
+	if (NULL == (authdata = od_record_copy_authauthority(backend->ctx, record)))
+		return PAM_SUCCESS;
+
+	if (NULL == (*aa = malloc(CFDataGetLength(authdata)))) {
+		_LOG_DEBUG("malloc() failed");
+		retval = PAM_BUF_ERR;
+	} else {
+		memcpy(*aa, CFDataGetBytePtr(authdata), CFDataGetLength(authdata));
+	}
+	CFRelease(authdata);
 
 	return retval;
 }
 
+static void *
+od_backend_retain(__unused struct dir_backend *backend, void *record)
+{
+	return (void *)CFRetain(record);
+}
+
+static void
+od_backend_release(__unused struct dir_backend *backend, void *record)
+{
+	CFReleaseSafe(record);
+}
+
+static void
+od_backend_close(struct dir_backend *backend)
+{
+	free(backend);
+}
+
+static const struct dir_backend_ops od_backend_ops = {
+	.name = "opendirectory",
+	.lookup = od_backend_lookup,
+	.copy_values = od_backend_copy_values,
+	.view_value = od_backend_view_value,
+	.check_policy = od_backend_check_policy,
+	.verify_password = od_backend_verify_password,
+	.copy_authauthority = od_backend_copy_authauthority,
+	.retain = od_backend_retain,
+	.release = od_backend_release,
+	.close = od_backend_close,
+};
+
+struct dir_backend *
+od_backend_open(void)
+{
+	struct dir_backend *backend = calloc(1, sizeof(*backend));
+
+	if (NULL != backend)
+		backend->ops = &od_backend_ops;
+
+	return backend;
+}
+
+/* The backend of pamh, which lives no longer than the call it is made for. */
+#define OD_BACKEND_HANDLE(pamh) { .ops = &od_backend_ops, .ctx = (pamh) }
+
 int
-extract_homemount(char *in, char **out_url, char **out_path)
+od_record_check_authauthority(pam_handle_t *pamh, ODRecordRef record)
 {
-	// Directory Services people have assured me that this won't change
-	static const char URL_OPEN[] = "<url>";
-	static const char URL_CLOSE[] = "</url>";
-	static const char PATH_OPEN[] = "<path>";
-	static const char PATH_CLOSE[] = "</path>";
+	struct dir_backend backend = OD_BACKEND_HANDLE(pamh);
+	int retval = PAM_SERVICE_ERR;
+
+	if (NULL == record) {
+		_LOG_DEBUG("NULL argument passed");
+		return PAM_SERVICE_ERR;
+	}
+
+	retval = dir_check_authauthority(&backend, record);
+	if (PAM_SUCCESS != retval) {
+		_LOG_ERROR("failed: %d", retval);
+	}
+
+	return retval;
+}
 
-	char *server_URL = NULL;
-	char *path = NULL;
-	char *record_start = NULL;
-	char *record_end = NULL;
+/*
+ * Account checks for pam_sm_acct_mgmt().  The module options are compiled
+ * into a rule list once per call, which dir_check_account() applies
+ * through the handle's backend, stopping at the first rule that denies.
+ */
+void
+od_account_rules_compile(pam_handle_t *pamh, struct od_account_rules *rules)
+{
+	dir_account_rules_init(rules,
+			       NULL == pamh || !openpam_get_option(pamh, "no_check_home"),
+			       (NULL != pamh) ? openpam_get_option(pamh, "deny_home") : NULL,
+			       NULL == pamh || !openpam_get_option(pamh, "no_check_shell"),
+			       (NULL != pamh) ? openpam_get_option(pamh, "deny_shell") : NULL);
+}
 
+int
+od_record_check_account(pam_handle_t *pamh, ODRecordRef record, const struct od_account_rules *rules)
+{
+	struct dir_backend backend = OD_BACKEND_HANDLE(pamh);
 	int retval = PAM_SERVICE_ERR;
 
-	if (NULL == in)
-		goto fin;
-
-	record_start = in;
-	server_URL = strstr(record_start, URL_OPEN);
-	if (NULL == server_URL)
-		goto fin;
-	server_URL += sizeof(URL_OPEN)-1;
-	while ('\0' != *server_URL && isspace(*server_URL))
-		server_URL++;
-	record_end = strstr(server_URL, URL_CLOSE);
-	if (NULL == record_end)
-		goto fin;
-	while (record_end >= server_URL && '\0' != *record_end && isspace(*(record_end-1)))
-		record_end--;
-	if (NULL == record_end)
-		goto fin;
-	*record_end = '\0';
-	if (NULL == (*out_url = strdup(server_URL)))
-		goto fin;
-
-	record_start = record_end+1;
-	path = strstr(record_start, PATH_OPEN);
-	if (NULL == path)
-		goto ok;
-	path += sizeof(PATH_OPEN)-1;
-	while ('\0' != *path && isspace(*path))
-		path++;
-	record_end = strstr(path, PATH_CLOSE);
-	if (NULL == record_end)
-		goto fin;
-	while (record_end >= path && '\0' != *record_end && isspace(*(record_end-1)))
-		record_end--;
-	if (NULL == record_end)
-		goto fin;
-	*record_end = '\0';
-	if (NULL == (*out_path = strdup(path)))
-		goto fin;
-
-ok:
-	retval = PAM_SUCCESS;
-fin:
+	if (NULL == record || NULL == rules) {
+		_LOG_DEBUG("NULL argument passed");
+		return PAM_SERVICE_ERR;
+	}
+
+	retval = dir_check_account(&backend, record, rules);
+	if (PAM_SUCCESS != retval) {
+		_LOG_ERROR("account check failed: %d", retval);
+	}
+
 	return retval;
 }
 
 int
 od_extract_home(pam_handle_t *pamh, const char *username, char **server_URL, char **path, char **homedir)
 {
+	struct dir_backend backend = OD_BACKEND_HANDLE(pamh);
 	int retval = PAM_SERVICE_ERR;
-	char *tmp = NULL;
-	ODRecordRef record = NULL;
+	void *record = NULL;
 
-	retval = od_record_create_cstring(pamh, &record, username);
+	retval = backend.ops->lookup(&backend, username, &record);
 	if (PAM_SUCCESS != retval) {
 		goto cleanup;
 	}
 
-	retval = od_string_from_record(record, kODAttributeTypeHomeDirectory, &tmp);
-	if (retval) {
-		_LOG_DEBUG("%s - get kODAttributeTypeHomeDirectory  : %d",
-			    __func__, retval);
-		goto cleanup;
-	}
-	extract_homemount(tmp, server_URL, path);
+	retval = dir_copy_home(&backend, record, server_URL, path, homedir);
 	_LOG_DEBUG("%s - Server URL   : %s", __func__, *server_URL);
 	_LOG_DEBUG("%s - Path to mount: %s", __func__, *path);
-
-	retval = od_string_from_record(record, kODAttributeTypeNFSHomeDirectory, homedir);
 	_LOG_DEBUG("%s - Home dir     : %s", __func__, *homedir);
-	if (retval)
-		goto cleanup;
-
-	retval = PAM_SUCCESS;
 
 cleanup:
-	if (tmp)
-		free(tmp);
+	if (PAM_SUCCESS != retval) {
+		_LOG_DEBUG("%s - failed: %d", __func__, retval);
+	}
 	CFReleaseSafe(record);
 
 	return retval;
@@ -616,11 +3278,9 @@ cleanup:
 int
 od_principal_for_user(pam_handle_t *pamh, const char *user, char **od_principal)
 {
+	struct dir_backend backend = OD_BACKEND_HANDLE(pamh);
 	int retval = PAM_SERVICE_ERR;
-	ODRecordRef record = NULL;
-	CFStringRef principal = NULL;
-	CFArrayRef authparts = NULL, vals = NULL;
-	CFIndex i = 0, count = 0;
+	void *record = NULL;
 
 	if (NULL == user || NULL == od_principal) {
 		_LOG_DEBUG("NULL argument passed");
@@ -628,66 +3288,13 @@ od_principal_for_user(pam_handle_t *pamh, const char *user, char **od_principal)
 		goto cleanup;
 	}
 
-	retval = od_record_create_cstring(pamh, &record, user);
+	retval = backend.ops->lookup(&backend, user, &record);
 	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfstring() failed");
-		goto cleanup;
-	}
-
-	retval = od_record_attribute_create_cfarray(record, kODAttributeTypeAuthenticationAuthority, &vals);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("od_record_attribute_create_cfarray() failed");
-		goto cleanup;
-	}
-	if (NULL == vals) {
-		_LOG_DEBUG("no authauth availale for user.");
-		retval = PAM_PERM_DENIED;
-		goto cleanup;
-	}
-
-	count = CFArrayGetCount(vals);
-	for (i = 0; i < count; i++)
-	{
-		const void *val = CFArrayGetValueAtIndex(vals, i);
-		if (NULL == val || CFGetTypeID(val) != CFStringGetTypeID())
-			break;
-
-		authparts = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, val, CFSTR(";"));
-		if (NULL == authparts)
-			continue;
-
-		if ((CFArrayGetCount(authparts) < 5) ||
-		    (CFStringCompare(CFArrayGetValueAtIndex(authparts, 1), CFSTR("Kerberosv5"), kCFCompareEqualTo)) ||
-		    (CFStringHasPrefix(CFArrayGetValueAtIndex(authparts, 4), CFSTR("LKDC:")))) {
-			if (NULL != authparts) {
-				CFRelease(authparts);
-				authparts = NULL;
-			}
-			continue;
-		} else {
-			break;
-		}
-	}
-
-	if (NULL == authparts) {
-		_LOG_DEBUG("No authentication authority returned");
-		retval = PAM_PERM_DENIED;
-		goto cleanup;
-	}
-
-	principal = CFArrayGetValueAtIndex(authparts, 3);
-	if (NULL == principal) {
-		_LOG_DEBUG("no principal found in authentication authority");
-		retval = PAM_PERM_DENIED;
-		goto cleanup;
-	}
-
-	retval = cfstring_to_cstring(principal, od_principal);
-	if (PAM_SUCCESS != retval) {
-		_LOG_DEBUG("cfstring_to_cstring() failed");
+		_LOG_DEBUG("od_record_create_cstring() failed");
 		goto cleanup;
 	}
 
+	retval = dir_copy_principal(&backend, record, od_principal);
 
 cleanup:
 	if (PAM_SUCCESS != retval) {
@@ -695,8 +3302,6 @@ cleanup:
 	}
 
 	CFReleaseSafe(record);
-	CFReleaseSafe(authparts);
-	CFReleaseSafe(vals);
 
 	return retval;
 }
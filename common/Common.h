@@ -5,16 +5,163 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include "AuthAuthority.h"
+#include "UserRecord.h"
+
+struct od_record_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t coalesced;	/* misses that waited for a lookup already in flight */
+	uint64_t entries;
+};
+
+struct od_record_attribute_stats {
+	uint64_t late_fetches;	/* attributes fetched after the record was loaded */
+};
+
 int od_record_create(pam_handle_t*, ODRecordRef*, CFStringRef);
 int od_record_create_cstring(pam_handle_t*, ODRecordRef*, const char*);
-int od_record_attribute_create_cfstring(ODRecordRef record, CFStringRef attrib,  CFStringRef *out);
-int od_record_attribute_create_cfarray(ODRecordRef record, CFStringRef attrib,  CFArrayRef *out);
-int od_record_attribute_create_cstring(ODRecordRef record, CFStringRef attrib,  char **out);
+int od_record_create_cstring_for_auth(pam_handle_t*, ODRecordRef*, const char*);
+int od_record_create_cstring_attrs(pam_handle_t*, ODRecordRef*, const char*, CFArrayRef);
+int od_record_declare_attributes(pam_handle_t*, CFArrayRef);
+
+struct od_record_prefetch;
+struct od_record_prefetch *od_record_prefetch_start(pam_handle_t*, const char*, void (*)(ODRecordRef));
+int od_record_prefetch_finish(pam_handle_t*, struct od_record_prefetch*, ODRecordRef*);
+void od_record_prefetch_cancel(struct od_record_prefetch*);
+void od_record_get_attribute_stats(struct od_record_attribute_stats *);
+void od_record_cache_get_stats(struct od_record_cache_stats *);
+void od_record_invalidate(pam_handle_t*);
+/* pamh, which may be NULL, tells which attributes the record was loaded with */
+int od_record_attribute_create_cfstring(pam_handle_t*, ODRecordRef record, CFStringRef attrib,  CFStringRef *out);
+int od_record_attribute_create_cfarray(pam_handle_t*, ODRecordRef record, CFStringRef attrib,  CFArrayRef *out);
 
 int od_record_check_pwpolicy(ODRecordRef);
-int od_record_check_authauthority(ODRecordRef);
-int od_record_check_homedir(ODRecordRef);
-int od_record_check_shell(ODRecordRef);
+void od_policy_cache_invalidate(const char *user, ODRecordRef);
+void od_policy_cache_get_stats(struct od_record_cache_stats *);
+int od_record_check_authauthority(pam_handle_t*, ODRecordRef);
+
+void od_account_rules_compile(pam_handle_t*, struct od_account_rules*);
+int od_record_check_account(pam_handle_t*, ODRecordRef, const struct od_account_rules*);
+
+CF_RETURNS_RETAINED
+CFDataRef od_authauthority_create(CFArrayRef);
+CF_RETURNS_RETAINED
+CFDataRef od_record_copy_authauthority(pam_handle_t*, ODRecordRef);
+const struct od_authauthority *od_authauthority_get(CFDataRef);
+
+/*
+ * Shared histogram of successful authentication times, in two rolling
+ * periods, from which failed authentications get their blinding window.
+ * Lives in OD_LATENCY_PATH.
+ */
+#define OD_LATENCY_PATH "/var/run/pam_opendirectory.latency"
+
+enum {
+	kODLatencyBuckets = 192
+};
+
+struct od_latency_histogram {
+	uint32_t	magic;
+	uint32_t	current;	/* period being filled */
+	uint64_t	started;	/* us, CLOCK_MONOTONIC, start of the current period */
+	uint64_t	window;		/* us, blinding window most recently chosen */
+	uint64_t	samples[2];
+	uint64_t	counts[2][kODLatencyBuckets];
+};
+
+void od_blinding_record(uint64_t usec);
+uint64_t od_blinding_window(pam_handle_t*);
+int od_blinding_copy_histogram(struct od_latency_histogram *);
+uint64_t od_latency_bucket_limit(unsigned int bucket);
+
+/*
+ * System-wide admission control for blocking directory calls, with a
+ * priority class per service.  The queue lives in OD_ADMISSION_PATH.
+ */
+#define OD_ADMISSION_PATH "/var/run/pam_opendirectory.admission"
+
+enum {
+	kODAdmissionInteractive = 0,
+	kODAdmissionNormal,
+	kODAdmissionBatch,
+	kODAdmissionClasses
+};
+
+enum {
+	kODAdmissionEntries = 128	/* running and queued callers */
+};
+
+struct od_admission {
+	int		priority;
+	unsigned int	limit;		/* concurrent calls, 0 for no limit */
+	uint64_t	deadline;	/* us a caller may queue */
+};
+
+struct od_admission_stats_class {
+	uint64_t	admitted;
+	uint64_t	rejected;
+	uint64_t	wait_usec;	/* total time the admitted ones queued */
+	uint64_t	max_wait_usec;
+};
+
+struct od_admission_stats {
+	uint32_t	running;
+	uint32_t	depth;		/* queued now */
+	uint32_t	peak_depth;
+	struct od_admission_stats_class classes[kODAdmissionClasses];
+};
+
+void od_admission_init(pam_handle_t*, struct od_admission *);
+int od_admission_enter(const struct od_admission *, uint64_t *ticket);
+void od_admission_leave(uint64_t ticket);
+int od_admission_copy_stats(struct od_admission_stats *);
+
+/* Membership cache TTL refreshes, shared in OD_MEMBERSHIP_PATH */
+#define OD_MEMBERSHIP_PATH "/var/run/pam_opendirectory.membership"
+
+struct od_membership_stats {
+	uint64_t	issued;
+	uint64_t	skipped;	/* within refresh_coalesce of the last one */
+};
+
+bool od_membership_refresh_due(pam_handle_t*, uid_t, unsigned int ttl);
+int od_membership_copy_stats(struct od_membership_stats *);
+
+/* Hedged lookups, shared by all processes in OD_HEDGE_PATH */
+#define OD_HEDGE_PATH "/var/run/pam_opendirectory.hedge"
+
+enum {
+	kODHedgeNodes       = 16,
+	kODHedgeNodeNameMax = 128
+};
+
+struct od_hedge_node_stats {
+	char		node[kODHedgeNodeNameMax];
+	uint64_t	hedges;		/* lookups sent to it as a hedge */
+	uint64_t	wins;		/* of those, found the record first */
+};
+
+struct od_hedge_stats {
+	uint64_t	lookups;	/* made while hedging was enabled */
+	uint64_t	hedges;
+	uint64_t	capped;		/* hedges held back by hedge_rate */
+	uint64_t	delay;		/* us, most recent wait before hedging */
+	struct od_hedge_node_stats nodes[kODHedgeNodes];
+};
+
+int od_hedge_copy_stats(struct od_hedge_stats *);
+
+/*
+ * Runs fn(arg) on a thread of its own.  The caller waits for it with a
+ * timeout and releases it either way; dispose(arg) runs once neither side
+ * needs arg any more.
+ */
+struct od_task;
+#define kODTaskWaitForever UINT64_MAX
+struct od_task *od_task_start(int (*fn)(void *), void *arg, void (*dispose)(void *));
+int od_task_wait(struct od_task *, uint64_t timeout_usec, int *result);
+void od_task_release(struct od_task *);
 
 int od_extract_home(pam_handle_t*, const char *, char **, char **, char **);
 int od_principal_for_user(pam_handle_t*, const char *, char **);
@@ -23,6 +170,10 @@ void pam_cf_cleanup(__unused pam_handle_t *, void *, __unused int );
 
 int cfstring_to_cstring(const CFStringRef val, char **buffer);
 
+/* stack buffer size that holds most directory attribute values */
+#define CFSTRING_VIEW_BUFSIZE 256
+const char *cfstring_cstring_view(const CFStringRef val, char *buf, size_t buflen, char **allocated);
+
 #ifndef CFReleaseSafe
 #define CFReleaseSafe(CF) { CFTypeRef _cf = (CF); if (_cf) CFRelease(_cf); }
 #endif
@@ -0,0 +1,415 @@
+/*
+ * Flat-file directory backend, for benchmarks and load tests on hosts
+ * without OpenDirectory.  The file holds records separated by blank lines,
+ * one "attribute: value" pair per line; an attribute may repeat.  Names
+ * without a "dsAttrType" prefix are standard attributes, so
+ * "NFSHomeDirectory" answers for kDirAttrNFSHomeDirectory.  Two
+ * attributes are private to this backend: "Password" is the clear text
+ * password and "PolicyState" is one of ok, disabled, inactive, expired,
+ * change_required, temp_locked or locked.
+ *
+ *	# comment
+ *	RecordName: jdoe
+ *	Password: secret
+ *	NFSHomeDirectory: /Users/jdoe
+ *	AuthenticationAuthority: ;ShadowHash;
+ *
+ * Options tune the latency injected into every call, in microseconds:
+ * lookup_latency, verify_latency and jitter (a uniform extra delay of up to
+ * that much), e.g. "file:/tmp/users?lookup_latency=2000&jitter=500".
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "Backend.h"
+
+#define STANDARD_PREFIX "dsAttrTypeStandard:"
+
+struct file_attr {
+	const char	*name;
+	const char	*value;
+};
+
+struct file_record {
+	const char		*name;
+	const struct file_attr	*attrs;
+	size_t			nattrs;
+};
+
+struct file_backend {
+	struct dir_backend	backend;
+	char			*data;
+	struct file_attr	*attrs;
+	struct file_record	*records;	/* sorted by name */
+	size_t			nrecords;
+	uint64_t		lookup_latency;
+	uint64_t		verify_latency;
+	uint64_t		jitter;
+};
+
+static void
+file_backend_delay(const struct file_backend *fb, uint64_t usec)
+{
+	static __thread unsigned int seed;
+	struct timespec ts;
+
+	if (0 != fb->jitter) {
+		if (0 == seed)
+			seed = (unsigned int)(uintptr_t)&seed ^ (unsigned int)time(NULL);
+		usec += (uint64_t)rand_r(&seed) % (fb->jitter + 1);
+	}
+	if (0 == usec)
+		return;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (0 != nanosleep(&ts, &ts) && EINTR == errno)
+		;
+}
+
+/* stored names may leave out the standard prefix */
+static bool
+file_attr_matches(const struct file_attr *attr, const char *name)
+{
+	if (0 == strcmp(attr->name, name))
+		return true;
+
+	return 0 == strncmp(name, STANDARD_PREFIX, sizeof(STANDARD_PREFIX) - 1) &&
+	       0 == strcmp(attr->name, name + sizeof(STANDARD_PREFIX) - 1);
+}
+
+static const char *
+file_record_value(const struct file_record *record, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < record->nattrs; ++i) {
+		if (file_attr_matches(&record->attrs[i], name))
+			return record->attrs[i].value;
+	}
+
+	return NULL;
+}
+
+static int
+file_record_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct file_record *)a)->name, ((const struct file_record *)b)->name);
+}
+
+static int
+file_backend_lookup(struct dir_backend *backend, const char *name, void **record)
+{
+	struct file_backend *fb = backend->ctx;
+	struct file_record key = { .name = name };
+
+	if (NULL == name || NULL == record)
+		return PAM_SERVICE_ERR;
+
+	file_backend_delay(fb, fb->lookup_latency);
+
+	*record = bsearch(&key, fb->records, fb->nrecords, sizeof(fb->records[0]), file_record_compare);
+
+	return (NULL != *record) ? PAM_SUCCESS : PAM_USER_UNKNOWN;
+}
+
+static int
+file_backend_copy_values(__attribute__((unused)) struct dir_backend *backend, void *record, const char *attribute,
+			 char ***values, size_t *count)
+{
+	const struct file_record *fr = record;
+	size_t i, n = 0;
+
+	if (NULL == fr || NULL == attribute || NULL == values || NULL == count)
+		return PAM_SERVICE_ERR;
+
+	*values = NULL;
+	*count = 0;
+	for (i = 0; i < fr->nattrs; ++i) {
+		if (file_attr_matches(&fr->attrs[i], attribute))
+			++n;
+	}
+	if (0 == n)
+		return PAM_SUCCESS;
+
+	*values = calloc(n, sizeof(**values));
+	if (NULL == *values)
+		return PAM_BUF_ERR;
+	for (i = 0; i < fr->nattrs; ++i) {
+		if (!file_attr_matches(&fr->attrs[i], attribute))
+			continue;
+		if (NULL == ((*values)[*count] = strdup(fr->attrs[i].value))) {
+			dir_values_free(*values, *count);
+			*values = NULL;
+			*count = 0;
+			return PAM_BUF_ERR;
+		}
+		++*count;
+	}
+
+	return PAM_SUCCESS;
+}
+
+static int
+file_backend_view_value(__attribute__((unused)) struct dir_backend *backend, void *record, const char *attribute,
+			char *buf, size_t buflen, char **value, char **allocated)
+{
+	const char *val = NULL;
+
+	if (NULL == record || NULL == attribute || NULL == value || NULL == allocated)
+		return PAM_SERVICE_ERR;
+
+	*value = *allocated = NULL;
+	if (NULL == (val = file_record_value(record, attribute)))
+		return PAM_SUCCESS;
+
+	if (NULL != buf && strlen(val) < buflen)
+		*value = strcpy(buf, val);
+	else if (NULL == (*value = *allocated = strdup(val)))
+		return PAM_BUF_ERR;
+
+	return PAM_SUCCESS;
+}
+
+/* same outcomes as od_record_check_pwpolicy() */
+static int
+file_backend_check_policy(__attribute__((unused)) struct dir_backend *backend, void *record)
+{
+	const char *state = NULL;
+
+	if (NULL == record)
+		return PAM_SERVICE_ERR;
+
+	state = file_record_value(record, "PolicyState");
+	if (NULL == state || 0 == strcmp(state, "ok"))
+		return PAM_SUCCESS;
+	if (0 == strcmp(state, "disabled") || 0 == strcmp(state, "inactive"))
+		return PAM_PERM_DENIED;
+	if (0 == strcmp(state, "expired") || 0 == strcmp(state, "change_required"))
+		return PAM_NEW_AUTHTOK_REQD;
+#ifdef PAM_APPLE_ACCT_TEMP_LOCK
+	if (0 == strcmp(state, "temp_locked"))
+		return PAM_APPLE_ACCT_TEMP_LOCK;
+	if (0 == strcmp(state, "locked"))
+		return PAM_APPLE_ACCT_LOCKED;
+#endif
+
+	return PAM_AUTH_ERR;
+}
+
+static int
+file_backend_verify_password(struct dir_backend *backend, void *record, const char *password)
+{
+	struct file_backend *fb = backend->ctx;
+	const char *expected = NULL;
+	size_t i, elen, plen;
+	unsigned char diff = 0;
+
+	if (NULL == record || NULL == password)
+		return PAM_SERVICE_ERR;
+
+	file_backend_delay(fb, fb->verify_latency);
+
+	expected = file_record_value(record, "Password");
+	if (NULL == expected)
+		return PAM_AUTH_ERR;
+
+	/* look at every byte so the time taken does not depend on the password */
+	elen = strlen(expected);
+	plen = strlen(password);
+	for (i = 0; i < plen; ++i)
+		diff |= (unsigned char)password[i] ^ (unsigned char)expected[i < elen ? i : 0];
+
+	return (0 == diff && elen == plen) ? PAM_SUCCESS : PAM_AUTH_ERR;
+}
+
+/* records live as long as the backend */
+static void *
+file_backend_retain(__attribute__((unused)) struct dir_backend *backend, void *record)
+{
+	return record;
+}
+
+static void
+file_backend_release(__attribute__((unused)) struct dir_backend *backend, __attribute__((unused)) void *record)
+{
+}
+
+static void
+file_backend_close(struct dir_backend *backend)
+{
+	struct file_backend *fb = backend->ctx;
+
+	free(fb->records);
+	free(fb->attrs);
+	free(fb->data);
+	free(fb);
+}
+
+static const struct dir_backend_ops file_backend_ops = {
+	.name = "file",
+	.lookup = file_backend_lookup,
+	.copy_values = file_backend_copy_values,
+	.view_value = file_backend_view_value,
+	.check_policy = file_backend_check_policy,
+	.verify_password = file_backend_verify_password,
+	.retain = file_backend_retain,
+	.release = file_backend_release,
+	.close = file_backend_close,
+};
+
+static int
+file_backend_parse_options(struct file_backend *fb, const char *options)
+{
+	char *copy = NULL, *opt = NULL, *next = NULL, *value = NULL, *end = NULL;
+	unsigned long long number;
+	int retval = PAM_SUCCESS;
+
+	if (NULL == options)
+		return PAM_SUCCESS;
+	if (NULL == (copy = strdup(options)))
+		return PAM_BUF_ERR;
+
+	for (opt = copy; NULL != opt && PAM_SUCCESS == retval; opt = next) {
+		if (NULL != (next = strchr(opt, '&')))
+			*next++ = '\0';
+		if ('\0' == *opt)
+			continue;
+		if (NULL == (value = strchr(opt, '='))) {
+			retval = PAM_SERVICE_ERR;
+			break;
+		}
+		*value++ = '\0';
+		number = strtoull(value, &end, 10);
+		if ('\0' == *value || '\0' != *end)
+			retval = PAM_SERVICE_ERR;
+		else if (0 == strcmp(opt, "lookup_latency"))
+			fb->lookup_latency = number;
+		else if (0 == strcmp(opt, "verify_latency"))
+			fb->verify_latency = number;
+		else if (0 == strcmp(opt, "jitter"))
+			fb->jitter = number;
+		else
+			retval = PAM_SERVICE_ERR;
+	}
+
+	free(copy);
+	return retval;
+}
+
+/* reads the whole file into fb->data and splits it up in place */
+static int
+file_backend_load(struct file_backend *fb, const char *path)
+{
+	FILE *fp = NULL;
+	long size;
+	size_t lines = 1, nattrs = 0, i;
+	char *line = NULL, *next = NULL, *sep = NULL;
+	struct file_record *current = NULL;
+	int retval = PAM_SERVICE_ERR;
+
+	if (NULL == (fp = fopen(path, "r")))
+		goto cleanup;
+	if (0 != fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || 0 != fseek(fp, 0, SEEK_SET))
+		goto cleanup;
+
+	if (NULL == (fb->data = malloc((size_t)size + 1))) {
+		retval = PAM_BUF_ERR;
+		goto cleanup;
+	}
+	if ((size_t)size != fread(fb->data, 1, (size_t)size, fp))
+		goto cleanup;
+	fb->data[size] = '\0';
+
+	for (i = 0; i < (size_t)size; ++i) {
+		if ('\n' == fb->data[i])
+			++lines;
+	}
+	/* a record or an attribute per line at most */
+	fb->attrs = calloc(lines, sizeof(fb->attrs[0]));
+	fb->records = calloc(lines, sizeof(fb->records[0]));
+	if (NULL == fb->attrs || NULL == fb->records) {
+		retval = PAM_BUF_ERR;
+		goto cleanup;
+	}
+
+	for (line = fb->data; NULL != line; line = next) {
+		if (NULL != (next = strchr(line, '\n')))
+			*next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+
+		if ('#' == line[0])
+			continue;
+		if ('\0' == line[0]) {
+			current = NULL;
+			continue;
+		}
+
+		if (NULL != (sep = strstr(line, ": "))) {
+			*sep = '\0';
+			sep += 2;
+		} else if (':' == line[strlen(line) - 1]) {
+			sep = &line[strlen(line) - 1];
+			*sep++ = '\0';
+		} else {
+			continue;
+		}
+
+		if (NULL == current) {
+			current = &fb->records[fb->nrecords++];
+			current->attrs = &fb->attrs[nattrs];
+		}
+		fb->attrs[nattrs].name = line;
+		fb->attrs[nattrs++].value = sep;
+		++current->nattrs;
+		if (NULL == current->name && file_attr_matches(&fb->attrs[nattrs - 1], kDirAttrRecordName))
+			current->name = sep;
+	}
+
+	/* records without a name cannot be looked up */
+	for (i = 0; i < fb->nrecords; ) {
+		if (NULL != fb->records[i].name)
+			++i;
+		else
+			fb->records[i] = fb->records[--fb->nrecords];
+	}
+	qsort(fb->records, fb->nrecords, sizeof(fb->records[0]), file_record_compare);
+
+	retval = PAM_SUCCESS;
+
+cleanup:
+	if (NULL != fp)
+		fclose(fp);
+
+	return retval;
+}
+
+struct dir_backend *
+dir_file_backend_open(const char *path, const char *options)
+{
+	struct file_backend *fb = NULL;
+
+	if (NULL == path)
+		return NULL;
+
+	fb = calloc(1, sizeof(*fb));
+	if (NULL == fb)
+		return NULL;
+	fb->backend.ops = &file_backend_ops;
+	fb->backend.ctx = fb;
+
+	if (PAM_SUCCESS != file_backend_parse_options(fb, options) ||
+	    PAM_SUCCESS != file_backend_load(fb, path)) {
+		file_backend_close(&fb->backend);
+		return NULL;
+	}
+
+	return &fb->backend;
+}
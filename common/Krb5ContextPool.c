@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "Krb5ContextPool.h"
+#include "SharedTable.h"
+
+#ifndef __APPLE__
+#define KRB5_CONFIG_DEFAULT "/etc/krb5.conf"
+#endif
+
+struct od_krb5_pooled {
+	krb5_context	context;
+	uint64_t	stamp;		/* of the configuration it was made from */
+};
+
+static pthread_mutex_t od_krb5_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t od_krb5_pool_once = PTHREAD_ONCE_INIT;
+static struct od_krb5_pooled od_krb5_idle[kODKrb5PoolIdle];
+static unsigned int od_krb5_nidle;
+static struct od_krb5_pooled od_krb5_lent[kODKrb5PoolLent];
+static unsigned int od_krb5_nlent;
+static uint64_t od_krb5_stamp;
+static struct od_krb5_pool_stats od_krb5_stats;
+
+static void
+od_krb5_pool_prefork(void)
+{
+	pthread_mutex_lock(&od_krb5_pool_lock);
+}
+
+static void
+od_krb5_pool_postfork_parent(void)
+{
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+}
+
+/*
+ * The parent's contexts may hold connections to the credentials cache
+ * daemon that are not the child's to tear down; leave them be.
+ */
+static void
+od_krb5_pool_postfork_child(void)
+{
+	od_krb5_nidle = 0;
+	od_krb5_nlent = 0;
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+}
+
+static void
+od_krb5_pool_init(void)
+{
+	od_atfork(od_krb5_pool_prefork, od_krb5_pool_postfork_parent, od_krb5_pool_postfork_child);
+}
+
+static uint64_t
+od_krb5_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t
+od_krb5_hash_file(uint64_t h, const char *path)
+{
+	struct stat sb;
+	int64_t fields[5];
+
+	h = od_krb5_hash(h, path, strlen(path) + 1);
+	if (0 != stat(path, &sb))
+		return od_krb5_hash(h, "-", 1);
+
+	fields[0] = (int64_t)sb.st_dev;
+	fields[1] = (int64_t)sb.st_ino;
+	fields[2] = (int64_t)sb.st_size;
+#ifdef __APPLE__
+	fields[3] = (int64_t)sb.st_mtimespec.tv_sec;
+	fields[4] = (int64_t)sb.st_mtimespec.tv_nsec;
+#else
+	fields[3] = (int64_t)sb.st_mtim.tv_sec;
+	fields[4] = (int64_t)sb.st_mtim.tv_nsec;
+#endif
+	return od_krb5_hash(h, fields, sizeof(fields));
+}
+
+/* Identity and modification time of every configuration file a new context would read */
+static uint64_t
+od_krb5_config_stamp(void)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+#ifdef __APPLE__
+	char **files = NULL;
+	unsigned int i;
+
+	if (0 != krb5_get_default_config_files(&files))
+		return 0;
+	for (i = 0; NULL != files[i]; ++i)
+		h = od_krb5_hash_file(h, files[i]);
+	krb5_free_config_files(files);
+#else
+	const char *env = getenv("KRB5_CONFIG");
+	char *list = strdup(NULL != env ? env : KRB5_CONFIG_DEFAULT), *path = NULL, *next = NULL;
+
+	if (NULL == list)
+		return 0;
+	for (next = list; NULL != (path = strsep(&next, ":"));) {
+		if ('\0' != *path)
+			h = od_krb5_hash_file(h, path);
+	}
+	free(list);
+#endif
+
+	return (0 != h) ? h : 1;
+}
+
+krb5_error_code
+od_krb5_context_get(krb5_context *context)
+{
+	struct od_krb5_pooled entry = { NULL, 0 }, stale[kODKrb5PoolIdle];
+	unsigned int nstale = 0;
+	krb5_error_code ret;
+	uint64_t stamp;
+	bool created = false;
+
+	pthread_once(&od_krb5_pool_once, od_krb5_pool_init);
+	stamp = od_krb5_config_stamp();
+
+	pthread_mutex_lock(&od_krb5_pool_lock);
+	if (stamp != od_krb5_stamp) {
+		/* nothing parsed from the old configuration is handed out again */
+		if (od_krb5_nidle > 0)
+			++od_krb5_stats.flushes;
+		memcpy(stale, od_krb5_idle, od_krb5_nidle * sizeof(*stale));
+		nstale = od_krb5_nidle;
+		od_krb5_nidle = 0;
+		od_krb5_stamp = stamp;
+	}
+	if (od_krb5_nidle > 0) {
+		entry = od_krb5_idle[--od_krb5_nidle];
+		++od_krb5_stats.reused;
+	}
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+
+	while (nstale > 0)
+		krb5_free_context(stale[--nstale].context);
+
+	if (NULL == entry.context) {
+		if (0 != (ret = krb5_init_context(&entry.context)))
+			return ret;
+		entry.stamp = stamp;
+		created = true;
+	}
+
+	/* an untracked context is freed when it comes back */
+	pthread_mutex_lock(&od_krb5_pool_lock);
+	if (created)
+		++od_krb5_stats.created;
+	if (od_krb5_nlent < kODKrb5PoolLent)
+		od_krb5_lent[od_krb5_nlent++] = entry;
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+
+	*context = entry.context;
+	return 0;
+}
+
+void
+od_krb5_context_put(krb5_context context)
+{
+	struct od_krb5_pooled entry = { NULL, 0 };
+	unsigned int i;
+	bool keep = false;
+
+	if (NULL == context)
+		return;
+
+	krb5_clear_error_message(context);
+	krb5_cc_set_default_name(context, NULL);
+
+	pthread_mutex_lock(&od_krb5_pool_lock);
+	for (i = 0; i < od_krb5_nlent; ++i) {
+		if (od_krb5_lent[i].context == context) {
+			entry = od_krb5_lent[i];
+			od_krb5_lent[i] = od_krb5_lent[--od_krb5_nlent];
+			break;
+		}
+	}
+	if (NULL != entry.context && entry.stamp == od_krb5_stamp && od_krb5_nidle < kODKrb5PoolIdle) {
+		od_krb5_idle[od_krb5_nidle++] = entry;
+		keep = true;
+	} else {
+		++od_krb5_stats.discarded;
+	}
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+
+	if (!keep)
+		krb5_free_context(context);
+}
+
+/* Counters and the number of idle contexts, for monitoring */
+void
+od_krb5_pool_copy_stats(struct od_krb5_pool_stats *stats)
+{
+	if (NULL == stats)
+		return;
+
+	pthread_mutex_lock(&od_krb5_pool_lock);
+	*stats = od_krb5_stats;
+	stats->idle = od_krb5_nidle;
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+}
+
+uint64_t
+od_krb5_config_generation(void)
+{
+	uint64_t stamp;
+
+	pthread_mutex_lock(&od_krb5_pool_lock);
+	stamp = od_krb5_stamp;
+	pthread_mutex_unlock(&od_krb5_pool_lock);
+
+	return stamp;
+}
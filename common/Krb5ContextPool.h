@@ -0,0 +1,49 @@
+/*
+ * Process-wide pool of initialized krb5 contexts for pam_krb5.  Setting up
+ * a context parses every Kerberos configuration file and loads plugins,
+ * and one login used to do it in authenticate, setcred and acct_mgmt each.
+ * A pooled context belongs to one caller between get and put.  Idle
+ * contexts are freed once a configuration file changes, and forgotten in
+ * the child after fork().
+ */
+
+#ifndef _KRB5CONTEXTPOOL_H_
+#define _KRB5CONTEXTPOOL_H_
+
+#include <stdint.h>
+
+#ifdef __APPLE__
+#include <Heimdal/krb5.h>
+#else
+#include <krb5.h>
+#endif
+
+enum {
+	kODKrb5PoolIdle = 4,		/* contexts kept between uses */
+	kODKrb5PoolLent = 32		/* contexts tracked while checked out */
+};
+
+struct od_krb5_pool_stats {
+	uint64_t	created;
+	uint64_t	reused;
+	uint64_t	flushes;	/* configuration changes that emptied the pool */
+	uint64_t	discarded;	/* put back but freed instead */
+	uint32_t	idle;
+};
+
+/* A reused context or a fresh one; returns what krb5_init_context() would. */
+krb5_error_code od_krb5_context_get(krb5_context *);
+/*
+ * Resets the error message and the default credentials cache name and
+ * keeps the context for the next caller.  Any other setting changed on it
+ * would carry over, so such a context must go to krb5_free_context().
+ */
+void od_krb5_context_put(krb5_context);
+void od_krb5_pool_copy_stats(struct od_krb5_pool_stats *);
+/*
+ * Changes whenever the pool sees a different Kerberos configuration, for
+ * callers that cache what they derived from it.  0 before the first get.
+ */
+uint64_t od_krb5_config_generation(void);
+
+#endif /* _KRB5CONTEXTPOOL_H_ */
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+#include <security/openpam.h>
+
+#include "Krb5ContextPool.h"
+#include "Krb5Forwardable.h"
+#include "Logging.h"
+#include "SharedTable.h"
+
+#ifdef PAM_USE_OS_LOG
+PAM_DEFINE_LOG(Krb5Forwardable)
+#define PAM_LOG PAM_LOG_Krb5Forwardable()
+#endif
+
+#define OD_KRB5_FORWARDABLE_MAGIC 0x6f646677	/* "odfw" */
+#define OD_KRB5_FORWARDABLE_VERSION 1
+
+enum {
+	kForwardableMemoryDefault = 3600	/* s */
+};
+
+struct od_krb5_forwardable_slot {
+	char		realm[kODKrb5RealmNameMax];
+	uint64_t	config;		/* configuration generation it was learned under */
+	uint64_t	learned;	/* us, CLOCK_MONOTONIC, 0 for a free slot */
+	uint64_t	until;		/* us, CLOCK_MONOTONIC */
+};
+
+struct od_krb5_forwardable_table {
+	uint32_t	magic;
+	uint32_t	version;
+	struct od_krb5_forwardable_stats stats;
+	struct od_krb5_forwardable_slot slots[kODKrb5ForwardableRealms];
+};
+
+/* followed, so that removing the file resets every process */
+static struct od_shared_table od_krb5_forwardable_shared =
+	OD_SHARED_TABLE_INITIALIZER(OD_KRB5_FORWARDABLE_PATH, sizeof(struct od_krb5_forwardable_table),
+				    OD_KRB5_FORWARDABLE_MAGIC, OD_KRB5_FORWARDABLE_VERSION,
+				    kODSharedCreate | kODSharedPrivate | kODSharedFollow, NULL);
+
+static uint64_t
+od_krb5_forwardable_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* us a refusal is kept, from "forwardable_memory" (s) */
+static uint64_t
+od_krb5_forwardable_memory(pam_handle_t *pamh)
+{
+	const char *opt = NULL;
+
+	if (NULL != pamh && NULL != (opt = openpam_get_option(pamh, "forwardable_memory")))
+		return (uint64_t)strtoul(opt, NULL, 10) * 1000000;
+	return (uint64_t)kForwardableMemoryDefault * 1000000;
+}
+
+/* table locked */
+static struct od_krb5_forwardable_slot *
+od_krb5_forwardable_find(struct od_krb5_forwardable_table *table, const char *realm)
+{
+	int i;
+
+	for (i = 0; i < kODKrb5ForwardableRealms; ++i) {
+		if (0 != table->slots[i].learned && 0 == strcmp(realm, table->slots[i].realm))
+			return &table->slots[i];
+	}
+	return NULL;
+}
+
+bool
+od_krb5_forwardable_refused(pam_handle_t *pamh, const char *realm)
+{
+	struct od_krb5_forwardable_table *table = NULL;
+	struct od_krb5_forwardable_slot *slot = NULL;
+	uint64_t now = od_krb5_forwardable_now(), config = od_krb5_config_generation();
+	bool refused = false;
+
+	if (NULL == realm || strlen(realm) >= kODKrb5RealmNameMax || 0 == od_krb5_forwardable_memory(pamh))
+		return false;
+	if (NULL == (table = od_shared_table_lock(&od_krb5_forwardable_shared)))
+		return false;
+
+	if (NULL != (slot = od_krb5_forwardable_find(table, realm))) {
+		if (config != slot->config) {
+			_LOG_DEBUG("Kerberos configuration changed; forgetting that %s refused forwardable tickets", realm);
+			memset(slot, 0, sizeof(*slot));
+		} else if (slot->learned <= now && now < slot->until) {
+			_LOG_DEBUG("%s refused forwardable tickets %llu s ago; asking again in %llu s", realm,
+			    (unsigned long long)((now - slot->learned) / 1000000),
+			    (unsigned long long)((slot->until - now) / 1000000));
+			++table->stats.skipped;
+			refused = true;
+		}
+	}
+	od_shared_table_unlock(&od_krb5_forwardable_shared);
+
+	return refused;
+}
+
+void
+od_krb5_forwardable_record(pam_handle_t *pamh, const char *realm, bool refused)
+{
+	struct od_krb5_forwardable_table *table = NULL;
+	struct od_krb5_forwardable_slot *slot = NULL;
+	uint64_t now = od_krb5_forwardable_now(), config = od_krb5_config_generation();
+	uint64_t memory = od_krb5_forwardable_memory(pamh);
+	int i;
+
+	if (NULL == realm || strlen(realm) >= kODKrb5RealmNameMax || (refused && 0 == memory))
+		return;
+	if (NULL == (table = od_shared_table_lock(&od_krb5_forwardable_shared)))
+		return;
+
+	slot = od_krb5_forwardable_find(table, realm);
+	if (!refused) {
+		if (NULL != slot) {
+			_LOG_DEBUG("%s grants forwardable tickets again", realm);
+			memset(slot, 0, sizeof(*slot));
+			++table->stats.cleared;
+		}
+	} else {
+		/* a free slot, else the one that expires first */
+		for (i = 0; i < kODKrb5ForwardableRealms && NULL == slot; ++i) {
+			if (0 == table->slots[i].learned)
+				slot = &table->slots[i];
+		}
+		if (NULL == slot) {
+			slot = &table->slots[0];
+			for (i = 1; i < kODKrb5ForwardableRealms; ++i) {
+				if (table->slots[i].until < slot->until)
+					slot = &table->slots[i];
+			}
+		}
+		strlcpy(slot->realm, realm, sizeof(slot->realm));
+		slot->config = config;
+		slot->learned = now;
+		slot->until = now + memory;
+		++table->stats.learned;
+		_LOG_DEBUG("%s refused forwardable tickets; asking for non-forwardable ones for %llu s", realm,
+		    (unsigned long long)(memory / 1000000));
+	}
+	od_shared_table_unlock(&od_krb5_forwardable_shared);
+}
+
+/* Counters and the realms remembered now, for monitoring */
+int
+od_krb5_forwardable_copy_stats(struct od_krb5_forwardable_stats *out)
+{
+	struct od_krb5_forwardable_table *table = NULL;
+	uint64_t now = od_krb5_forwardable_now();
+	int i;
+
+	if (NULL == out)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_shared_table_lock(&od_krb5_forwardable_shared)))
+		return PAM_SERVICE_ERR;
+
+	*out = table->stats;
+	out->realms = 0;
+	for (i = 0; i < kODKrb5ForwardableRealms; ++i) {
+		if (0 != table->slots[i].learned && table->slots[i].learned <= now && now < table->slots[i].until)
+			++out->realms;
+	}
+	od_shared_table_unlock(&od_krb5_forwardable_shared);
+
+	return PAM_SUCCESS;
+}
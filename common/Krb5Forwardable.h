@@ -0,0 +1,43 @@
+/*
+ * Realms whose KDC refuses forwardable tickets, for pam_krb5.  Against
+ * such a realm every login asked for a forwardable TGT, was turned down
+ * and asked again without.  A refusal is remembered per realm, shared by
+ * all processes in OD_KRB5_FORWARDABLE_PATH; removing the file forgets
+ * every realm.
+ */
+
+#ifndef _KRB5FORWARDABLE_H_
+#define _KRB5FORWARDABLE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <security/pam_appl.h>
+
+#define OD_KRB5_FORWARDABLE_PATH "/var/run/pam_krb5.forwardable"
+
+enum {
+	kODKrb5ForwardableRealms = 32,
+	kODKrb5RealmNameMax      = 256
+};
+
+struct od_krb5_forwardable_stats {
+	uint64_t	learned;	/* refusals remembered */
+	uint64_t	skipped;	/* forwardable requests not made because of one */
+	uint64_t	cleared;	/* forgotten when a forwardable request succeeded */
+	uint32_t	realms;		/* remembered now */
+};
+
+/*
+ * Whether realm's KDC refused a forwardable TGT within the last
+ * "forwardable_memory" seconds, under the Kerberos configuration in use.
+ */
+bool od_krb5_forwardable_refused(pam_handle_t *, const char *realm);
+/*
+ * What a forwardable request to realm came to: refused when the KDC turned
+ * it down and the same request without forwardable then succeeded.
+ */
+void od_krb5_forwardable_record(pam_handle_t *, const char *realm, bool refused);
+int od_krb5_forwardable_copy_stats(struct od_krb5_forwardable_stats *);
+
+#endif /* _KRB5FORWARDABLE_H_ */
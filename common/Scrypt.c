@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __APPLE__
+#include <CommonCrypto/CommonKeyDerivation.h>
+#else
+#include <openssl/evp.h>
+#endif
+
+#include "Scrypt.h"
+
+/* called through a volatile pointer so the stores cannot be optimized away */
+static void *(*const volatile scrypt_memset)(void *, int, size_t) = memset;
+
+void
+od_scrypt_wipe(void *buf, size_t len)
+{
+	scrypt_memset(buf, 0, len);
+}
+
+static int
+scrypt_pbkdf2_sha256(const void *password, size_t passwordlen, const uint8_t *salt, size_t saltlen,
+		     uint8_t *out, size_t outlen)
+{
+#ifdef __APPLE__
+	if (kCCSuccess != CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordlen, salt, saltlen,
+					       kCCPRFHmacAlgSHA256, 1, out, outlen))
+		return -1;
+#else
+	if (passwordlen > INT32_MAX || saltlen > INT32_MAX || outlen > INT32_MAX ||
+	    1 != PKCS5_PBKDF2_HMAC(password, (int)passwordlen, salt, (int)saltlen, 1, EVP_sha256(),
+				   (int)outlen, out))
+		return -1;
+#endif
+
+	return 0;
+}
+
+static inline uint32_t
+scrypt_le32dec(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void
+scrypt_le32enc(uint8_t *p, uint32_t x)
+{
+	p[0] = x & 0xff;
+	p[1] = (x >> 8) & 0xff;
+	p[2] = (x >> 16) & 0xff;
+	p[3] = (x >> 24) & 0xff;
+}
+
+#define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static void
+scrypt_salsa20_8(uint32_t b[16])
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, b, sizeof(x));
+	for (i = 0; i < 8; i += 2) {
+		/* columns */
+		x[ 4] ^= ROTL(x[ 0] + x[12],  7);	x[ 8] ^= ROTL(x[ 4] + x[ 0],  9);
+		x[12] ^= ROTL(x[ 8] + x[ 4], 13);	x[ 0] ^= ROTL(x[12] + x[ 8], 18);
+		x[ 9] ^= ROTL(x[ 5] + x[ 1],  7);	x[13] ^= ROTL(x[ 9] + x[ 5],  9);
+		x[ 1] ^= ROTL(x[13] + x[ 9], 13);	x[ 5] ^= ROTL(x[ 1] + x[13], 18);
+		x[14] ^= ROTL(x[10] + x[ 6],  7);	x[ 2] ^= ROTL(x[14] + x[10],  9);
+		x[ 6] ^= ROTL(x[ 2] + x[14], 13);	x[10] ^= ROTL(x[ 6] + x[ 2], 18);
+		x[ 3] ^= ROTL(x[15] + x[11],  7);	x[ 7] ^= ROTL(x[ 3] + x[15],  9);
+		x[11] ^= ROTL(x[ 7] + x[ 3], 13);	x[15] ^= ROTL(x[11] + x[ 7], 18);
+		/* rows */
+		x[ 1] ^= ROTL(x[ 0] + x[ 3],  7);	x[ 2] ^= ROTL(x[ 1] + x[ 0],  9);
+		x[ 3] ^= ROTL(x[ 2] + x[ 1], 13);	x[ 0] ^= ROTL(x[ 3] + x[ 2], 18);
+		x[ 6] ^= ROTL(x[ 5] + x[ 4],  7);	x[ 7] ^= ROTL(x[ 6] + x[ 5],  9);
+		x[ 4] ^= ROTL(x[ 7] + x[ 6], 13);	x[ 5] ^= ROTL(x[ 4] + x[ 7], 18);
+		x[11] ^= ROTL(x[10] + x[ 9],  7);	x[ 8] ^= ROTL(x[11] + x[10],  9);
+		x[ 9] ^= ROTL(x[ 8] + x[11], 13);	x[10] ^= ROTL(x[ 9] + x[ 8], 18);
+		x[12] ^= ROTL(x[15] + x[14],  7);	x[13] ^= ROTL(x[12] + x[15],  9);
+		x[14] ^= ROTL(x[13] + x[12], 13);	x[15] ^= ROTL(x[14] + x[13], 18);
+	}
+	for (i = 0; i < 16; ++i)
+		b[i] += x[i];
+}
+
+/* BlockMix over the 2r 16-word blocks of b, using y (32r words) as scratch */
+static void
+scrypt_blockmix(uint32_t *b, uint32_t *y, uint32_t r)
+{
+	uint32_t x[16];
+	uint32_t i, j;
+
+	memcpy(x, &b[(2 * r - 1) * 16], sizeof(x));
+	for (i = 0; i < 2 * r; ++i) {
+		for (j = 0; j < 16; ++j)
+			x[j] ^= b[i * 16 + j];
+		scrypt_salsa20_8(x);
+		/* even blocks go to the first half, odd ones to the second */
+		memcpy(&y[((i & 1) * r + i / 2) * 16], x, sizeof(x));
+	}
+	memcpy(b, y, 128 * r);
+}
+
+/* ROMix of one 128r byte block, v holds N blocks and xy 64r words */
+static void
+scrypt_romix(uint8_t *block, uint32_t r, uint64_t n, uint32_t *v, uint32_t *xy)
+{
+	uint32_t *x = xy, *y = xy + 32 * r;
+	uint64_t i, j, k;
+
+	for (k = 0; k < 32 * r; ++k)
+		x[k] = scrypt_le32dec(&block[4 * k]);
+
+	for (i = 0; i < n; ++i) {
+		memcpy(&v[i * 32 * r], x, 128 * r);
+		scrypt_blockmix(x, y, r);
+	}
+	for (i = 0; i < n; ++i) {
+		j = x[(2 * r - 1) * 16] & (n - 1);
+		for (k = 0; k < 32 * r; ++k)
+			x[k] ^= v[j * 32 * r + k];
+		scrypt_blockmix(x, y, r);
+	}
+
+	for (k = 0; k < 32 * r; ++k)
+		scrypt_le32enc(&block[4 * k], x[k]);
+}
+
+int
+od_scrypt(const void *password, size_t passwordlen, const uint8_t *salt, size_t saltlen,
+	  unsigned int log2_n, uint32_t r, uint32_t p, uint8_t *out, size_t outlen)
+{
+	uint8_t *b = NULL;
+	uint32_t *v = NULL, *xy = NULL;
+	uint64_t n;
+	size_t blocklen;
+	uint32_t i;
+	int retval = -1;
+
+	if (0 == log2_n || log2_n > kScryptMaxLog2N || 0 == r || 0 == p || (uint64_t)r * p >= (1 << 30)) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = (uint64_t)1 << log2_n;
+	blocklen = (size_t)128 * r;
+	if (p > SIZE_MAX / blocklen || n > SIZE_MAX / blocklen) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	b = malloc(blocklen * p);
+	v = malloc(blocklen * n);
+	xy = malloc(2 * blocklen);
+	if (NULL == b || NULL == v || NULL == xy) {
+		errno = ENOMEM;
+		goto cleanup;
+	}
+
+	if (0 != scrypt_pbkdf2_sha256(password, passwordlen, salt, saltlen, b, blocklen * p))
+		goto cleanup;
+	for (i = 0; i < p; ++i)
+		scrypt_romix(&b[i * blocklen], r, n, v, xy);
+	if (0 != scrypt_pbkdf2_sha256(password, passwordlen, b, blocklen * p, out, outlen))
+		goto cleanup;
+
+	retval = 0;
+
+cleanup:
+	/* all three hold material derived from the password */
+	if (NULL != b)
+		od_scrypt_wipe(b, blocklen * p);
+	if (NULL != v)
+		od_scrypt_wipe(v, blocklen * n);
+	if (NULL != xy)
+		od_scrypt_wipe(xy, 2 * blocklen);
+	free(xy);
+	free(v);
+	free(b);
+
+	return retval;
+}
@@ -0,0 +1,28 @@
+/*
+ * scrypt (RFC 7914), the memory-hard key derivation function used for
+ * cached password verifiers.  PBKDF2-HMAC-SHA256 comes from CommonCrypto
+ * on macOS and from OpenSSL elsewhere.
+ */
+
+#ifndef _SCRYPT_H_
+#define _SCRYPT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	kScryptMaxLog2N = 24
+};
+
+/*
+ * Derives outlen bytes into out with N = 2^log2_n, block size r and
+ * parallelism p.  Needs 128 * r * N bytes of memory.  Returns 0, or -1 with
+ * errno set.
+ */
+int od_scrypt(const void *password, size_t passwordlen, const uint8_t *salt, size_t saltlen,
+	      unsigned int log2_n, uint32_t r, uint32_t p, uint8_t *out, size_t outlen);
+
+/* zeroes secrets in a way the compiler will not drop */
+void od_scrypt_wipe(void *buf, size_t len);
+
+#endif /* _SCRYPT_H_ */
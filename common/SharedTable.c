@@ -0,0 +1,279 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE	/* dladdr() */
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SharedTable.h"
+
+/* every mapped table, so that fork() can take all of their locks */
+static pthread_mutex_t od_shared_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t od_shared_tables_once = PTHREAD_ONCE_INIT;
+static struct od_shared_table *od_shared_tables = NULL;
+
+static void
+od_shared_tables_prefork(void)
+{
+	struct od_shared_table *t = NULL;
+
+	pthread_mutex_lock(&od_shared_tables_lock);
+	for (t = od_shared_tables; NULL != t; t = t->next)
+		pthread_mutex_lock(&t->lock);
+}
+
+static void
+od_shared_tables_postfork_parent(void)
+{
+	struct od_shared_table *t = NULL;
+
+	for (t = od_shared_tables; NULL != t; t = t->next)
+		pthread_mutex_unlock(&t->lock);
+	pthread_mutex_unlock(&od_shared_tables_lock);
+}
+
+/* flock() locks belong to the open file, which the child shares with its parent */
+static void
+od_shared_tables_postfork_child(void)
+{
+	struct od_shared_table *t = NULL;
+
+	for (t = od_shared_tables; NULL != t; t = t->next) {
+		if (t->fd >= 0)
+			t->reopen = true;
+		pthread_mutex_unlock(&t->lock);
+	}
+	pthread_mutex_unlock(&od_shared_tables_lock);
+}
+
+static void
+od_shared_tables_init(void)
+{
+	od_atfork(od_shared_tables_prefork, od_shared_tables_postfork_parent, od_shared_tables_postfork_child);
+}
+
+static void
+od_shared_table_register(struct od_shared_table *t)
+{
+	if (t->registered)
+		return;
+	pthread_once(&od_shared_tables_once, od_shared_tables_init);
+
+	pthread_mutex_lock(&od_shared_tables_lock);
+	t->next = od_shared_tables;
+	od_shared_tables = t;
+	pthread_mutex_unlock(&od_shared_tables_lock);
+	t->registered = true;
+}
+
+static void
+od_shared_table_unregister(struct od_shared_table *t)
+{
+	struct od_shared_table **p = NULL;
+
+	pthread_mutex_lock(&od_shared_tables_lock);
+	for (p = &od_shared_tables; NULL != *p; p = &(*p)->next) {
+		if (t == *p) {
+			*p = t->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&od_shared_tables_lock);
+	t->registered = false;
+}
+
+/* the table's file, sized, or -1 when it is missing or others could read it */
+static int
+od_shared_table_open_file(const struct od_shared_table *t, struct stat *sb)
+{
+	bool create = (0 != (t->flags & kODSharedCreate));
+	int fd;
+
+	fd = open(t->path, O_RDWR | O_CLOEXEC | O_NOFOLLOW | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return -1;
+
+	if (0 != fstat(fd, sb) || !S_ISREG(sb->st_mode) || 0 != (sb->st_mode & (S_IRWXG | S_IRWXO)) ||
+	    (0 != sb->st_uid && geteuid() != sb->st_uid) ||
+	    ((size_t)sb->st_size != t->size && (!create || 0 != ftruncate(fd, t->size)))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* t->lock held */
+static void
+od_shared_table_map(struct od_shared_table *t)
+{
+	struct stat sb;
+	void *table = MAP_FAILED;
+	int fd = -1;
+
+	if ('\0' != t->path[0] && (fd = od_shared_table_open_file(t, &sb)) >= 0) {
+		table = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (MAP_FAILED == table) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (MAP_FAILED == table && 0 != (t->flags & kODSharedPrivate))
+		table = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+
+	if (MAP_FAILED != table) {
+		t->fd = fd;
+		t->table = table;
+		/* not yet registered, so a concurrent fork() does not wait for t->lock */
+		od_shared_table_register(t);
+	}
+	__atomic_store_n(&t->opened, true, __ATOMIC_RELEASE);
+}
+
+/* t->lock held; a descriptor of our own for the file mapped, if it is still there */
+static void
+od_shared_table_reopen(struct od_shared_table *t)
+{
+	struct stat mapped, sb;
+	int fd;
+
+	t->reopen = false;
+	if (0 != fstat(t->fd, &mapped) || (fd = od_shared_table_open_file(t, &sb)) < 0)
+		return;
+	if (mapped.st_dev != sb.st_dev || mapped.st_ino != sb.st_ino) {
+		close(fd);
+		return;
+	}
+	close(t->fd);
+	t->fd = fd;
+}
+
+/* t->lock held; whether the path no longer leads to the file mapped */
+static bool
+od_shared_table_moved(const struct od_shared_table *t)
+{
+	struct stat mapped, sb;
+
+	if (0 != fstat(t->fd, &mapped) || 0 != stat(t->path, &sb))
+		return true;
+	return mapped.st_dev != sb.st_dev || mapped.st_ino != sb.st_ino;
+}
+
+/* t->lock held; it stays registered */
+static void
+od_shared_table_unmap(struct od_shared_table *t)
+{
+	munmap(t->table, t->size);
+	t->table = NULL;
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+	t->reopen = false;
+}
+
+void
+od_shared_table_init(struct od_shared_table *t, const char *path, size_t size, uint32_t magic,
+		     uint32_t version, unsigned int flags, void (*reset)(void *))
+{
+	memset(t, 0, sizeof(*t));
+	pthread_mutex_init(&t->lock, NULL);
+	/* a path that does not fit leaves the table without a file */
+	if (NULL != path && strlen(path) < sizeof(t->path))
+		strcpy(t->path, path);
+	t->size = size;
+	t->magic = magic;
+	t->version = version;
+	t->flags = flags;
+	t->reset = reset;
+	t->fd = -1;
+}
+
+void
+od_shared_table_close(struct od_shared_table *t)
+{
+	if (t->registered)
+		od_shared_table_unregister(t);
+	if (NULL != t->table)
+		od_shared_table_unmap(t);
+	pthread_mutex_destroy(&t->lock);
+}
+
+void *
+od_shared_table_peek(struct od_shared_table *t)
+{
+	if (!__atomic_load_n(&t->opened, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&t->lock);
+		if (!t->opened)
+			od_shared_table_map(t);
+		pthread_mutex_unlock(&t->lock);
+	}
+
+	return t->table;
+}
+
+void *
+od_shared_table_lock(struct od_shared_table *t)
+{
+	uint32_t *header = NULL;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->opened && 0 != (t->flags & kODSharedFollow) && t->fd >= 0 && od_shared_table_moved(t)) {
+		od_shared_table_unmap(t);
+		t->opened = false;
+	}
+	if (!t->opened)
+		od_shared_table_map(t);
+	if (NULL == (header = t->table)) {
+		pthread_mutex_unlock(&t->lock);
+		return NULL;
+	}
+
+	if (t->fd >= 0) {
+		if (t->reopen)
+			od_shared_table_reopen(t);
+		while (0 != flock(t->fd, LOCK_EX)) {
+			if (EINTR != errno) {
+				pthread_mutex_unlock(&t->lock);
+				return NULL;
+			}
+		}
+	}
+
+	if (t->magic != header[0] || (0 != t->version && t->version != header[1])) {
+		memset(t->table, 0, t->size);
+		header[0] = t->magic;
+		if (0 != t->version)
+			header[1] = t->version;
+		if (NULL != t->reset)
+			t->reset(t->table);
+	}
+
+	return t->table;
+}
+
+void
+od_shared_table_unlock(struct od_shared_table *t)
+{
+	if (t->fd >= 0)
+		flock(t->fd, LOCK_UN);
+	pthread_mutex_unlock(&t->lock);
+}
+
+int
+od_atfork(void (*prepare)(void), void (*parent)(void), void (*child)(void))
+{
+	Dl_info info;
+
+	/* the handle is never closed, which is the point */
+	if (0 != dladdr((const void *)od_atfork, &info) && NULL != info.dli_fname)
+		(void)dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+
+	return pthread_atfork(prepare, parent, child);
+}
@@ -0,0 +1,71 @@
+/*
+ * Fixed-size tables shared by every process on the system through a file
+ * mapped into memory.  The file must be a regular file that only its
+ * owner, root or the caller, can read.  A table starts with a 32-bit magic
+ * number and, when it has one, a 32-bit version; a table that does not
+ * carry both is cleared before use.  Locking takes a mutex for the threads
+ * of the process and flock() for the other processes.  Nothing in here
+ * depends on CoreFoundation.
+ */
+
+#ifndef _SHAREDTABLE_H_
+#define _SHAREDTABLE_H_
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	kODSharedCreate  = 1 << 0,	/* create the file when it is missing */
+	kODSharedPrivate = 1 << 1,	/* use private memory when the file cannot be used */
+	kODSharedFollow  = 1 << 2	/* map the file again once it was removed or replaced */
+};
+
+struct od_shared_table {
+	pthread_mutex_t	lock;
+	char		path[PATH_MAX];
+	size_t		size;
+	uint32_t	magic;
+	uint32_t	version;	/* 0 when the table has no version word */
+	unsigned int	flags;
+	void		(*reset)(void *table);	/* fills in a cleared table, may be NULL */
+	/* private to SharedTable.c */
+	bool		opened;
+	bool		reopen;		/* forked since the file was opened */
+	bool		registered;
+	int		fd;		/* -1 for private memory */
+	void		*table;
+	struct od_shared_table *next;
+};
+
+#define OD_SHARED_TABLE_INITIALIZER(path_, size_, magic_, version_, flags_, reset_) \
+	{ .lock = PTHREAD_MUTEX_INITIALIZER, .path = path_, .size = (size_), .magic = (magic_), \
+	  .version = (version_), .flags = (flags_), .reset = (reset_), .fd = -1 }
+
+/* For a table not statically initialized; pair with od_shared_table_close(). */
+void od_shared_table_init(struct od_shared_table *, const char *path, size_t size, uint32_t magic,
+			  uint32_t version, unsigned int flags, void (*reset)(void *));
+void od_shared_table_close(struct od_shared_table *);
+
+/*
+ * Maps the table unless that was tried before; returns the mapping, or
+ * NULL when there is none.  Only fields that are safe to read racily may
+ * be read through it without the lock, and not at all for kODSharedFollow.
+ */
+void *od_shared_table_peek(struct od_shared_table *);
+
+/* The table, locked, or NULL when it could not be mapped. */
+void *od_shared_table_lock(struct od_shared_table *);
+void od_shared_table_unlock(struct od_shared_table *);
+
+/*
+ * pthread_atfork() for process-wide state in a module that may be
+ * dlclose()d after pam_end().  Fork handlers cannot be removed, so the
+ * module is made resident first rather than leave them pointing into
+ * unmapped code.
+ */
+int od_atfork(void (*prepare)(void), void (*parent)(void), void (*child)(void));
+
+#endif /* _SHAREDTABLE_H_ */
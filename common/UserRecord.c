@@ -0,0 +1,310 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <security/pam_appl.h>
+
+#include "UserRecord.h"
+
+static void
+dir_account_rule_add(struct od_account_rules *rules, int kind, const char *name, const char *attribute, const char *deny)
+{
+	struct od_account_rule *rule = &rules->rules[rules->count++];
+
+	rule->kind = kind;
+	rule->name = name;
+	rule->attribute = attribute;
+	rule->deny = deny;
+}
+
+void
+dir_account_rules_init(struct od_account_rules *rules, bool check_home, const char *deny_home,
+		       bool check_shell, const char *deny_shell)
+{
+	if (NULL == rules)
+		return;
+
+	memset(rules, 0, sizeof(*rules));
+	dir_account_rule_add(rules, kODAccountRulePolicy, "password policy", NULL, NULL);
+	dir_account_rule_add(rules, kODAccountRuleAuthAuthority, "authentication authority", NULL, NULL);
+	if (check_home)
+		dir_account_rule_add(rules, kODAccountRuleDenyValue, "home directory", kDirAttrNFSHomeDirectory,
+				     (NULL != deny_home) ? deny_home : OD_DENY_HOME_DEFAULT);
+	if (check_shell)
+		dir_account_rule_add(rules, kODAccountRuleDenyValue, "shell", kDirAttrUserShell,
+				     (NULL != deny_shell) ? deny_shell : OD_DENY_SHELL_DEFAULT);
+}
+
+/* is value one of the comma separated entries in list */
+static bool
+dir_account_value_listed(const char *value, const char *list)
+{
+	size_t vlen = strlen(value), len;
+
+	while ('\0' != *list) {
+		len = strcspn(list, ",");
+		if (len == vlen && 0 == strncmp(list, value, len))
+			return true;
+		list += len;
+		if (',' == *list)
+			++list;
+	}
+
+	return false;
+}
+
+static int
+dir_account_check_value(struct dir_backend *backend, void *record, const struct od_account_rule *rule)
+{
+	char buf[DIR_VALUE_BUFSIZE];
+	char *value = NULL, *allocated = NULL;
+	int retval;
+
+	/* only the first value counts, as it did for od_record_attribute_create_cfstring() */
+	retval = dir_view_value(backend, record, rule->attribute, buf, sizeof(buf), &value, &allocated);
+	if (PAM_SUCCESS == retval && NULL != value && dir_account_value_listed(value, rule->deny))
+		retval = PAM_PERM_DENIED;
+	free(allocated);
+
+	return retval;
+}
+
+int
+dir_check_account(struct dir_backend *backend, void *record, const struct od_account_rules *rules)
+{
+	const struct od_account_rule *rule = NULL;
+	int retval = PAM_SERVICE_ERR;
+	unsigned int i;
+
+	if (NULL == backend || NULL == record || NULL == rules)
+		return PAM_SERVICE_ERR;
+
+	for (i = 0; i < rules->count; ++i) {
+		rule = &rules->rules[i];
+		switch (rule->kind) {
+			case kODAccountRulePolicy:
+				retval = backend->ops->check_policy(backend, record);
+#ifdef PAM_APPLE_ACCT_TEMP_LOCK
+				if (PAM_APPLE_ACCT_TEMP_LOCK == retval && rules->ignore_temp_lock)
+					retval = PAM_SUCCESS;
+#endif
+				break;
+			case kODAccountRuleAuthAuthority:
+				retval = dir_check_authauthority(backend, record);
+				break;
+			case kODAccountRuleDenyValue:
+				retval = dir_account_check_value(backend, record, rule);
+				break;
+			default:
+				retval = PAM_SERVICE_ERR;
+				break;
+		}
+		if (PAM_SUCCESS != retval)
+			return retval;
+	}
+
+	return PAM_SUCCESS;
+}
+
+int
+dir_copy_authauthority(struct dir_backend *backend, void *record, struct od_authauthority **aa)
+{
+	char **values = NULL;
+	size_t count = 0, size = 0;
+	int retval;
+
+	if (NULL == backend || NULL == record || NULL == aa)
+		return PAM_SERVICE_ERR;
+	*aa = NULL;
+
+	if (NULL != backend->ops->copy_authauthority)
+		return backend->ops->copy_authauthority(backend, record, aa);
+
+	retval = backend->ops->copy_values(backend, record, kDirAttrAuthenticationAuthority, &values, &count);
+	if (PAM_SUCCESS == retval && NULL != values &&
+	    NULL == (*aa = od_authauthority_parse((const char *const *)values, count, &size)))
+		retval = PAM_BUF_ERR;
+	dir_values_free(values, count);
+
+	return retval;
+}
+
+int
+dir_check_authauthority(struct dir_backend *backend, void *record)
+{
+	struct od_authauthority *aa = NULL;
+	int retval;
+
+	if (PAM_SUCCESS != (retval = dir_copy_authauthority(backend, record, &aa)))
+		return retval;
+	/* the first value starts with ";DisabledUser;", as kDSValueAuthAuthorityDisabledUser */
+	if (NULL != aa && aa->count > 0 && kODAuthAuthTagDisabledUser == aa->entries[0].tag &&
+	    0 == aa->entries[0].fields[0].length)
+		retval = PAM_PERM_DENIED;
+	free(aa);
+
+	return retval;
+}
+
+int
+dir_view_value(struct dir_backend *backend, void *record, const char *attribute,
+	       char *buf, size_t buflen, char **value, char **allocated)
+{
+	char **values = NULL;
+	size_t count = 0;
+	int retval;
+
+	if (NULL == backend || NULL == record || NULL == value || NULL == allocated)
+		return PAM_SERVICE_ERR;
+	*value = NULL;
+	*allocated = NULL;
+
+	if (NULL != backend->ops->view_value)
+		return backend->ops->view_value(backend, record, attribute, buf, buflen, value, allocated);
+
+	retval = backend->ops->copy_values(backend, record, attribute, &values, &count);
+	if (PAM_SUCCESS == retval && count > 0) {
+		/* hand the first value over instead of copying it */
+		*value = *allocated = values[0];
+		values[0] = NULL;
+	}
+	dir_values_free(values, count);
+
+	return retval;
+}
+
+int
+dir_copy_value(struct dir_backend *backend, void *record, const char *attribute, char **value)
+{
+	char buf[DIR_VALUE_BUFSIZE];
+	char *view = NULL, *allocated = NULL;
+	int retval;
+
+	if (NULL == value)
+		return PAM_SERVICE_ERR;
+	*value = NULL;
+
+	retval = dir_view_value(backend, record, attribute, buf, sizeof(buf), &view, &allocated);
+	if (PAM_SUCCESS != retval || NULL == view)
+		return retval;
+
+	/* hand over the heap copy if there is one, otherwise copy exactly what is needed */
+	if (NULL == (*value = (NULL != allocated) ? allocated : strdup(view)))
+		retval = PAM_BUF_ERR;
+
+	return retval;
+}
+
+static int
+dir_extract_homemount(char *in, char **out_url, char **out_path)
+{
+	// Directory Services people have assured me that this won't change
+	static const char URL_OPEN[] = "<url>";
+	static const char URL_CLOSE[] = "</url>";
+	static const char PATH_OPEN[] = "<path>";
+	static const char PATH_CLOSE[] = "</path>";
+
+	char *server_URL = NULL;
+	char *path = NULL;
+	char *record_start = NULL;
+	char *record_end = NULL;
+
+	int retval = PAM_SERVICE_ERR;
+
+	if (NULL == in)
+		goto fin;
+
+	record_start = in;
+	server_URL = strstr(record_start, URL_OPEN);
+	if (NULL == server_URL)
+		goto fin;
+	server_URL += sizeof(URL_OPEN)-1;
+	while ('\0' != *server_URL && isspace(*server_URL))
+		server_URL++;
+	record_end = strstr(server_URL, URL_CLOSE);
+	if (NULL == record_end)
+		goto fin;
+	while (record_end >= server_URL && '\0' != *record_end && isspace(*(record_end-1)))
+		record_end--;
+	if (NULL == record_end)
+		goto fin;
+	*record_end = '\0';
+	if (NULL == (*out_url = strdup(server_URL)))
+		goto fin;
+
+	record_start = record_end+1;
+	path = strstr(record_start, PATH_OPEN);
+	if (NULL == path)
+		goto ok;
+	path += sizeof(PATH_OPEN)-1;
+	while ('\0' != *path && isspace(*path))
+		path++;
+	record_end = strstr(path, PATH_CLOSE);
+	if (NULL == record_end)
+		goto fin;
+	while (record_end >= path && '\0' != *record_end && isspace(*(record_end-1)))
+		record_end--;
+	if (NULL == record_end)
+		goto fin;
+	*record_end = '\0';
+	if (NULL == (*out_path = strdup(path)))
+		goto fin;
+
+ok:
+	retval = PAM_SUCCESS;
+fin:
+	return retval;
+}
+
+int
+dir_copy_home(struct dir_backend *backend, void *record, char **server_URL, char **path, char **homedir)
+{
+	char buf[DIR_VALUE_BUFSIZE];
+	char *value = NULL, *allocated = NULL;
+	int retval;
+
+	retval = dir_view_value(backend, record, kDirAttrHomeDirectory, buf, sizeof(buf), &value, &allocated);
+	if (PAM_SUCCESS != retval)
+		return retval;
+	/* a home directory without a mount is not an error */
+	dir_extract_homemount(value, server_URL, path);
+	free(allocated);
+
+	return dir_copy_value(backend, record, kDirAttrNFSHomeDirectory, homedir);
+}
+
+int
+dir_copy_principal(struct dir_backend *backend, void *record, char **principal)
+{
+	struct od_authauthority *aa = NULL;
+	const struct od_authauthority_entry *entry = NULL;
+	int retval;
+
+	if (NULL == principal)
+		return PAM_SERVICE_ERR;
+
+	if (PAM_SUCCESS != (retval = dir_copy_authauthority(backend, record, &aa)))
+		return retval;
+	if (NULL == aa) {
+		retval = PAM_PERM_DENIED;
+		goto cleanup;
+	}
+
+	while (NULL != (entry = od_authauthority_find(aa, kODAuthAuthTagKerberosv5, entry))) {
+		if (entry->nfields >= 5 &&
+		    0 != strncmp(od_authauthority_field(aa, entry, 4), "LKDC:", 5))
+			break;
+	}
+	if (NULL == entry) {
+		retval = PAM_PERM_DENIED;
+		goto cleanup;
+	}
+
+	if (NULL == (*principal = strdup(od_authauthority_field(aa, entry, 3))))
+		retval = PAM_BUF_ERR;
+
+cleanup:
+	free(aa);
+
+	return retval;
+}
@@ -0,0 +1,65 @@
+/*
+ * What the modules ask of a user record, answered through any directory
+ * backend: the account checks of pam_sm_acct_mgmt(), the home directory
+ * and the Kerberos principal.  Common.c runs these against OpenDirectory,
+ * the benchmarks against FileBackend.c; nothing in here depends on
+ * CoreFoundation.
+ */
+
+#ifndef _USERRECORD_H_
+#define _USERRECORD_H_
+
+#include <stdbool.h>
+
+#include "AuthAuthority.h"
+#include "Backend.h"
+
+#define DIR_VALUE_BUFSIZE	256
+
+#define OD_DENY_HOME_DEFAULT	"/dev/null,99"
+#define OD_DENY_SHELL_DEFAULT	"/usr/bin/false"
+
+enum {
+	kODAccountRulePolicy = 0,	/* check_policy() */
+	kODAccountRuleAuthAuthority,	/* not a DisabledUser */
+	kODAccountRuleDenyValue		/* first value of attribute is not in deny */
+};
+
+enum {
+	kODAccountMaxRules = 4
+};
+
+struct od_account_rule {
+	int		kind;
+	const char	*name;
+	const char	*attribute;
+	const char	*deny;		/* comma separated values */
+};
+
+struct od_account_rules {
+	unsigned int		count;
+	bool			ignore_temp_lock;
+	struct od_account_rule	rules[kODAccountMaxRules];
+};
+
+/* deny_home and deny_shell are NULL for the defaults above */
+void dir_account_rules_init(struct od_account_rules *, bool check_home, const char *deny_home,
+			    bool check_shell, const char *deny_shell);
+/* Stops at the first rule that denies. */
+int dir_check_account(struct dir_backend *, void *record, const struct od_account_rules *);
+int dir_check_authauthority(struct dir_backend *, void *record);
+
+/* *aa is NULL when the record has no authorities, else free() it */
+int dir_copy_authauthority(struct dir_backend *, void *record, struct od_authauthority **aa);
+/* view_value(), or the first of copy_values() for a backend without it */
+int dir_view_value(struct dir_backend *, void *record, const char *attribute,
+		   char *buf, size_t buflen, char **value, char **allocated);
+/* The first value, or NULL when there is none; free() it */
+int dir_copy_value(struct dir_backend *, void *record, const char *attribute, char **value);
+
+/* server_URL and path come from a HomeDirectory "<url>...</url><path>...</path>" */
+int dir_copy_home(struct dir_backend *, void *record, char **server_URL, char **path, char **homedir);
+/* From the first Kerberosv5 authority outside a local KDC */
+int dir_copy_principal(struct dir_backend *, void *record, char **principal);
+
+#endif /* _USERRECORD_H_ */
@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "Scrypt.h"
+#include "SharedTable.h"
+#include "VerifierCache.h"
+
+#define OD_VERIFIER_MAGIC 0x6f647666	/* "odvf" */
+#define OD_VERIFIER_VERSION 1
+
+enum {
+	kVerifierLog2NDefault  = 15,	/* 32 MiB with r = 8 */
+	kVerifierRDefault      = 8,
+	kVerifierPDefault      = 1,
+	kVerifierMaxAgeDefault = 7 * 24 * 60 * 60,
+	kVerifierMinLog2N      = 10,
+	kVerifierMaxLog2N      = 20,
+	kVerifierMaxRP         = 64
+};
+
+struct od_verifier_cache {
+	struct od_shared_table	shared;
+};
+
+void
+od_verifier_default_params(struct od_verifier_params *params)
+{
+	params->log2_n = kVerifierLog2NDefault;
+	params->r = kVerifierRDefault;
+	params->p = kVerifierPDefault;
+	params->max_age = kVerifierMaxAgeDefault;
+}
+
+/* bounds the memory and time a stored (or configured) cost can ask for */
+static bool
+od_verifier_cost_valid(unsigned int log2_n, uint32_t r, uint32_t p)
+{
+	return log2_n >= kVerifierMinLog2N && log2_n <= kVerifierMaxLog2N &&
+	       0 != r && 0 != p && (uint64_t)r * p <= kVerifierMaxRP;
+}
+
+struct od_verifier_cache *
+od_verifier_open(const char *path, bool create)
+{
+	struct od_verifier_cache *cache = NULL;
+
+	if (NULL == path || NULL == (cache = calloc(1, sizeof(*cache))))
+		return NULL;
+
+	/* the hashes are only as safe as the file, so there is no private fallback */
+	od_shared_table_init(&cache->shared, path, sizeof(struct od_verifier_table), OD_VERIFIER_MAGIC,
+			     OD_VERIFIER_VERSION, create ? kODSharedCreate : 0, NULL);
+	if (NULL == od_shared_table_peek(&cache->shared)) {
+		od_shared_table_close(&cache->shared);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void
+od_verifier_close(struct od_verifier_cache *cache)
+{
+	if (NULL == cache)
+		return;
+
+	od_shared_table_close(&cache->shared);
+	free(cache);
+}
+
+/* table must be locked */
+static struct od_verifier_entry *
+od_verifier_find(struct od_verifier_table *table, const char *user)
+{
+	int i;
+
+	for (i = 0; i < kODVerifierSlots; ++i) {
+		if ('\0' != table->entries[i].name[0] &&
+		    0 == strncmp(table->entries[i].name, user, sizeof(table->entries[i].name)))
+			return &table->entries[i];
+	}
+
+	return NULL;
+}
+
+static bool
+od_verifier_expired(const struct od_verifier_entry *entry, uint64_t max_age, time_t now)
+{
+	return entry->stored > now || (uint64_t)(now - entry->stored) >= max_age;
+}
+
+int
+od_verifier_store(struct od_verifier_cache *cache, const char *user, const char *password,
+		  const struct od_verifier_params *params)
+{
+	struct od_verifier_table *table = NULL;
+	struct od_verifier_entry entry, *slot = NULL;
+	int i;
+
+	if (NULL == cache || NULL == user || NULL == password || NULL == params)
+		return PAM_SERVICE_ERR;
+	if ('\0' == user[0] || strlen(user) >= sizeof(entry.name) ||
+	    !od_verifier_cost_valid(params->log2_n, params->r, params->p))
+		return PAM_SERVICE_ERR;
+
+	memset(&entry, 0, sizeof(entry));
+	memcpy(entry.name, user, strlen(user));
+	arc4random_buf(entry.salt, sizeof(entry.salt));
+	entry.log2_n = params->log2_n;
+	entry.r = params->r;
+	entry.p = params->p;
+	entry.stored = time(NULL);
+
+	/* the expensive part happens without the lock */
+	if (0 != od_scrypt(password, strlen(password), entry.salt, sizeof(entry.salt),
+			   entry.log2_n, entry.r, entry.p, entry.hash, sizeof(entry.hash)))
+		return (ENOMEM == errno) ? PAM_BUF_ERR : PAM_SERVICE_ERR;
+
+	if (NULL == (table = od_shared_table_lock(&cache->shared))) {
+		od_scrypt_wipe(&entry, sizeof(entry));
+		return PAM_SYSTEM_ERR;
+	}
+
+	/* the user's slot, else a free one, else the oldest */
+	slot = od_verifier_find(table, user);
+	for (i = 0; i < kODVerifierSlots && NULL == slot; ++i) {
+		if ('\0' == table->entries[i].name[0])
+			slot = &table->entries[i];
+	}
+	if (NULL == slot) {
+		slot = &table->entries[0];
+		for (i = 1; i < kODVerifierSlots; ++i) {
+			if (table->entries[i].stored < slot->stored)
+				slot = &table->entries[i];
+		}
+	}
+	*slot = entry;
+
+	od_shared_table_unlock(&cache->shared);
+	od_scrypt_wipe(&entry, sizeof(entry));
+
+	return PAM_SUCCESS;
+}
+
+int
+od_verifier_check(struct od_verifier_cache *cache, const char *user, const char *password,
+		  const struct od_verifier_params *params)
+{
+	struct od_verifier_table *table = NULL;
+	struct od_verifier_entry entry, *slot = NULL;
+	uint8_t hash[kODVerifierHashSize];
+	uint8_t diff = 0;
+	bool usable = false;
+	size_t i;
+	int retval = PAM_AUTHINFO_UNAVAIL;
+
+	if (NULL == cache || NULL == user || NULL == password || NULL == params)
+		return PAM_SERVICE_ERR;
+
+	memset(&entry, 0, sizeof(entry));
+	if (NULL != (table = od_shared_table_lock(&cache->shared))) {
+		if (NULL != (slot = od_verifier_find(table, user))) {
+			if (od_verifier_expired(slot, params->max_age, time(NULL)) ||
+			    !od_verifier_cost_valid(slot->log2_n, slot->r, slot->p)) {
+				od_scrypt_wipe(slot, sizeof(*slot));
+			} else {
+				entry = *slot;
+				usable = true;
+			}
+		}
+		od_shared_table_unlock(&cache->shared);
+	}
+
+	/*
+	 * Without a verifier, hash against a throwaway one at the configured
+	 * cost so the answer does not come back any sooner.
+	 */
+	if (!usable) {
+		arc4random_buf(entry.salt, sizeof(entry.salt));
+		entry.log2_n = params->log2_n;
+		entry.r = params->r;
+		entry.p = params->p;
+		if (!od_verifier_cost_valid(entry.log2_n, entry.r, entry.p)) {
+			entry.log2_n = kVerifierLog2NDefault;
+			entry.r = kVerifierRDefault;
+			entry.p = kVerifierPDefault;
+		}
+	}
+
+	if (0 != od_scrypt(password, strlen(password), entry.salt, sizeof(entry.salt),
+			   entry.log2_n, entry.r, entry.p, hash, sizeof(hash))) {
+		retval = (ENOMEM == errno) ? PAM_BUF_ERR : PAM_SERVICE_ERR;
+		goto cleanup;
+	}
+
+	for (i = 0; i < sizeof(hash); ++i)
+		diff |= hash[i] ^ entry.hash[i];
+	if (usable)
+		retval = (0 == diff) ? PAM_SUCCESS : PAM_AUTH_ERR;
+
+cleanup:
+	od_scrypt_wipe(hash, sizeof(hash));
+	od_scrypt_wipe(&entry, sizeof(entry));
+
+	return retval;
+}
+
+int
+od_verifier_set_account(struct od_verifier_cache *cache, const char *user, bool allowed)
+{
+	struct od_verifier_table *table = NULL;
+	struct od_verifier_entry *slot = NULL;
+	int retval = PAM_SUCCESS;
+
+	if (NULL == cache || NULL == user)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_shared_table_lock(&cache->shared)))
+		return PAM_SYSTEM_ERR;
+
+	if (NULL == (slot = od_verifier_find(table, user)))
+		retval = PAM_USER_UNKNOWN;
+	else if (allowed)
+		slot->account = kODVerifierAccountAllowed;
+	else
+		od_scrypt_wipe(slot, sizeof(*slot));
+
+	od_shared_table_unlock(&cache->shared);
+
+	return retval;
+}
+
+int
+od_verifier_check_account(struct od_verifier_cache *cache, const char *user, const struct od_verifier_params *params)
+{
+	struct od_verifier_table *table = NULL;
+	struct od_verifier_entry *slot = NULL;
+	int retval = PAM_AUTHINFO_UNAVAIL;
+
+	if (NULL == cache || NULL == user || NULL == params)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_shared_table_lock(&cache->shared)))
+		return PAM_SYSTEM_ERR;
+
+	if (NULL != (slot = od_verifier_find(table, user)) &&
+	    !od_verifier_expired(slot, params->max_age, time(NULL)) &&
+	    kODVerifierAccountAllowed == slot->account)
+		retval = PAM_SUCCESS;
+
+	od_shared_table_unlock(&cache->shared);
+
+	return retval;
+}
+
+int
+od_verifier_invalidate(struct od_verifier_cache *cache, const char *user)
+{
+	struct od_verifier_table *table = NULL;
+	struct od_verifier_entry *slot = NULL;
+	int retval = PAM_SUCCESS;
+
+	if (NULL == cache)
+		return PAM_SERVICE_ERR;
+	if (NULL == (table = od_shared_table_lock(&cache->shared)))
+		return PAM_SYSTEM_ERR;
+
+	if (NULL == user)
+		od_scrypt_wipe(table->entries, sizeof(table->entries));
+	else if (NULL != (slot = od_verifier_find(table, user)))
+		od_scrypt_wipe(slot, sizeof(*slot));
+	else
+		retval = PAM_USER_UNKNOWN;
+
+	od_shared_table_unlock(&cache->shared);
+
+	return retval;
+}
+
+size_t
+od_verifier_list(struct od_verifier_cache *cache, struct od_verifier_entry *out, size_t max)
+{
+	struct od_verifier_table *table = NULL;
+	size_t count = 0;
+	int i;
+
+	if (NULL == cache || NULL == out)
+		return 0;
+	if (NULL == (table = od_shared_table_lock(&cache->shared)))
+		return 0;
+
+	for (i = 0; i < kODVerifierSlots && count < max; ++i) {
+		if ('\0' == table->entries[i].name[0])
+			continue;
+		out[count] = table->entries[i];
+		memset(out[count].salt, 0, sizeof(out[count].salt));
+		memset(out[count].hash, 0, sizeof(out[count].hash));
+		++count;
+	}
+
+	od_shared_table_unlock(&cache->shared);
+
+	return count;
+}
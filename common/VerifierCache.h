@@ -0,0 +1,91 @@
+/*
+ * Cached password verifiers.  After the directory accepts a password,
+ * pam_opendirectory can keep a salted scrypt hash of it so the user can
+ * still be authenticated while the directory is slow or unreachable.  The
+ * verifiers live in a root-only file shared by every process on the
+ * system; nothing in here depends on CoreFoundation.
+ */
+
+#ifndef _VERIFIERCACHE_H_
+#define _VERIFIERCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OD_VERIFIER_PATH "/var/db/pam_opendirectory.verifiers"
+
+enum {
+	kODVerifierSlots    = 256,
+	kODVerifierNameMax  = 256,
+	kODVerifierSaltSize = 16,
+	kODVerifierHashSize = 32
+};
+
+/* what the account management module last found for the user */
+enum {
+	kODVerifierAccountUnchecked = 0,
+	kODVerifierAccountAllowed   = 1
+};
+
+struct od_verifier_params {
+	unsigned int	log2_n;		/* scrypt cost */
+	uint32_t	r;
+	uint32_t	p;
+	uint64_t	max_age;	/* s, older verifiers are ignored and dropped */
+};
+
+struct od_verifier_entry {
+	char		name[kODVerifierNameMax];	/* empty for a free slot */
+	uint8_t		salt[kODVerifierSaltSize];
+	uint8_t		hash[kODVerifierHashSize];
+	uint32_t	log2_n;
+	uint32_t	r;
+	uint32_t	p;
+	uint32_t	account;	/* kODVerifierAccount*, unchecked for a new verifier */
+	int64_t		stored;		/* time(3) of the verification it came from */
+};
+
+struct od_verifier_table {
+	uint32_t	magic;
+	uint32_t	version;
+	struct od_verifier_entry entries[kODVerifierSlots];
+};
+
+struct od_verifier_cache;
+
+/*
+ * Maps the table at path, creating it if asked to.  Returns NULL if the
+ * file is missing or anyone but its owner (root, or the caller) can read it.
+ */
+struct od_verifier_cache *od_verifier_open(const char *path, bool create);
+void od_verifier_close(struct od_verifier_cache *);
+
+void od_verifier_default_params(struct od_verifier_params *);
+
+/* Every call returns a PAM status. */
+int od_verifier_store(struct od_verifier_cache *, const char *user, const char *password,
+		      const struct od_verifier_params *);
+/*
+ * PAM_SUCCESS or PAM_AUTH_ERR when a verifier younger than max_age is
+ * held for user, else PAM_AUTHINFO_UNAVAIL.  Takes the same time either way.
+ */
+int od_verifier_check(struct od_verifier_cache *, const char *user, const char *password,
+		      const struct od_verifier_params *);
+/*
+ * Records the account check the directory answered for user's verifier:
+ * allowed marks it, a denial drops the verifier.
+ */
+int od_verifier_set_account(struct od_verifier_cache *, const char *user, bool allowed);
+/*
+ * PAM_SUCCESS when user's verifier is younger than max_age and the account
+ * was allowed since it was stored, else PAM_AUTHINFO_UNAVAIL.
+ */
+int od_verifier_check_account(struct od_verifier_cache *, const char *user, const struct od_verifier_params *);
+/* drops user's verifier, or every verifier when user is NULL */
+int od_verifier_invalidate(struct od_verifier_cache *, const char *user);
+
+/* copies out up to max entries with their salts and hashes cleared, returns how many */
+size_t od_verifier_list(struct od_verifier_cache *, struct od_verifier_entry *out, size_t max);
+
+#endif /* _VERIFIERCACHE_H_ */
@@ -50,10 +50,13 @@
 #include <sys/cdefs.h>
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -93,7 +96,6 @@ krb5_error_code _krb5_kcm_get_initial_ticket(krb5_context context,
 /* #define	COMPAT_MIT  */
 
 static int	verify_krb_v5_tgt(krb5_context, krb5_ccache, char *, int);
-static const	char *compat_princ_component(krb5_context, krb5_principal, int);
 static void	compat_free_data_contents(krb5_context, krb5_data *);
 
 #define USER_PROMPT		"Username: "
@@ -101,6 +103,7 @@ static void	compat_free_data_contents(krb5_context, krb5_data *);
 #define NEW_PASSWORD_PROMPT	"New Password:"
 
 #define PAM_OPT_CCACHE		"ccache"
+#define PAM_OPT_MEMORY_CCACHE	"memory_ccache"
 #define PAM_OPT_NO_AUTH_CCACHE        "no_auth_ccache"
 #define PAM_OPT_DEBUG		"debug"
 #define PAM_OPT_DEFAULT_PRINCIPAL	"default_principal"
@@ -119,9 +122,29 @@ static void	compat_free_data_contents(krb5_context, krb5_data *);
 #endif
 
 #include "Common.h"
+#include "Krb5ContextPool.h"
+#include "Krb5Forwardable.h"
 
 static const char *password_key = "KRB5PWD";
 static const char *user_key = "KRB5USER";
+static const char *temp_ccache_key = "krb5_ccache";
+
+/* Destroys the temporary cache when setcred is done with it, or never came */
+static void
+temp_ccache_cleanup(pam_handle_t *pamh __unused, void *data, int pam_end_status __unused)
+{
+	krb5_context context;
+	krb5_ccache ccache;
+
+	if (NULL == data)
+		return;
+	if (0 == od_krb5_context_get(&context)) {
+		if (0 == krb5_cc_resolve(context, data, &ccache))
+			krb5_cc_destroy(context, ccache);
+		od_krb5_context_put(context);
+	}
+	free(data);
+}
 
 
 /*
@@ -141,6 +164,8 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 	struct passwd pwdbuf;
 	char pwbuffer[2 * PATH_MAX];
 	int retval, have_tickets = 0;
+	bool forwardable_refused = false, memory_ccache;
+	const char *realm;
 	const void *ccache_data;
 	const char *user;
 	char *pass;
@@ -166,7 +191,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 
     _LOG_DEBUG("Got service: %s", (const char *)service);
 
-	krbret = krb5_init_context(&pam_context);
+	krbret = od_krb5_context_get(&pam_context);
 	if (krbret != 0) {
         _LOG_ERROR("Kerberos 5 error");
 		return (PAM_SERVICE_ERR);
@@ -207,7 +232,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 		}
 
 		free(principal);
-		krb5_free_context(pam_context);
+		od_krb5_context_put(pam_context);
 
 		return (PAM_IGNORE);
 	}
@@ -282,8 +307,13 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 
     _LOG_DEBUG("Done getpwnam()");
 
-	/* Get a TGT */
-	if (NULL == openpam_get_option(pamh, PAM_OPT_NO_FORWARDABLE)) {
+	/*
+	 * Get a TGT.  A realm whose KDC lately refused a forwardable one is
+	 * asked for a non-forwardable one straight away.
+	 */
+	realm = krb5_principal_get_realm(pam_context, princ);
+	if (NULL == openpam_get_option(pamh, PAM_OPT_NO_FORWARDABLE) &&
+	    !od_krb5_forwardable_refused(pamh, realm)) {
 		krb5_get_init_creds_opt_set_forwardable(opts, 1);
 		krb5_get_init_creds_opt_set_proxiable(opts, 1);
 
@@ -294,8 +324,12 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 		if (krbret != 0) {
 			krb5_get_init_creds_opt_set_forwardable(opts, 0);
 			krb5_get_init_creds_opt_set_proxiable(opts, 0);
+			/* only a policy answer is worth remembering, not a bad password */
+			forwardable_refused = (krbret == KRB5KDC_ERR_BADOPTION ||
+			    krbret == KRB5KDC_ERR_POLICY);
 		} else {
             _LOG_DEBUG("Have a forwardable TGT.");
+			od_krb5_forwardable_record(pamh, realm, false);
 			have_tickets = 1;
 		}
 	}
@@ -311,12 +345,21 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 			retval = PAM_AUTH_ERR;
 			goto cleanup2;
 		}
+		if (forwardable_refused)
+			od_krb5_forwardable_record(pamh, realm, true);
 	}
 
     _LOG_DEBUG("Got TGT");
 
-	/* Generate a temporary cache */
-	krbret = krb5_cc_new_unique(pam_context, "FILE", NULL, &ccache);
+	/*
+	 * Generate a temporary cache.  Its name reaches setcred through the PAM
+	 * environment, which applications that call setcred from another
+	 * process, like sshd's monitor, pass along.  With memory_ccache it is
+	 * held in this process's memory instead and nothing is written to disk,
+	 * but setcred has to be called from this process or a child of it.
+	 */
+	memory_ccache = (NULL != openpam_get_option(pamh, PAM_OPT_MEMORY_CCACHE));
+	krbret = krb5_cc_new_unique(pam_context, memory_ccache ? "MEMORY" : "FILE", NULL, &ccache);
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_cc_gen_new(): %s",
 		    krb5_get_err_text(pam_context, krbret));
@@ -327,6 +370,7 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_cc_initialize(): %s",
 		    krb5_get_err_text(pam_context, krbret));
+		krb5_cc_destroy(pam_context, ccache);
 		retval = PAM_SERVICE_ERR;
 		goto cleanup;
 	}
@@ -373,17 +417,27 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags __unused,
 	asprintf(&ccache_name, "%s:%s", krb5_cc_get_type(pam_context,
 		ccache), krb5_cc_get_name(pam_context, ccache));
 	if (ccache_name == NULL) {
+		krb5_cc_destroy(pam_context, ccache);
         _LOG_ERROR("Kerberos 5 error");
 		retval = PAM_BUF_ERR;
 		goto cleanup;
 	}
-	retval = pam_setenv(pamh, "krb5_ccache", ccache_name, 1);
-	if (retval != 0) {
+	if (memory_ccache) {
+		retval = pam_set_data(pamh, temp_ccache_key, ccache_name, temp_ccache_cleanup);
+		if (retval != PAM_SUCCESS)
+			free(ccache_name);
+	} else {
+		retval = pam_setenv(pamh, temp_ccache_key, ccache_name, 1);
+		free(ccache_name);
+	}
+	if (retval != PAM_SUCCESS) {
 		krb5_cc_destroy(pam_context, ccache);
         _LOG_ERROR("Kerberos 5 error");
 		retval = PAM_SERVICE_ERR;
 		goto cleanup;
 	}
+	/* closed, the cache stays until setcred destroys it */
+	krb5_cc_close(pam_context, ccache);
 
     _LOG_DEBUG("Credentials stash saved");
 
@@ -403,7 +457,7 @@ cleanup3:
 	if (opts)
 		krb5_get_init_creds_opt_free(pam_context, opts);
 
-	krb5_free_context(pam_context);
+	od_krb5_context_put(pam_context);
 
     _LOG_DEBUG("Done cleanup3");
 
@@ -424,9 +478,7 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	krb5_error_code krbret;
 	krb5_context pam_context = NULL;
 	krb5_principal princ = NULL;
-	krb5_creds creds;
 	krb5_ccache ccache_temp, ccache_perm = NULL;
-	krb5_cc_cursor cursor;
 	struct passwd *pwd = NULL;
 	struct passwd pwdbuf;
 	char pwbuffer[2 * PATH_MAX];
@@ -437,6 +489,7 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	const void *cache_data;
 	char *cache_name_buf = NULL, *p = NULL, *cache_type_colon_name = NULL;
 	int use_kcminit;
+	bool memory_ccache = false;
     
 	uid_t euid;
 	gid_t egid;
@@ -444,7 +497,7 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	if (flags & PAM_DELETE_CRED) {
 		krb5_cccol_cursor cursor;
 
-		krbret = krb5_init_context(&pam_context);
+		krbret = od_krb5_context_get(&pam_context);
 		if (krbret != 0) {
             _LOG_DEBUG("Error krb5_init_secure_context() failed");
 			retval = PAM_SERVICE_ERR;
@@ -505,7 +558,7 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 
     _LOG_DEBUG("Got user: %s", (const char *)user);
 
-	krbret = krb5_init_context(&pam_context);
+	krbret = od_krb5_context_get(&pam_context);
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_init_secure_context() failed");
 		retval = PAM_SERVICE_ERR;
@@ -522,8 +575,10 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	use_kcminit = (openpam_get_option(pamh, PAM_OPT_USE_KCMINIT) != NULL);
 
 	if (!use_kcminit) {
-		/* Retrieve the temporary cache */
-		if ((cache_data = pam_getenv(pamh, "krb5_ccache")) == NULL) {
+		/* Retrieve the temporary cache, kept in memory or named in the environment */
+		if (pam_get_data(pamh, temp_ccache_key, &cache_data) == PAM_SUCCESS && cache_data != NULL) {
+			memory_ccache = true;
+		} else if ((cache_data = pam_getenv(pamh, temp_ccache_key)) == NULL) {
             _LOG_DEBUG("Error pam_getenv failed.");
 			retval = PAM_IGNORE;
 			goto cleanup3;
@@ -611,15 +666,6 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 		retval = PAM_SUCCESS;
 	} else {
 
-		/* Initialize the new ccache */
-		krbret = krb5_cc_get_principal(pam_context, ccache_temp, &princ);
-		if (krbret != 0) {
-            _LOG_ERROR("Error krb5_cc_get_principal(): %s",
-				krb5_get_err_text(pam_context, krbret));
-			retval = PAM_SERVICE_ERR;
-			goto cleanup3;
-		}
-
 		/* Get the cache name */
 		cache_name = openpam_get_option(pamh, PAM_OPT_CCACHE);
 		if (cache_name == NULL) {
@@ -673,56 +719,37 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 				goto cleanup2;
 			}
 		}
-		krbret = krb5_cc_initialize(pam_context, ccache_perm, princ);
-		if (krbret != 0) {
-            _LOG_ERROR("Error krb5_cc_initialize(): %s",
-				krb5_get_err_text(pam_context, krbret));
-			retval = PAM_SERVICE_ERR;
-			goto cleanup2;
-		}
-
-        _LOG_DEBUG("Cache initialised");
-
-		/* Prepare for iteration over creds */
-		krbret = krb5_cc_start_seq_get(pam_context, ccache_temp, &cursor);
+		/*
+		 * Initialize the new ccache and copy the creds (should be two of
+		 * them) in one call.  krb5_cc_move() would be a single switch, but
+		 * only between caches of the same type.
+		 */
+		krbret = krb5_cc_copy_cache(pam_context, ccache_temp, ccache_perm);
 		if (krbret != 0) {
-            _LOG_ERROR("Error krb5_cc_start_seq_get(): %s",
+            _LOG_ERROR("Error krb5_cc_copy_cache(): %s",
 				krb5_get_err_text(pam_context, krbret));
 			krb5_cc_destroy(pam_context, ccache_perm);
 			retval = PAM_SERVICE_ERR;
 			goto cleanup2;
 		}
 
-        _LOG_DEBUG("Prepared for iteration");
+        _LOG_DEBUG("Credentials copied");
 
-		/* Copy the creds (should be two of them) */
-		while ((krbret = krb5_cc_next_cred(pam_context, ccache_temp,
-						   &cursor, &creds) == 0)) {
-			krbret = krb5_cc_store_cred(pam_context, ccache_perm, &creds);
+		if (memory_ccache) {
+			/* dropping the data destroys the temporary cache */
+			krb5_cc_close(pam_context, ccache_temp);
+			pam_set_data(pamh, temp_ccache_key, NULL, NULL);
+		} else {
+			krbret = krb5_cc_destroy(pam_context, ccache_temp);
 			if (krbret != 0) {
-                _LOG_ERROR("Error krb5_cc_store_cred(): %s",
-					krb5_get_err_text(pam_context, krbret));
+                _LOG_ERROR("Error krb5_cc_destroy(): %s",
+						krb5_get_err_text(pam_context, krbret));
 				krb5_cc_destroy(pam_context, ccache_perm);
-				krb5_free_cred_contents(pam_context, &creds);
 				retval = PAM_SERVICE_ERR;
 				goto cleanup2;
 			}
-			krb5_free_cred_contents(pam_context, &creds);
-            _LOG_DEBUG("Iteration");
-		}
-		krb5_cc_end_seq_get(pam_context, ccache_temp, &cursor);
-
-        _LOG_DEBUG("Done iterating");
-
-		krbret = krb5_cc_destroy(pam_context, ccache_temp);
-		if (krbret != 0) {
-            _LOG_ERROR("Error krb5_cc_destroy(): %s",
-					krb5_get_err_text(pam_context, krbret));
-			krb5_cc_destroy(pam_context, ccache_perm);
-			retval = PAM_SERVICE_ERR;
-			goto cleanup2;
 		}
-        _LOG_DEBUG("Temporary FILE cache destroyed");
+        _LOG_DEBUG("Temporary cache destroyed");
 	}
 
 	/* Get the cache type and name */
@@ -784,7 +811,7 @@ cleanup3:
 		free(cache_name_buf);
 cleanup4:
 	if (pam_context)
-		krb5_free_context(pam_context);
+		od_krb5_context_put(pam_context);
 	pam_unsetenv(pamh, user_key);
 	pam_unsetenv(pamh, password_key);
     _LOG_DEBUG("Done cleanup4");
@@ -823,7 +850,7 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags __unused,
 
     _LOG_DEBUG("Got credentials");
 
-	krbret = krb5_init_context(&pam_context);
+	krbret = od_krb5_context_get(&pam_context);
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_init_secure_context() failed");
 		return (PAM_PERM_DENIED);
@@ -835,7 +862,7 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags __unused,
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_cc_resolve(\"%s\"): %s", (const char *)ccache_name,
 		    krb5_get_err_text(pam_context, krbret));
-		krb5_free_context(pam_context);
+		od_krb5_context_put(pam_context);
 		return (PAM_PERM_DENIED);
 	}
 
@@ -861,7 +888,7 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags __unused,
     _LOG_DEBUG("Done kuserok()");
 
 cleanup:
-	krb5_free_context(pam_context);
+	od_krb5_context_put(pam_context);
     _LOG_DEBUG("Done cleanup");
 
 	return (retval);
@@ -895,7 +922,7 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags,
 
     _LOG_DEBUG("Got user: %s", (const char *)user);
 
-	krbret = krb5_init_context(&pam_context);
+	krbret = od_krb5_context_get(&pam_context);
 	if (krbret != 0) {
         _LOG_ERROR("Error krb5_init_secure_context() failed");
 		return (PAM_SERVICE_ERR);
@@ -1000,7 +1027,7 @@ cleanup3:
 	if (opts)
 		krb5_get_init_creds_opt_free(pam_context, opts);
 
-	krb5_free_context(pam_context);
+	od_krb5_context_put(pam_context);
 
     _LOG_DEBUG("Done cleanup3");
 
@@ -1009,6 +1036,253 @@ cleanup3:
 
 PAM_MODULE_ENTRY("pam_krb5");
 
+/*
+ * Service key cache for verify_krb_v5_tgt().  Resolving the service
+ * principals may canonicalize the host name through DNS, and reading a
+ * service key opens and scans the keytab; every login did both for "host"
+ * and again for its own service.  The principals are kept per host name and
+ * Kerberos configuration, and the default keytab's entries as long as the
+ * file's identity and modification time stay the same.  Each verification
+ * gets a private memory keytab filled from the copy.
+ */
+enum {
+	kServicePrincipalMax = 8
+};
+
+struct service_principal {
+	char		*service;
+	krb5_principal	principal;
+};
+
+struct keytab_stamp {
+	dev_t		dev;
+	ino_t		ino;
+	off_t		size;
+	struct timespec	mtime;
+	char		path[PATH_MAX];
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	/* principals, for this host name and configuration */
+	char				host[MAXHOSTNAMELEN];
+	uint64_t			config;
+	struct service_principal	principals[kServicePrincipalMax];
+	unsigned int			nprincipals;
+	/* the default keytab as it was when read */
+	bool				have_keytab;
+	struct keytab_stamp		stamp;
+	krb5_keytab_entry		*entries;
+	size_t				nentries;
+} service_keys = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int service_keytab_serial;
+
+/*
+ * Lock held.  None of the Heimdal copy and free functions use the context
+ * beyond error reporting, so any context can free what another copied.
+ */
+static void
+service_keys_flush_principals(krb5_context context)
+{
+	while (service_keys.nprincipals > 0) {
+		struct service_principal *p = &service_keys.principals[--service_keys.nprincipals];
+
+		free(p->service);
+		krb5_free_principal(context, p->principal);
+	}
+}
+
+/* lock held */
+static void
+service_keys_flush_keytab(krb5_context context)
+{
+	size_t i;
+
+	for (i = 0; i < service_keys.nentries; ++i)
+		krb5_kt_free_entry(context, &service_keys.entries[i]);
+	free(service_keys.entries);
+	service_keys.entries = NULL;
+	service_keys.nentries = 0;
+	service_keys.have_keytab = false;
+}
+
+/* krb5_sname_to_principal() for this host, from the cache when nothing changed */
+static krb5_error_code
+service_principal_get(krb5_context context, const char *service, krb5_principal *principal)
+{
+	char host[MAXHOSTNAMELEN];
+	uint64_t config = od_krb5_config_generation();
+	krb5_error_code ret;
+	unsigned int i;
+
+	if (0 != gethostname(host, sizeof(host)))
+		host[0] = '\0';
+	host[sizeof(host) - 1] = '\0';
+
+	pthread_mutex_lock(&service_keys.lock);
+	if (config != service_keys.config || 0 != strcmp(host, service_keys.host)) {
+		service_keys_flush_principals(context);
+		strlcpy(service_keys.host, host, sizeof(service_keys.host));
+		service_keys.config = config;
+	}
+	for (i = 0; i < service_keys.nprincipals; ++i) {
+		if (0 == strcmp(service, service_keys.principals[i].service)) {
+			ret = krb5_copy_principal(context, service_keys.principals[i].principal, principal);
+			pthread_mutex_unlock(&service_keys.lock);
+			return ret;
+		}
+	}
+	pthread_mutex_unlock(&service_keys.lock);
+
+	ret = krb5_sname_to_principal(context, NULL, service, KRB5_NT_SRV_HST, principal);
+	if (0 != ret)
+		return ret;
+
+	pthread_mutex_lock(&service_keys.lock);
+	if (config == service_keys.config && 0 == strcmp(host, service_keys.host) &&
+	    service_keys.nprincipals < kServicePrincipalMax) {
+		struct service_principal *p = &service_keys.principals[service_keys.nprincipals];
+
+		if (NULL != (p->service = strdup(service))) {
+			if (0 == krb5_copy_principal(context, *principal, &p->principal))
+				++service_keys.nprincipals;
+			else
+				free(p->service);
+		}
+	}
+	pthread_mutex_unlock(&service_keys.lock);
+
+	return 0;
+}
+
+/* Identity of the default keytab, if it is a single file */
+static bool
+keytab_stamp_get(krb5_context context, struct keytab_stamp *stamp)
+{
+	char name[PATH_MAX + 8];
+	const char *path = name;
+	struct stat sb;
+
+	if (0 != krb5_kt_default_name(context, name, sizeof(name)))
+		return false;
+	if (0 == strncmp(name, "FILE:", 5))
+		path += 5;
+	else if ('/' != name[0])
+		return false;
+	if (NULL != strchr(path, ',') || 0 != stat(path, &sb))
+		return false;
+
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->dev = sb.st_dev;
+	stamp->ino = sb.st_ino;
+	stamp->size = sb.st_size;
+	stamp->mtime = sb.st_mtimespec;
+	strlcpy(stamp->path, path, sizeof(stamp->path));
+
+	return true;
+}
+
+static bool
+keytab_stamp_equal(const struct keytab_stamp *a, const struct keytab_stamp *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	    a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+	    0 == strcmp(a->path, b->path);
+}
+
+/* lock held; read the whole default keytab into the cache */
+static krb5_error_code
+service_keys_load(krb5_context context)
+{
+	krb5_keytab keytab = NULL;
+	krb5_kt_cursor cursor;
+	krb5_keytab_entry entry, *entries = NULL, *grown = NULL;
+	size_t count = 0, capacity = 0;
+	krb5_error_code ret;
+
+	if (0 != (ret = krb5_kt_default(context, &keytab)))
+		return ret;
+	if (0 != (ret = krb5_kt_start_seq_get(context, keytab, &cursor))) {
+		krb5_kt_close(context, keytab);
+		return ret;
+	}
+	while (0 == krb5_kt_next_entry(context, keytab, &entry, &cursor)) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 8;
+			if (NULL == (grown = realloc(entries, capacity * sizeof(*entries)))) {
+				krb5_kt_free_entry(context, &entry);
+				ret = ENOMEM;
+				break;
+			}
+			entries = grown;
+		}
+		/* the entry's contents move into the array */
+		entries[count++] = entry;
+	}
+	krb5_kt_end_seq_get(context, keytab, &cursor);
+	krb5_kt_close(context, keytab);
+
+	if (0 != ret) {
+		while (count > 0)
+			krb5_kt_free_entry(context, &entries[--count]);
+		free(entries);
+		return ret;
+	}
+
+	service_keys.entries = entries;
+	service_keys.nentries = count;
+	service_keys.have_keytab = true;
+
+	return 0;
+}
+
+/*
+ * A keytab holding what the default keytab holds: a private memory copy
+ * while the file is unchanged, else the default keytab itself.
+ */
+static krb5_error_code
+service_keytab_get(krb5_context context, krb5_keytab *keytab)
+{
+	struct keytab_stamp stamp, after;
+	char name[64];
+	krb5_error_code ret = 0;
+	size_t i;
+
+	*keytab = NULL;
+	if (!keytab_stamp_get(context, &stamp))
+		return krb5_kt_default(context, keytab);
+
+	pthread_mutex_lock(&service_keys.lock);
+	if (service_keys.have_keytab && !keytab_stamp_equal(&stamp, &service_keys.stamp))
+		service_keys_flush_keytab(context);
+	if (!service_keys.have_keytab) {
+		ret = service_keys_load(context);
+		/* rewritten while being read: use it this time, read it again next time */
+		if (0 == ret && (!keytab_stamp_get(context, &after) || !keytab_stamp_equal(&stamp, &after)))
+			memset(&stamp, 0, sizeof(stamp));
+		service_keys.stamp = stamp;
+	}
+	if (0 == ret) {
+		snprintf(name, sizeof(name), "MEMORY:pam_krb5.%d.%u", (int)getpid(),
+		    __atomic_add_fetch(&service_keytab_serial, 1, __ATOMIC_RELAXED));
+		ret = krb5_kt_resolve(context, name, keytab);
+	}
+	for (i = 0; 0 == ret && i < service_keys.nentries; ++i)
+		ret = krb5_kt_add_entry(context, *keytab, &service_keys.entries[i]);
+	pthread_mutex_unlock(&service_keys.lock);
+
+	if (0 != ret) {
+		if (NULL != *keytab) {
+			krb5_kt_close(context, *keytab);
+			*keytab = NULL;
+		}
+		return krb5_kt_default(context, keytab);
+	}
+
+	return 0;
+}
+
 /*
  * This routine with some modification is from the MIT V5B6 appl/bsd/login.c
  * Modified by Sam Hartman <hartmans@mit.edu> to support PAM services
@@ -1029,11 +1303,11 @@ verify_krb_v5_tgt(krb5_context context, krb5_ccache ccache,
     char *pam_service, int debug)
 {
 	krb5_error_code retval;
-	krb5_principal princ;
-	krb5_keyblock *keyblock;
+	krb5_principal princ = NULL;
+	krb5_keytab keytab = NULL;
+	krb5_keytab_entry entry;
 	krb5_data packet;
-	krb5_auth_context auth_context;
-	char phost[BUFSIZ];
+	krb5_auth_context auth_context = NULL;
 	const char *services[3], **service;
 
 	packet.data = 0;
@@ -1050,36 +1324,39 @@ verify_krb_v5_tgt(krb5_context context, krb5_ccache ccache,
 	services[0] = "host";
 	services[1] = pam_service;
 	services[2] = NULL;
-	keyblock = 0;
+	retval = service_keytab_get(context, &keytab);
+	if (retval != 0) {
+		if (debug)
+            _LOG_DEBUG("pam_krb5: verify_krb_v5_tgt(): %s: %s",
+			    "krb5_kt_default()",
+			    krb5_get_err_text(context, retval));
+		retval = 0;
+		goto cleanup;
+	}
 	retval = -1;
 	for (service = &services[0]; *service != NULL; service++) {
-		retval = krb5_sname_to_principal(context, NULL, *service,
-		    KRB5_NT_SRV_HST, &princ);
+		retval = service_principal_get(context, *service, &princ);
 		if (retval != 0) {
 			if (debug)
                 _LOG_DEBUG("pam_krb5: verify_krb_v5_tgt(): %s: %s",
 				    "krb5_sname_to_principal()",
 				    krb5_get_err_text(context, retval));
-			return -1;
+			retval = -1;
+			goto cleanup;
 		}
 
-		/* Extract the name directly. */
-		strncpy(phost, compat_princ_component(context, princ, 1),
-		    BUFSIZ);
-		phost[BUFSIZ - 1] = '\0';
-
 		/*
 		 * Do we have service/<host> keys?
 		 * (use default/configured keytab, kvno IGNORE_VNO to get the
 		 * first match, and ignore enctype.)
 		 */
-		retval = krb5_kt_read_service_key(context, NULL, princ, 0, 0,
-		    &keyblock);
+		retval = krb5_kt_get_entry(context, keytab, princ, 0, 0, &entry);
 		if (retval != 0) {
 			krb5_free_principal(context, princ);
 			princ = NULL;
 			continue;
 		}
+		krb5_kt_free_entry(context, &entry);
 		break;
 	}
 	if (retval != 0) {	/* failed to find key */
@@ -1091,12 +1368,10 @@ verify_krb_v5_tgt(krb5_context context, krb5_ccache ccache,
 		retval = 0;
 		goto cleanup;
 	}
-	if (keyblock)
-		krb5_free_keyblock(context, keyblock);
 
-	/* Talk to the kdc and construct the ticket. */
+	/* Talk to the kdc and construct the ticket, for the principal as resolved. */
 	auth_context = NULL;
-	retval = krb5_mk_req(context, &auth_context, 0, (char *)*service, phost,
+	retval = krb5_mk_req_exact(context, &auth_context, 0, princ,
 		NULL, ccache, &packet);
 	if (auth_context) {
 		krb5_auth_con_free(context, auth_context);
@@ -1105,15 +1380,29 @@ verify_krb_v5_tgt(krb5_context context, krb5_ccache ccache,
 	if (retval) {
 		if (debug)
             _LOG_DEBUG("pam_krb5: verify_krb_v5_tgt(): %s: %s",
-			    "krb5_mk_req()",
+			    "krb5_mk_req_exact()",
 			    krb5_get_err_text(context, retval));
 		retval = -1;
 		goto cleanup;
 	}
 
-	/* Try to use the ticket. */
-	retval = krb5_rd_req(context, &auth_context, &packet, princ, NULL,
-	    NULL, NULL);
+	/*
+	 * Try to use the ticket.  The request was made a moment ago in this
+	 * process and is read once without ever leaving it, so nobody can
+	 * replay it.  Keep it out of the replay cache, whose file locking and
+	 * fsync would otherwise serialize concurrent logins on the host.
+	 */
+	retval = krb5_auth_con_init(context, &auth_context);
+	if (retval == 0) {
+		krb5_int32 ac_flags = 0;
+
+		krb5_auth_con_getflags(context, auth_context, &ac_flags);
+		krb5_auth_con_setflags(context, auth_context,
+		    ac_flags & ~KRB5_AUTH_CONTEXT_DO_TIME);
+		krb5_auth_con_setrcache(context, auth_context, NULL);
+		retval = krb5_rd_req(context, &auth_context, &packet, princ,
+		    keytab, NULL, NULL);
+	}
 	if (retval) {
 		if (debug)
             _LOG_DEBUG("pam_krb5: verify_krb_v5_tgt(): %s: %s",
@@ -1125,9 +1414,13 @@ verify_krb_v5_tgt(krb5_context context, krb5_ccache ccache,
 		retval = 1;
 
 cleanup:
+	if (auth_context)
+		krb5_auth_con_free(context, auth_context);
 	if (packet.data)
 		compat_free_data_contents(context, &packet);
 	krb5_free_principal(context, princ);
+	if (keytab)
+		krb5_kt_close(context, keytab);
 	return retval;
 }
 
@@ -1144,13 +1437,6 @@ cleanup:
 #endif
 
 #ifdef COMPAT_HEIMDAL
-/* ARGSUSED */
-static const char *
-compat_princ_component(krb5_context context __unused, krb5_principal princ, int n)
-{
-	return princ->name.name_string.val[n];
-}
-
 /* ARGSUSED */
 static void
 compat_free_data_contents(krb5_context context __unused, krb5_data * data)
@@ -1160,12 +1446,6 @@ compat_free_data_contents(krb5_context context __unused, krb5_data * data)
 #endif
 
 #ifdef COMPAT_MIT
-static const char *
-compat_princ_component(krb5_context context, krb5_principal princ, int n)
-{
-	return krb5_princ_component(context, princ, n)->data;
-}
-
 static void
 compat_free_data_contents(krb5_context context, krb5_data * data)
 {
@@ -87,8 +87,9 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	uid_t euid = geteuid();
 	gid_t egid = getegid();
 	ODRecordRef record = NULL;
-	CFArrayRef array = NULL;
-	CFIndex i, count;
+	CFDataRef authdata = NULL;
+	const struct od_authauthority *aa = NULL;
+	const struct od_authauthority_entry *entry = NULL;
 
     _LOG_DEBUG("pam_sm_setcred: ntlm");
 
@@ -120,8 +121,9 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 		goto cleanup;
 	}
 
-	array = ODRecordCopyValues(record, kODAttributeTypeAuthenticationAuthority, NULL);
-	if (array == NULL) {
+	authdata = od_record_copy_authauthority(pamh, record);
+	aa = od_authauthority_get(authdata);
+	if (aa == NULL) {
         _LOG_ERROR("pam_sm_setcred: ntlm user %s doesn't have auth authority", user);
 		retval = PAM_IGNORE;
 		goto cleanup;
@@ -130,30 +132,16 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 	identity.username = (char *)user;
 	identity.password = (char *)password;
 
-	count = CFArrayGetCount(array);
-	for (i = 0; i < count && identity.realm == NULL; i++) {
-		CFStringRef val = CFArrayGetValueAtIndex(array, i);
-		if (NULL == val || CFGetTypeID(val) != CFStringGetTypeID())
-			break;
-
-		if (!CFStringHasPrefix(val, CFSTR(";NetLogon;")))
-			continue;
-
-		CFArrayRef parts = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, val, CFSTR(";"));
-		if (parts == NULL)
-			continue;
-
-		if (CFArrayGetCount(parts) < 4) {
-			CFRelease(parts);
+	while (identity.realm == NULL &&
+	       (entry = od_authauthority_find(aa, kODAuthAuthTagNetLogon, entry)) != NULL) {
+		if (entry->fields[0].length != 0 || entry->nfields < 4)
 			continue;
-		}
 
-		CFStringRef domain = CFArrayGetValueAtIndex(parts, 3);
-
-		retval = cfstring_to_cstring(domain, &identity.realm);
-		CFRelease(parts);
-		if (retval)
+		identity.realm = strdup(od_authauthority_field(aa, entry, 3));
+		if (identity.realm == NULL) {
+			retval = PAM_BUF_ERR;
 			goto cleanup;
+		}
 	}
 
 	if (identity.realm == NULL) {
@@ -193,8 +181,8 @@ pam_sm_setcred(pam_handle_t *pamh, int flags,
 cleanup:
 	if (record)
 		CFRelease(record);
-	if (array)
-		CFRelease(array);
+	if (authdata)
+		CFRelease(authdata);
 	if (identity.realm)
 		free(identity.realm);
 	pam_unsetenv(pamh, password_key);
@@ -0,0 +1,185 @@
+/*
+ * Print what the pam_opendirectory modules of all processes have recorded
+ * in their shared tables, for monitoring.  Run it as root; the tables are
+ * only readable by their owner.
+ *
+ * cc -I../../common -o od_stats od_stats.c ../../common/Common.c ../../common/Backend.c \
+ *	../../common/UserRecord.c ../../common/AuthAuthority.c ../../common/SharedTable.c \
+ *	-F/System/Library/PrivateFrameworks -framework CoreFoundation -framework OpenDirectory \
+ *	-framework DirectoryService -framework ServerInformation -lpam
+ *
+ * Usage: od_stats [blinding | admission | hedge | membership]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "Common.h"
+
+static int
+show_blinding(void)
+{
+	struct od_latency_histogram hist;
+	uint64_t count;
+	unsigned int i;
+
+	if (PAM_SUCCESS != od_blinding_copy_histogram(&hist))
+		return 1;
+
+	printf("Blinding\n");
+	printf("  Window           : %llu us\n", hist.window);
+	printf("  Successes        : %llu this period, %llu the one before\n",
+	       hist.samples[hist.current], hist.samples[hist.current ^ 1]);
+	for (i = 0; i < kODLatencyBuckets; ++i) {
+		if (0 == (count = hist.counts[0][i] + hist.counts[1][i]))
+			continue;
+		printf("  < %-14llu : %llu\n", od_latency_bucket_limit(i), count);
+	}
+
+	return 0;
+}
+
+static const char *const admission_classes[kODAdmissionClasses] = {
+	"interactive",
+	"normal",
+	"batch",
+};
+
+static int
+show_admission(void)
+{
+	struct od_admission_stats stats;
+	const struct od_admission_stats_class *class = NULL;
+	int i;
+
+	if (PAM_SUCCESS != od_admission_copy_stats(&stats))
+		return 1;
+
+	printf("Admission\n");
+	printf("  Running          : %u\n", stats.running);
+	printf("  Queued           : %u (peak %u)\n", stats.depth, stats.peak_depth);
+	printf("  %-16s %10s %10s %12s %12s\n", "class", "admitted", "rejected", "avg wait us", "max wait us");
+	for (i = 0; i < kODAdmissionClasses; ++i) {
+		class = &stats.classes[i];
+		printf("  %-16s %10llu %10llu %12llu %12llu\n", admission_classes[i],
+		       class->admitted, class->rejected,
+		       (0 != class->admitted) ? class->wait_usec / class->admitted : 0,
+		       class->max_wait_usec);
+	}
+
+	return 0;
+}
+
+static int
+show_hedge(void)
+{
+	struct od_hedge_stats stats;
+	const struct od_hedge_node_stats *node = NULL;
+	int i;
+
+	if (PAM_SUCCESS != od_hedge_copy_stats(&stats))
+		return 1;
+
+	printf("Hedging\n");
+	printf("  Lookups          : %llu\n", stats.lookups);
+	printf("  Hedges           : %llu (%llu held back by hedge_rate)\n", stats.hedges, stats.capped);
+	printf("  Delay            : %llu us\n", stats.delay);
+	for (i = 0; i < kODHedgeNodes; ++i) {
+		node = &stats.nodes[i];
+		if ('\0' == node->node[0])
+			continue;
+		printf("  %-40s %llu hedges, %llu won\n", node->node, node->hedges, node->wins);
+	}
+
+	return 0;
+}
+
+static int
+show_membership(void)
+{
+	struct od_membership_stats stats;
+
+	if (PAM_SUCCESS != od_membership_copy_stats(&stats))
+		return 1;
+
+	printf("Membership refreshes\n");
+	printf("  Issued           : %llu\n", stats.issued);
+	printf("  Skipped          : %llu\n", stats.skipped);
+
+	return 0;
+}
+
+static const struct {
+	const char	*name;
+	const char	*path;
+	int		(*show)(void);
+} sections[] = {
+	{ "blinding",	OD_LATENCY_PATH,	show_blinding },
+	{ "admission",	OD_ADMISSION_PATH,	show_admission },
+	{ "hedge",	OD_HEDGE_PATH,		show_hedge },
+	{ "membership",	OD_MEMBERSHIP_PATH,	show_membership },
+};
+
+static int
+show(const char *prog, size_t i)
+{
+	/* no file means nothing was recorded; do not create one here */
+	if (0 != access(sections[i].path, F_OK)) {
+		printf("%s: nothing recorded\n", sections[i].name);
+		return 0;
+	}
+	if (0 != access(sections[i].path, R_OK)) {
+		fprintf(stderr, "%s: cannot read %s: %s\n", prog, sections[i].path, strerror(errno));
+		return 1;
+	}
+	if (0 != sections[i].show()) {
+		fprintf(stderr, "%s: cannot use %s\n", prog, sections[i].path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [", prog);
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); ++i)
+		fprintf(stderr, "%s%s", (0 != i) ? " | " : "", sections[i].name);
+	fprintf(stderr, "]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *prog = argv[0];
+	size_t i;
+	int status = 0;
+
+	if (argc > 2)
+		usage(prog);
+
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); ++i) {
+		if (2 == argc && 0 != strcmp(argv[1], sections[i].name))
+			continue;
+		if (1 == argc && 0 != i)
+			printf("\n");
+		status |= show(prog, i);
+		if (2 == argc)
+			return status;
+	}
+	if (2 == argc)
+		usage(prog);
+
+	return status;
+}
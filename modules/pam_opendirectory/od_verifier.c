@@ -0,0 +1,109 @@
+/*
+ * Inspect and invalidate the password verifiers pam_opendirectory caches
+ * with its verifier_cache option.
+ *
+ * cc -I../../common -o od_verifier od_verifier.c ../../common/VerifierCache.c \
+ *	../../common/SharedTable.c ../../common/Scrypt.c
+ *
+ * Usage: od_verifier [-f file] list
+ *        od_verifier [-f file] invalidate <user name> ...
+ *        od_verifier [-f file] flush
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "VerifierCache.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f file] list\n", prog);
+	fprintf(stderr, "       %s [-f file] invalidate <user name> ...\n", prog);
+	fprintf(stderr, "       %s [-f file] flush\n", prog);
+	exit(2);
+}
+
+static int
+list(struct od_verifier_cache *cache)
+{
+	struct od_verifier_entry *entries = NULL;
+	size_t count, i;
+	char stored[32];
+
+	entries = calloc(kODVerifierSlots, sizeof(*entries));
+	if (NULL == entries)
+		return 1;
+
+	count = od_verifier_list(cache, entries, kODVerifierSlots);
+	for (i = 0; i < count; ++i) {
+		time_t t = (time_t)entries[i].stored;
+
+		strftime(stored, sizeof(stored), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%-32s %s  N=2^%u r=%u p=%u  account %s\n", entries[i].name, stored,
+		       entries[i].log2_n, entries[i].r, entries[i].p,
+		       (kODVerifierAccountAllowed == entries[i].account) ? "allowed" : "unchecked");
+	}
+
+	free(entries);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct od_verifier_cache *cache = NULL;
+	const char *path = OD_VERIFIER_PATH;
+	const char *prog = argv[0];
+	int ch, i, status = 0;
+
+	while ((ch = getopt(argc, argv, "f:")) != -1) {
+		switch (ch) {
+			case 'f':
+				path = optarg;
+				break;
+			default:
+				usage(prog);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage(prog);
+
+	cache = od_verifier_open(path, false);
+	if (NULL == cache) {
+		/* no file means nothing is cached */
+		if (0 == access(path, F_OK)) {
+			fprintf(stderr, "%s: cannot use %s\n", prog, path);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (0 == strcmp(argv[0], "list") && 1 == argc) {
+		status = list(cache);
+	} else if (0 == strcmp(argv[0], "invalidate") && argc > 1) {
+		for (i = 1; i < argc; ++i) {
+			if (PAM_SUCCESS != od_verifier_invalidate(cache, argv[i])) {
+				fprintf(stderr, "%s: no verifier for %s\n", prog, argv[i]);
+				status = 1;
+			}
+		}
+	} else if (0 == strcmp(argv[0], "flush") && 1 == argc) {
+		if (PAM_SUCCESS != od_verifier_invalidate(cache, NULL))
+			status = 1;
+	} else {
+		od_verifier_close(cache);
+		usage(prog);
+	}
+
+	od_verifier_close(cache);
+
+	return status;
+}
@@ -28,6 +28,7 @@
  * authentication module for Mac OS X.
  ******************************************************************/
 
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -47,11 +48,17 @@
 #include <security/pam_modules.h>
 #include <security/pam_appl.h>
 
+#include "AsyncAuth.h"
+#include "AttemptTracker.h"
 #include "Common.h"
+#include "SharedTable.h"
+#include "VerifierCache.h"
 
 #define PM_DISPLAY_NAME "OpenDirectory"
 #define PAM_OD_PW_EXP "ODPasswordExpire"
 #define PAM_OD_NON_PWD "non_password_auth"
+/* pam_set_data() key set when authentication fell back to a cached verifier */
+#define PAM_OD_CACHED_VERIFIER "od_cached_verifier"
 
 #include "Logging.h"
 
@@ -79,6 +86,415 @@ uint64_t AbsoluteToMicroseconds(uint64_t t) {
 	return t * f;
 }
 
+/*
+ * With "verifier_cache", a password the directory accepts is also kept as
+ * a scrypt verifier, and the verifier is used when the user record cannot
+ * be looked up or the directory takes longer than "verifier_budget" ms to
+ * check the password.
+ */
+enum {
+	kVerifierBudgetDefault = 3000	/* ms */
+};
+
+static void
+verifier_params_init(pam_handle_t *pamh, struct od_verifier_params *params, uint64_t *budget)
+{
+	const char *opt = NULL;
+
+	od_verifier_default_params(params);
+	if (NULL != (opt = openpam_get_option(pamh, "verifier_cost")))
+		params->log2_n = (unsigned int)strtoul(opt, NULL, 10);
+	if (NULL != (opt = openpam_get_option(pamh, "verifier_max_age")))
+		params->max_age = strtoull(opt, NULL, 10) * 60 * 60;
+	*budget = (uint64_t)kVerifierBudgetDefault * 1000;
+	if (NULL != (opt = openpam_get_option(pamh, "verifier_budget")))
+		*budget = strtoull(opt, NULL, 10) * 1000;
+}
+
+static struct od_verifier_cache *
+verifier_cache_open(pam_handle_t *pamh, struct od_verifier_params *params, uint64_t *budget)
+{
+	struct od_verifier_cache *cache = NULL;
+
+	if (NULL == openpam_get_option(pamh, "verifier_cache"))
+		return NULL;
+
+	verifier_params_init(pamh, params, budget);
+	cache = od_verifier_open(OD_VERIFIER_PATH, true);
+	if (NULL == cache)
+		_LOG_ERROR("%s - Unable to use %s.", PM_DISPLAY_NAME, OD_VERIFIER_PATH);
+
+	return cache;
+}
+
+/* whether an account check got an answer from the directory, either way */
+static bool
+account_checked(int retval)
+{
+	switch (retval) {
+		case PAM_AUTHINFO_UNAVAIL:
+		case PAM_SERVICE_ERR:
+		case PAM_SYSTEM_ERR:
+		case PAM_BUF_ERR:
+			return false;
+		default:
+			return true;
+	}
+}
+
+/*
+ * "attempt_limit" failures of one user from one remote host, or
+ * "attempt_source_limit" failures of any users from it, get the host
+ * refused locally until the counts decay below the limit again, halving
+ * every "attempt_halflife" seconds.  Local logins are never tracked.
+ */
+static pthread_once_t attempt_tracker_once = PTHREAD_ONCE_INIT;
+static struct od_attempt_tracker *attempt_tracker = NULL;
+
+static void
+attempt_tracker_init(void)
+{
+	attempt_tracker = od_attempt_open(OD_ATTEMPT_PATH);
+	if (NULL == attempt_tracker)
+		_LOG_ERROR("%s - Unable to track failed attempts.", PM_DISPLAY_NAME);
+}
+
+static struct od_attempt_tracker *
+attempt_tracker_get(pam_handle_t *pamh, struct od_attempt_params *params, const char **rhost)
+{
+	const char *opt = NULL;
+
+	od_attempt_default_params(params);
+	if (NULL != (opt = openpam_get_option(pamh, "attempt_limit")))
+		params->user_limit = strtod(opt, NULL);
+	if (NULL != (opt = openpam_get_option(pamh, "attempt_source_limit")))
+		params->source_limit = strtod(opt, NULL);
+	if (NULL != (opt = openpam_get_option(pamh, "attempt_halflife")))
+		params->halflife = strtoull(opt, NULL, 10) * 1000000;
+	if (params->user_limit <= 0 && params->source_limit <= 0)
+		return NULL;
+
+	if (PAM_SUCCESS != pam_get_item(pamh, PAM_RHOST, (const void **)rhost) || NULL == *rhost || '\0' == (*rhost)[0])
+		return NULL;
+
+	pthread_once(&attempt_tracker_once, attempt_tracker_init);
+
+	return attempt_tracker;
+}
+
+struct verify_task {
+	ODRecordRef	record;
+	CFStringRef	password;
+	struct od_admission admission;
+	CFIndex		code;		/* why the password was not accepted */
+	char		*user;		/* for the verifier cache, NULL without one */
+	struct od_verifier_params verifier_params;
+	bool		abandoned;	/* the login went on without this answer */
+};
+
+static int
+verify_task_main(void *arg)
+{
+	struct verify_task *task = arg;
+	CFErrorRef odErr = NULL;
+	uint64_t ticket = 0;
+	bool verified;
+
+	if (PAM_SUCCESS != od_admission_enter(&task->admission, &ticket))
+		return PAM_AUTHINFO_UNAVAIL;
+	verified = ODRecordVerifyPassword(task->record, task->password, &odErr);
+	od_admission_leave(ticket);
+	if (verified)
+		return PAM_SUCCESS;
+
+	task->code = (NULL != odErr) ? CFErrorGetCode(odErr) : kODErrorCredentialsInvalid;
+	CFReleaseSafe(odErr);
+
+	return PAM_AUTH_ERR;
+}
+
+/*
+ * The directory rejected a password after the login stopped waiting for
+ * it.  If the cached verifier still accepts that password, the password
+ * was changed elsewhere and the verifier must not outlive the change.
+ */
+static void
+verify_task_forget_verifier(struct verify_task *task)
+{
+	struct od_verifier_cache *verifiers = NULL;
+	char *password = NULL;
+
+	if (PAM_SUCCESS != cfstring_to_cstring(task->password, &password))
+		return;
+	if (NULL != (verifiers = od_verifier_open(OD_VERIFIER_PATH, false))) {
+		if (PAM_SUCCESS == od_verifier_check(verifiers, task->user, password, &task->verifier_params)) {
+			_LOG_VERBOSE("%s - The directory rejects a password the cached verifier accepts; dropping it.", PM_DISPLAY_NAME);
+			od_verifier_invalidate(verifiers, task->user);
+		}
+		od_verifier_close(verifiers);
+	}
+	free(password);
+}
+
+/* runs once both the task and verify_password() are done with it */
+static void
+verify_task_dispose(void *arg)
+{
+	struct verify_task *task = arg;
+
+	if (task->abandoned && NULL != task->user && kODErrorCredentialsInvalid == task->code)
+		verify_task_forget_verifier(task);
+	free(task->user);
+	CFReleaseSafe(task->record);
+	CFReleaseSafe(task->password);
+	free(task);
+}
+
+/*
+ * ODRecordVerifyPassword(), given at most budget us unless budget is 0.
+ * Returns PAM_SUCCESS, PAM_AUTH_ERR with *code set to the OD error, or
+ * PAM_AUTHINFO_UNAVAIL once the budget is spent or admission was refused;
+ * a check still running then finishes in the background.  Its answer is
+ * dropped, except that a rejection still reaches user's cached verifier.
+ */
+static int
+verify_password(ODRecordRef record, CFStringRef password, const struct od_admission *admission,
+		const char *user, const struct od_verifier_params *verifier_params, uint64_t budget, CFIndex *code)
+{
+	struct verify_task *task = NULL;
+	struct od_task *handle = NULL;
+	int retval = PAM_AUTH_ERR;
+
+	if (NULL == password) {
+		*code = kODErrorCredentialsInvalid;
+		return PAM_AUTH_ERR;
+	}
+	if (NULL == (task = calloc(1, sizeof(*task))))
+		return PAM_BUF_ERR;
+	task->record = (ODRecordRef)CFRetain(record);
+	task->password = (CFStringRef)CFRetain(password);
+	task->admission = *admission;
+	if (0 != budget && NULL != user && NULL != verifier_params) {
+		if (NULL == (task->user = strdup(user))) {
+			verify_task_dispose(task);
+			return PAM_BUF_ERR;
+		}
+		task->verifier_params = *verifier_params;
+	}
+
+	if (0 == budget || NULL == (handle = od_task_start(verify_task_main, task, verify_task_dispose))) {
+		retval = verify_task_main(task);
+		*code = task->code;
+		verify_task_dispose(task);
+		return retval;
+	}
+
+	if (PAM_SUCCESS == od_task_wait(handle, budget, &retval)) {
+		*code = task->code;
+	} else {
+		task->abandoned = true;
+		retval = PAM_AUTHINFO_UNAVAIL;
+	}
+	od_task_release(handle);
+
+	return retval;
+}
+
+/*
+ * The bootstrap token is the same for every login, so it is fetched once
+ * per process and kept for kBootstrapTokenTTL seconds.  A login that finds
+ * it older than kBootstrapTokenRefresh starts a background fetch of the
+ * next one; only a login that finds no usable token waits for the network.
+ * A rejected token, or a failed authentication that used it, drops it.
+ */
+enum {
+	kBootstrapTokenTTL     = 600,	/* s */
+	kBootstrapTokenRefresh = 480	/* s */
+};
+
+static pthread_mutex_t bootstrap_token_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bootstrap_token_once = PTHREAD_ONCE_INIT;
+static CFStringRef bootstrap_token = NULL;
+static uint64_t bootstrap_token_fetched = 0;	/* mach_absolute_time() */
+static bool bootstrap_token_refreshing = false;
+
+static void
+bootstrap_token_prefork(void)
+{
+	pthread_mutex_lock(&bootstrap_token_lock);
+}
+
+static void
+bootstrap_token_postfork_parent(void)
+{
+	pthread_mutex_unlock(&bootstrap_token_lock);
+}
+
+/* the refresh thread did not come along */
+static void
+bootstrap_token_postfork_child(void)
+{
+	bootstrap_token_refreshing = false;
+	pthread_mutex_unlock(&bootstrap_token_lock);
+}
+
+static void
+bootstrap_token_init(void)
+{
+	od_atfork(bootstrap_token_prefork, bootstrap_token_postfork_parent, bootstrap_token_postfork_child);
+}
+
+CF_RETURNS_RETAINED
+static CFStringRef
+bootstrap_token_fetch(void)
+{
+	CFStringRef token = NULL;
+
+	@autoreleasepool {
+		NSString *fetched = CP_GetBootstrapTokenWithOptions(@{ @"NetworkTimeout" : @20 }, NULL);
+		if (fetched != NULL && fetched.length > 0)
+			token = CFRetain((CFStringRef)fetched);
+	}
+	_LOG_DEBUG("%s - Bootstrap token fetch %s.", PM_DISPLAY_NAME, token ? "succeeded" : "failed");
+
+	return token;
+}
+
+static void
+bootstrap_token_store(CFStringRef token)
+{
+	CFStringRef old = NULL;
+
+	pthread_mutex_lock(&bootstrap_token_lock);
+	if (NULL != token) {
+		old = bootstrap_token;
+		bootstrap_token = CFRetain(token);
+		bootstrap_token_fetched = mach_absolute_time();
+	}
+	pthread_mutex_unlock(&bootstrap_token_lock);
+
+	CFReleaseSafe(old);
+}
+
+static int
+bootstrap_token_refresh(__unused void *arg)
+{
+	CFStringRef token = bootstrap_token_fetch();
+
+	bootstrap_token_store(token);
+	CFReleaseSafe(token);
+
+	pthread_mutex_lock(&bootstrap_token_lock);
+	bootstrap_token_refreshing = false;
+	pthread_mutex_unlock(&bootstrap_token_lock);
+
+	return PAM_SUCCESS;
+}
+
+static void
+bootstrap_token_invalidate(void)
+{
+	CFStringRef old = NULL;
+
+	pthread_once(&bootstrap_token_once, bootstrap_token_init);
+	pthread_mutex_lock(&bootstrap_token_lock);
+	old = bootstrap_token;
+	bootstrap_token = NULL;
+	pthread_mutex_unlock(&bootstrap_token_lock);
+
+	if (NULL != old)
+		_LOG_DEBUG("%s - Bootstrap token dropped.", PM_DISPLAY_NAME);
+	CFReleaseSafe(old);
+}
+
+CF_RETURNS_RETAINED
+static CFStringRef
+bootstrap_token_copy(void)
+{
+	CFStringRef token = NULL;
+	struct od_task *task = NULL;
+	uint64_t age = 0;
+	bool refresh = false;
+
+	pthread_once(&bootstrap_token_once, bootstrap_token_init);
+	pthread_mutex_lock(&bootstrap_token_lock);
+	if (NULL != bootstrap_token) {
+		age = AbsoluteToMicroseconds(mach_absolute_time() - bootstrap_token_fetched) / 1000000;
+		if (age < kBootstrapTokenTTL)
+			token = CFRetain(bootstrap_token);
+		if (age >= kBootstrapTokenRefresh && age < kBootstrapTokenTTL && !bootstrap_token_refreshing)
+			refresh = bootstrap_token_refreshing = true;
+	}
+	pthread_mutex_unlock(&bootstrap_token_lock);
+
+	if (refresh) {
+		if (NULL != (task = od_task_start(bootstrap_token_refresh, NULL, NULL))) {
+			od_task_release(task);
+		} else {
+			pthread_mutex_lock(&bootstrap_token_lock);
+			bootstrap_token_refreshing = false;
+			pthread_mutex_unlock(&bootstrap_token_lock);
+		}
+	}
+
+	if (NULL == token) {
+		/* cold */
+		token = bootstrap_token_fetch();
+		bootstrap_token_store(token);
+	}
+
+	return token;
+}
+
+/* a mobile account: its first authentication authority is ";LocalCachedUser;..." */
+static bool
+local_cached_user(pam_handle_t *pamh, ODRecordRef cfRecord)
+{
+	CFDataRef authdata = od_record_copy_authauthority(pamh, cfRecord);
+	const struct od_authauthority *aa = od_authauthority_get(authdata);
+	bool cached = (NULL != aa && aa->count > 0 && kODAuthAuthTagLocalCachedUser == aa->entries[0].tag);
+
+	CFReleaseSafe(authdata);
+
+	return cached;
+}
+
+/*
+ * <rdar://problem/48780154> Adopt new OD SPI and entitlement to use the bootstrap token prior to user authentication
+ * pamh is NULL on the prefetch worker, which must not touch the handle.
+ */
+static void
+bootstrap_token_apply(pam_handle_t *pamh, ODRecordRef cfRecord)
+{
+	CFStringRef token = NULL;
+	CFErrorRef odErr = NULL;
+
+	if (&CP_SupportsBootstrapToken == NULL)
+		return;
+
+	if (local_cached_user(pamh, cfRecord) && CP_SupportsBootstrapToken()) {
+		/* Get token + authenticate. */
+		token = bootstrap_token_copy();
+		if (token != NULL) {
+			if (ODRecordSetNodeCredentialsWithBootstrapToken(cfRecord, token, &odErr)) {
+                _LOG_VERBOSE("%s - Authenticated with bootstrap token.", PM_DISPLAY_NAME);
+			} else {
+				_LOG_ERROR("%s - Failed to set bootstrap token: %s.", PM_DISPLAY_NAME, [(NSError *)odErr description].UTF8String);
+				CFReleaseNull(odErr);
+				bootstrap_token_invalidate();
+			}
+		}
+	}
+
+	CFReleaseSafe(token);
+}
+
+static void
+bootstrap_token_prefetched(ODRecordRef cfRecord)
+{
+	bootstrap_token_apply(NULL, cfRecord);
+}
+
 PAM_EXTERN int
 pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc, const char **argv)
 {
@@ -92,6 +508,11 @@ pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	const char *ttl_str = NULL;
 	long ttl = 30 * 60;
     bool ignorePasswordLockout = openpam_get_option(pamh, PAM_OD_NON_PWD);
+	struct od_account_rules rules;
+	const void *cached = NULL;
+	struct od_verifier_cache *verifiers = NULL;
+	struct od_verifier_params verifier_params;
+	uint64_t budget = 0;
 
 	/* get the username */
 	retval = pam_get_user(pamh, &user, NULL);
@@ -112,11 +533,28 @@ pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	if (NULL != (ttl_str = openpam_get_option(pamh, "refresh"))) {
 		ttl = strtol(ttl_str, NULL, 10) * 60;
 	}
-	mbr_set_identifier_ttl(ID_TYPE_UID, &pwd->pw_uid, sizeof(pwd->pw_uid), (unsigned int)ttl);
-    _LOG_DEBUG("%s - Membership cache TTL set to %ld.", PM_DISPLAY_NAME, ttl);
+	if (od_membership_refresh_due(pamh, pwd->pw_uid, (unsigned int)ttl)) {
+		mbr_set_identifier_ttl(ID_TYPE_UID, &pwd->pw_uid, sizeof(pwd->pw_uid), (unsigned int)ttl);
+		_LOG_DEBUG("%s - Membership cache TTL set to %ld.", PM_DISPLAY_NAME, ttl);
+	} else {
+		_LOG_DEBUG("%s - Membership cache TTL refreshed recently, skipped.", PM_DISPLAY_NAME);
+	}
 
 	/* Get user record from OD */
 	retval = od_record_create_cstring(pamh, &cfRecord, (const char*)user);
+	if (PAM_AUTHINFO_UNAVAIL == retval && PAM_SUCCESS == pam_get_data(pamh, PAM_OD_CACHED_VERIFIER, &cached)) {
+		/* no rule can be checked without the record: go by the last check the directory answered */
+		verifier_params_init(pamh, &verifier_params, &budget);
+		verifiers = od_verifier_open(OD_VERIFIER_PATH, false);
+		retval = od_verifier_check_account(verifiers, user, &verifier_params);
+		if (PAM_SUCCESS == retval) {
+			_LOG_VERBOSE("%s - Directory unavailable, account allowed by its last check.", PM_DISPLAY_NAME);
+		} else {
+			_LOG_ERROR("%s - Directory unavailable and the account was not checked since the verifier was stored.", PM_DISPLAY_NAME);
+			retval = PAM_AUTHINFO_UNAVAIL;
+		}
+		goto cleanup;
+	}
 	if (PAM_SUCCESS != retval) {
 		_LOG_ERROR("%s - Unable to get user record: %d.", PM_DISPLAY_NAME, retval);
 		goto cleanup;
@@ -129,44 +567,19 @@ pam_sm_acct_mgmt(pam_handle_t * pamh, int flags, int argc, const char **argv)
 		goto cleanup;
 	}
 
-	/* check user password policy */
-	retval = od_record_check_pwpolicy(cfRecord);
-	if (PAM_SUCCESS != retval) {
-        if (ignorePasswordLockout && retval == PAM_APPLE_ACCT_TEMP_LOCK) {
-            _LOG_INFO("%s - ignored password lockout because non-password auth was used", PM_DISPLAY_NAME);
-        }
-        else {
-            _LOG_ERROR("%s - check password policy failed %d", PM_DISPLAY_NAME, retval);
-            goto cleanup;
-        }
-	}
-
-	/* check user authentication authority */
-	retval = od_record_check_authauthority(cfRecord);
-	if (PAM_SUCCESS != retval) {
-        _LOG_ERROR("%s - check authority failed %d", PM_DISPLAY_NAME, retval);
-		goto cleanup;
-	}
-
-	/* check user home directory */
-	if (!openpam_get_option(pamh, "no_check_home")) {
-		retval = od_record_check_homedir(cfRecord);
-		if (PAM_SUCCESS != retval) {
-            _LOG_ERROR("%s - check homedir failed %d", PM_DISPLAY_NAME, retval);
-			goto cleanup;
-		}
-	}
+	/* check password policy, authentication authority, home directory and shell */
+	od_account_rules_compile(pamh, &rules);
+	rules.ignore_temp_lock = ignorePasswordLockout;
+	retval = od_record_check_account(pamh, cfRecord, &rules);
+	if (PAM_SUCCESS != retval)
+		_LOG_ERROR("%s - account check failed %d", PM_DISPLAY_NAME, retval);
 
-	/* check user shell */
-	if (!openpam_get_option(pamh, "no_check_shell")) {
-		retval = od_record_check_shell(cfRecord);
-		if (PAM_SUCCESS != retval) {
-            _LOG_ERROR("%s - shell check failed %d", PM_DISPLAY_NAME, retval);
-			goto cleanup;
-		}
-	}
+	/* what the directory said is what a cached-verifier login gets while it is away */
+	if (account_checked(retval) && NULL != (verifiers = od_verifier_open(OD_VERIFIER_PATH, false)))
+		od_verifier_set_account(verifiers, user, PAM_SUCCESS == retval);
 
 cleanup:
+	od_verifier_close(verifiers);
 	CFReleaseSafe(cfRecord);
 	free(homedir);
 	pam_unsetenv(pamh, PAM_OD_PW_EXP);
@@ -181,17 +594,35 @@ pam_sm_authenticate(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	int retval = PAM_SUCCESS;
 	const char *user = NULL;
 	const char *password = NULL;
-	CFStringRef cfAuthAuthority = NULL;
 	CFStringRef cfPassword = NULL;
-	CFErrorRef odErr = NULL;
 	ODRecordRef cfRecord = NULL;
-	uint64_t mach_start_time = mach_absolute_time();
+	uint64_t mach_start_time = 0;
 	bool should_sleep = 0;
+	struct od_record_prefetch *prefetch = NULL;
+	struct od_verifier_cache *verifiers = NULL;
+	struct od_verifier_params verifier_params;
+	uint64_t budget = 0;
+	bool from_cache = false;
+	CFIndex code = 0;
+	struct od_admission admission;
+	struct od_attempt_tracker *attempts = NULL;
+	struct od_attempt_params attempt_params;
+	const char *rhost = NULL;
+	bool blocked = false;
 
 	if (PAM_SUCCESS != (retval = pam_get_user(pamh, &user, NULL))) {
 		_LOG_ERROR("%s - Unable to obtain the username.", PM_DISPLAY_NAME);
 		goto cleanup;
 	}
+
+	/* a source that keeps failing is still asked for a password, but the directory is not */
+	if (NULL != (attempts = attempt_tracker_get(pamh, &attempt_params, &rhost)))
+		blocked = od_attempt_blocked(attempts, user, rhost, &attempt_params);
+
+	/* look the user up while the password is being typed */
+	if (!blocked && NULL == openpam_get_option(pamh, "no_prefetch"))
+		prefetch = od_record_prefetch_start(pamh, user, bootstrap_token_prefetched);
+
 	if (PAM_SUCCESS != (retval = pam_get_authtok(pamh, PAM_AUTHTOK, &password, password_prompt))) {
         _LOG_ERROR("%s - Error obtaining the authtok.", PM_DISPLAY_NAME);
 		retval = PAM_AUTH_ERR;
@@ -205,11 +636,30 @@ pam_sm_authenticate(pam_handle_t * pamh, int flags, int argc, const char **argv)
 
 	/* From this point, all error paths should be constant time */
 	should_sleep = 1;
+	/* typing time says nothing about the directory */
+	mach_start_time = mach_absolute_time();
+
+	if (blocked) {
+		_LOG_ERROR("%s - Too many failed attempts from %s.", PM_DISPLAY_NAME, rhost);
+		retval = PAM_AUTH_ERR;
+		goto cleanup;
+	}
+
+	verifiers = verifier_cache_open(pamh, &verifier_params, &budget);
 
 	/* Get user record from OD */
-	retval = od_record_create_cstring(pamh, &cfRecord, (const char*)user);
+	if (NULL != prefetch) {
+		retval = od_record_prefetch_finish(pamh, prefetch, &cfRecord);
+		prefetch = NULL;
+	} else {
+		retval = od_record_create_cstring_for_auth(pamh, &cfRecord, (const char*)user);
+		if (PAM_SUCCESS == retval)
+			bootstrap_token_apply(pamh, cfRecord);
+	}
 	if (PAM_SUCCESS != retval) {
 		_LOG_ERROR("%s - Unable to get user record.", PM_DISPLAY_NAME);
+		if (PAM_AUTHINFO_UNAVAIL == retval && NULL != verifiers)
+			goto cached;
 		goto cleanup;
 	}
 
@@ -219,32 +669,22 @@ pam_sm_authenticate(pam_handle_t * pamh, int flags, int argc, const char **argv)
 		goto cleanup;
 	}
 
-	/* <rdar://problem/48780154> Adopt new OD SPI and entitlement to use the bootstrap token prior to user authentication */
-	if (&CP_SupportsBootstrapToken != NULL) {
-		retval = od_record_attribute_create_cfstring(cfRecord, (CFStringRef) kODAttributeTypeAuthenticationAuthority, &cfAuthAuthority);
-		NSArray<NSString *> *authAttributes = nil;
-		if (retval == PAM_SUCCESS)
-			authAttributes = [(NSString *)cfAuthAuthority componentsSeparatedByString:@";"];
-		if ([authAttributes containsObject:@(kDSTagAuthAuthorityLocalCachedUser)] &&
-			CP_SupportsBootstrapToken()) {
-			/* Get token + authenticate. */
-			NSString *token = CP_GetBootstrapTokenWithOptions(@{ @"NetworkTimeout" : @20 }, NULL);
-			if (token != NULL && token.length > 0) {
-				if (ODRecordSetNodeCredentialsWithBootstrapToken(cfRecord, (CFStringRef) token, &odErr)) {
-                    _LOG_VERBOSE("%s - Authenticated with bootstrap token.", PM_DISPLAY_NAME);
-				} else {
-					_LOG_ERROR("%s - Failed to set bootstrap token: %s.", PM_DISPLAY_NAME, [(NSError *)odErr description].UTF8String);
-					CFReleaseNull(odErr);
-				}
-			}
-		}
-	}
-
 	/* Verify the user's password */
 	cfPassword = CFStringCreateWithCString(kCFAllocatorDefault, password, kCFStringEncodingUTF8);
-	retval = PAM_USER_UNKNOWN;
-	if (!ODRecordVerifyPassword(cfRecord, cfPassword, &odErr)) {
-		switch (CFErrorGetCode(odErr)) {
+	od_admission_init(pamh, &admission);
+	retval = verify_password(cfRecord, cfPassword, &admission, user, &verifier_params,
+				 (NULL != verifiers) ? budget : 0, &code);
+	if (PAM_AUTHINFO_UNAVAIL == retval) {
+		_LOG_ERROR("%s - No answer from the directory.", PM_DISPLAY_NAME);
+		if (NULL != verifiers)
+			goto cached;
+		goto cleanup;
+	}
+	if (PAM_AUTH_ERR == retval) {
+		/* a stale bootstrap token fails like a wrong password; fetch it again next time */
+		if (local_cached_user(pamh, cfRecord))
+			bootstrap_token_invalidate();
+		switch (code) {
 			case kODErrorCredentialsAccountNotFound:
 				retval = PAM_USER_UNKNOWN;
 				_LOG_ERROR("%s - Account not found or invalid.", PM_DISPLAY_NAME);
@@ -274,23 +714,54 @@ pam_sm_authenticate(pam_handle_t * pamh, int flags, int argc, const char **argv)
 				break;
 			default:
                 _LOG_ERROR("%s  Unexpected error code from ODRecordVerifyPassword(): %ld.",
-					    PM_DISPLAY_NAME, CFErrorGetCode(odErr));
+					    PM_DISPLAY_NAME, code);
 				retval = PAM_AUTH_ERR;
 				break;
 		}
-	} else {
-		retval = PAM_SUCCESS;
+	} else if (PAM_SUCCESS == retval) {
+		should_sleep = 0;
+		if (NULL != verifiers && PAM_SUCCESS != od_verifier_store(verifiers, user, password, &verifier_params))
+			_LOG_ERROR("%s - Unable to store a cached verifier.", PM_DISPLAY_NAME);
+	}
+	goto cleanup;
+
+cached:
+	/* the directory cannot answer: try the verifier kept from an earlier success */
+	retval = od_verifier_check(verifiers, user, password, &verifier_params);
+	if (PAM_SUCCESS == retval) {
+		_LOG_VERBOSE("%s - Authenticated with a cached verifier.", PM_DISPLAY_NAME);
+		pam_set_data(pamh, PAM_OD_CACHED_VERIFIER, (void *)PAM_OD_CACHED_VERIFIER, NULL);
 		should_sleep = 0;
+		from_cache = true;
+	} else if (PAM_AUTH_ERR == retval) {
+		_LOG_ERROR("%s - The authtok does not match the cached verifier.", PM_DISPLAY_NAME);
+	} else {
+		_LOG_ERROR("%s - No usable cached verifier.", PM_DISPLAY_NAME);
+		retval = PAM_AUTHINFO_UNAVAIL;
 	}
 
 cleanup:
+	/* a policy answer cached for acct_mgmt may no longer hold */
+	if (PAM_SUCCESS != retval && 0 != mach_start_time)
+		od_policy_cache_invalidate(user, cfRecord);
+	/* only attempts that got as far as a password count */
+	if (NULL != attempts && !blocked && 0 != mach_start_time) {
+		if (PAM_SUCCESS == retval)
+			od_attempt_succeeded(attempts, user, rhost);
+		else if (PAM_AUTH_ERR == retval || PAM_USER_UNKNOWN == retval)
+			od_attempt_failed(attempts, user, rhost, &attempt_params);
+	}
+	if (PAM_SUCCESS == retval && !should_sleep && !from_cache) {
+		/* successes set how long failures have to take */
+		od_blinding_record(AbsoluteToMicroseconds(mach_absolute_time() - mach_start_time));
+	}
 	if (should_sleep) {
 		// <rdar://problem/12503092> OD password verification API always leads to user existence timing attacks
 		uint64_t elapsed      = mach_absolute_time() - mach_start_time;
 		uint64_t microseconds = AbsoluteToMicroseconds(elapsed);
 
-		const uint64_t response_delay = 2000000;    // 2000000 us == 2s
-		_LOG_DEBUG("%s - auth %lld µs", PM_DISPLAY_NAME, microseconds);
+		const uint64_t response_delay = od_blinding_window(pamh);
+		_LOG_DEBUG("%s - auth %lld µs, blinding window %lld µs", PM_DISPLAY_NAME, microseconds, response_delay);
 		if (microseconds < response_delay)
 			usleep((useconds_t)(response_delay - microseconds));
 
@@ -299,10 +770,10 @@ cleanup:
 		_LOG_DEBUG("%s - auth %lld µs (blinding)", PM_DISPLAY_NAME, microseconds);
 	}
 
-	CFReleaseSafe(cfAuthAuthority);
+	od_record_prefetch_cancel(prefetch);
 	CFReleaseSafe(cfRecord);
 	CFReleaseSafe(cfPassword);
-	CFReleaseSafe(odErr);
+	od_verifier_close(verifiers);
 
 	return retval;
 }
@@ -328,6 +799,8 @@ pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	ODRecordRef cfRecord = NULL;
 	CFStringRef cfOldPassword = NULL;
 	CFStringRef cfNewPassword = NULL;
+	struct od_verifier_cache *verifiers = NULL;
+	bool changed = false;
 
 	if (flags & PAM_PRELIM_CHECK) {
 		retval = PAM_SUCCESS;
@@ -349,7 +822,7 @@ pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	}
 
 	/* Get user record from OD */
-	retval = od_record_create_cstring(pamh, &cfRecord, (const char*)user);
+	retval = od_record_create_cstring_for_auth(pamh, &cfRecord, (const char*)user);
 	if (PAM_SUCCESS != retval) {
 		_LOG_ERROR("%s - Unable to get user record.", PM_DISPLAY_NAME);
 		goto cleanup;
@@ -360,7 +833,10 @@ pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc, const char **argv)
 	cfNewPassword = CFStringCreateWithCString(kCFAllocatorDefault, new_password, kCFStringEncodingUTF8);
 
 	retval = PAM_SYSTEM_ERR;
-	if (!ODRecordChangePassword(cfRecord, cfOldPassword, cfNewPassword, &odErr)) {
+	changed = ODRecordChangePassword(cfRecord, cfOldPassword, cfNewPassword, &odErr);
+	/* whichever way it went, the policy answer may have changed with it */
+	od_policy_cache_invalidate(user, cfRecord);
+	if (!changed) {
 		switch (CFErrorGetCode(odErr)) {
 			case kODErrorCredentialsInvalid:
 			case kODErrorCredentialsPasswordQualityFailed:
@@ -391,6 +867,13 @@ pam_sm_chauthtok(pam_handle_t * pamh, int flags, int argc, const char **argv)
 				break;
 		}
 	} else {
+		/* drop the shared record so later modules see the new authentication data */
+		od_record_invalidate(pamh);
+		/* and a cached verifier that would still accept the old password */
+		if (NULL != (verifiers = od_verifier_open(OD_VERIFIER_PATH, false))) {
+			od_verifier_invalidate(verifiers, user);
+			od_verifier_close(verifiers);
+		}
 		retval = PAM_SUCCESS;
 	}
 
@@ -402,3 +885,46 @@ cleanup:
 
 	return retval;
 }
+
+
+static uint64_t
+async_blinding_window(__unused void *ctx)
+{
+	return od_blinding_window(NULL);
+}
+
+static void
+async_blinding_record(__unused void *ctx, uint64_t usec)
+{
+	od_blinding_record(usec);
+}
+
+/*
+ * For daemons that authenticate many users from one event loop, where
+ * pam_authenticate() would park a thread per login for the whole directory
+ * round trip and blinding window.  Failures are blinded with the same shared
+ * window as pam_sm_authenticate, without module options; the verifier cache
+ * and the failed-attempt tracker are not consulted.  Release with
+ * od_async_destroy().
+ */
+PAM_EXTERN struct od_async *
+pam_opendirectory_async_create(unsigned int workers)
+{
+	struct od_async_params params = {
+		.workers = workers,
+		.window = async_blinding_window,
+		.success = async_blinding_record,
+		.ctx = NULL,
+	};
+	struct dir_backend *backend = od_backend_open();
+	struct od_async *engine = NULL;
+
+	if (NULL == backend)
+		return NULL;
+	if (NULL == (engine = od_async_create(backend, &params))) {
+		_LOG_ERROR("%s - Unable to start the asynchronous authentication engine.", PM_DISPLAY_NAME);
+		dir_backend_close(backend);
+	}
+
+	return engine;
+}
@@ -99,6 +99,20 @@ cleanup:
     return propertyList;
 }
 
+CFStringRef copyConfigDSAttribute()
+{
+    CFStringRef attribute = NULL;
+    CFDictionaryRef configFile = copyConfigFileContent();
+    if (!configFile)
+        return NULL;
+
+    CFTypeRef value = CFDictionaryGetValue(configFile, kCACUserIDDSAttributeString);
+    if (value && CFGetTypeID(value) == CFStringGetTypeID())
+        attribute = CFRetain(value);
+    CFRelease(configFile);
+    return attribute;
+}
+
 CFTypeRef getSectionData(CFArrayRef values, CFStringRef label)
 {
     if (!values || CFGetTypeID(values) != CFArrayGetTypeID())
@@ -272,7 +286,7 @@ bool isNonRepudiated(SecCertificateRef cert)
     return result;
 }
 
-SecKeychainRef copyAttributeMatchedKeychain(ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity)
+SecKeychainRef copyAttributeMatchedKeychain(pam_handle_t *pamh, ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity)
 {
     CFDictionaryRef dict;
     
@@ -302,7 +316,7 @@ SecKeychainRef copyAttributeMatchedKeychain(ODRecordRef odRecord, CFArrayRef ide
             CFStringRef expectedValue = (CFStringRef) CFDictionaryGetValue(dict, kCACUserIDTargetSearchString);
             CFStringRef attributeName = (CFStringRef) CFDictionaryGetValue(dict, kCACUserIDDSAttributeString);
             CFStringRef value = NULL;
-            int res = od_record_attribute_create_cfstring(odRecord, attributeName, &value);
+            int res = od_record_attribute_create_cfstring(pamh, odRecord, attributeName, &value);
             bool match = (res == 0) && (value) && (CFStringCompare(expectedValue, value, 0) == kCFCompareEqualTo);
             CFRelease(dict);
 
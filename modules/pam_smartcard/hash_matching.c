@@ -9,10 +9,6 @@
 #include "Common.h"
 #include "scmatch_evaluation.h"
 
-#if !defined(kODAuthAuthorityPubkey)
-#define kODAuthAuthorityPubkey                      CFSTR("pubkeyhash")
-#endif
-
 CFDataRef createDataFromHexString(CFStringRef str)
 {
     CFIndex length = CFStringGetLength(str);
@@ -30,31 +26,32 @@ CFDataRef createDataFromHexString(CFStringRef str)
     return data;
 }
 
-SecKeychainRef copyHashMatchedKeychain(ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity)
+SecKeychainRef copyHashMatchedKeychain(pam_handle_t *pamh, ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity)
 {
-    CFArrayRef authStrings;
+    CFDataRef authData;
     CFDataRef hash = NULL;
+    const struct od_authauthority *aa;
+    const struct od_authauthority_entry *entry = NULL;
     
-    int odRes = od_record_attribute_create_cfarray(odRecord, kODAttributeTypeAuthenticationAuthority,  &authStrings);
-    if (odRes != PAM_SUCCESS)
+    authData = od_record_copy_authauthority(pamh, odRecord);
+    aa = od_authauthority_get(authData);
+    if (aa == NULL)
         return NULL;
     
     
-    for (CFIndex i = 0; i < CFArrayGetCount(authStrings); ++i)
+    while (hash == NULL && (entry = od_authauthority_find(aa, kODAuthAuthTagPubkeyHash, entry)) != NULL)
     {
-        CFArrayRef parts = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, CFArrayGetValueAtIndex(authStrings, i), CFSTR(";"));
-        if (parts)
+        if (entry->nfields == 3)
         {
-            if (CFArrayGetCount(parts) == 3 && CFStringCompare(CFArrayGetValueAtIndex(parts, 1), kODAuthAuthorityPubkey, kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            CFStringRef hexHash = CFStringCreateWithCString(kCFAllocatorDefault, od_authauthority_field(aa, entry, 2), kCFStringEncodingUTF8);
+            if (hexHash)
             {
-                hash = createDataFromHexString(CFArrayGetValueAtIndex(parts, 2));
+                hash = createDataFromHexString(hexHash);
+                CFRelease(hexHash);
             }
-            CFRelease(parts);
         }
-        if (hash)
-            break;
     }
-    CFRelease(authStrings);
+    CFRelease(authData);
     
     if (!hash)
         return NULL;
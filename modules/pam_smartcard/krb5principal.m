@@ -41,61 +41,35 @@ Here's an example of the local kdc authentication authority.
 
 #import <CoreFoundation/CoreFoundation.h>
 #import <DirectoryService/DirServicesConst.h>
+#include <strings.h>
 
-
-CF_RETURNS_RETAINED
-CFStringRef	GetPrincipalFromUser(CFDictionaryRef inUserRecord);
-OSStatus	ParseKerbAuthAuthority(CFStringRef inAuthority, CFArrayRef *outTokens);
+#include "Common.h"
 
 /*
     The Kerberos auth authority is a CFString of the form:
     1.0;Kerbv5;[128-bit uid]; [user principal (with realm)]; realm; [realm public key];
 
+    Returns the first entry that has all of the 1.0 fields and a realm.
+    The tag is compared without regard to case, as ParseKerbAuthAuthority did.
 */
-OSStatus ParseKerbAuthAuthority(CFStringRef inAuthority, CFArrayRef *outTokens)
+static const struct od_authauthority_entry *
+FindKerbAuthAuthority(const struct od_authauthority *authorities)
 {
-    OSStatus			theError = -1;
-    CFComparisonResult	result;
-    CFIndex				max;
-    CFStringRef			tmpString = NULL;
-
-	// No separators in the string returns array with that string; string == sep returns two empty strings
-    *outTokens = CFStringCreateArrayBySeparatingStrings(NULL, inAuthority, CFSTR(";"));
-    if(*outTokens == NULL) {
-        theError = -1;
-    } else {
-        while (true) {
-            theError = 0;
-			// check that the second token "Kerbv5" and that we have enough elements
-			max = CFArrayGetCount(*outTokens);
-			if (max < 6) { // The 1.0 version of the auth authority has 6 elements
-				theError = -1;
-				break;
-			}
+	const struct od_authauthority_entry *entry = NULL;
+	uint32_t i;
 
-			result = CFStringCompare(CFSTR(kDSTagAuthAuthorityKerberosv5), (CFStringRef) CFArrayGetValueAtIndex(*outTokens, 1), kCFCompareCaseInsensitive);
-			if (result != kCFCompareEqualTo)
-            {
-				theError = -1;
-            }
-
-			tmpString = (CFStringRef) CFArrayGetValueAtIndex(*outTokens, 4); // should be the realm
-			if (CFStringGetLength(tmpString) == 0)	// realm is required
-            {
-				theError = -1;
-            }
-
-			break;
-        }
+	if (authorities == NULL)
+		return NULL;
 
-		if (theError != noErr) {
-			// Clean up
-            CFRelease(*outTokens);
-            *outTokens = NULL;
-        }
-    }
+	for (i = 0; i < authorities->count; ++i) {
+		entry = &authorities->entries[i];
+		// The 1.0 version of the auth authority has 6 elements, the realm is required
+		if (entry->nfields >= 6 && entry->fields[4].length > 0 &&
+		    strcasecmp(od_authauthority_field(authorities, entry, 1), kDSTagAuthAuthorityKerberosv5) == 0)
+			return entry;
+	}
 
-    return theError;
+	return NULL;
 }
 
 
@@ -105,14 +79,14 @@ OSStatus ParseKerbAuthAuthority(CFStringRef inAuthority, CFArrayRef *outTokens)
 CF_RETURNS_RETAINED
 CFStringRef	GetPrincipalFromUser(CFDictionaryRef inUserRecord)
 {
-	CFArrayRef	tokens = NULL;
 	CFArrayRef	tmpArray = NULL;
 	CFTypeRef	tmpTypeRef = NULL;
-	CFStringRef	authAuthority = NULL;
+	CFDataRef	authData = NULL;
 	CFStringRef	tmpString = NULL;
 	CFStringRef	realmString = NULL;
 	CFStringRef	principal = NULL;
-	CFIndex		index;
+	const struct od_authauthority *authorities = NULL;
+	const struct od_authauthority_entry *entry = NULL;
 
 	// extract the auth-authority from the original attribute first, in case it is cached user
 	// @notes:  We could check the current auth authority to see if it is a cached user, but that would be
@@ -131,58 +105,66 @@ CFStringRef	GetPrincipalFromUser(CFDictionaryRef inUserRecord)
 		
 	if (CFArrayGetTypeID() == CFGetTypeID(tmpTypeRef)) {
 		// tmpTypeRef is an array of auth-authority strings
-		CFArrayRef authArray = (CFArrayRef)tmpTypeRef;
-		CFIndex authArrayCount = CFArrayGetCount(authArray);
-		for (index = 0; index < authArrayCount; index++) {
-			authAuthority = CFArrayGetValueAtIndex(authArray, index);
-			if ((authAuthority != NULL) && (CFStringGetTypeID() == CFGetTypeID(authAuthority)))	{
-				if (ParseKerbAuthAuthority(authAuthority, &tokens) == noErr) {
-					break;
-				}
-			}
-		}
+		authData = od_authauthority_create((CFArrayRef)tmpTypeRef);
 	} else if (CFStringGetTypeID() == CFGetTypeID(tmpTypeRef)) {
-		ParseKerbAuthAuthority((CFStringRef)tmpTypeRef, &tokens);
+		tmpArray = CFArrayCreate(NULL, &tmpTypeRef, 1, &kCFTypeArrayCallBacks);
+		authData = od_authauthority_create(tmpArray);
+		CFReleaseNull(tmpArray);
 	}
 
-    if (tokens == NULL)	// we didn't find a Kerberos auth authority
+	authorities = od_authauthority_get(authData);
+	entry = FindKerbAuthAuthority(authorities);
+    if (entry == NULL) {	// we didn't find a Kerberos auth authority
+		CFReleaseSafe(authData);
         return NULL;
+	}
 
     // stupid hack for <rdar://problem/5236943> Security::SecurityServer::ClientSession::authCopyRights blocks for ~20 seconds
 	// we're going to put a kdc in the auth authority and then not run it because we're idiots
     // when the local kdc starts running per default this hack must be removed.
-	realmString = (CFStringRef) CFArrayGetValueAtIndex(tokens, 4);
-	if (realmString && CFStringHasPrefix(realmString, CFSTR("LKDC:"))) {
-		CFRelease(tokens);
+	if (strncmp(od_authauthority_field(authorities, entry, 4), "LKDC:", 5) == 0) {
+		CFRelease(authData);
 		return NULL;
 	}
 	// end of stupid hack
 
+	realmString = CFStringCreateWithCString(NULL, od_authauthority_field(authorities, entry, 4), kCFStringEncodingUTF8);
+	if (realmString == NULL) {
+		CFRelease(authData);
+		return NULL;
+	}
+
     // do we have a principal name?
-	tmpString = (CFStringRef) CFArrayGetValueAtIndex(tokens, 3);
-	if (CFStringGetLength(tmpString) > 3) {	// smallest principal name is a@a
-		CFRetain(tmpString);
-		CFRelease(tokens);
-		return tmpString;
+	if (entry->fields[3].length > 3) {	// smallest principal name is a@a
+		principal = CFStringCreateWithCString(NULL, od_authauthority_field(authorities, entry, 3), kCFStringEncodingUTF8);
+		CFRelease(realmString);
+		CFRelease(authData);
+		return principal;
 	} else {
 		// No principal name in auth-authority, is there an id?
-		tmpString = (CFStringRef) CFArrayGetValueAtIndex(tokens, 2);
-		if (CFStringGetLength(tmpString) > 0) {
+		if (entry->fields[2].length > 0) {
 			// Non-empty is good enough for an id
-			realmString = (CFStringRef) CFArrayGetValueAtIndex(tokens, 4);
-			principal = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@@%@"), tmpString, realmString);
-			CFRelease(tokens);
+			tmpString = CFStringCreateWithCString(NULL, od_authauthority_field(authorities, entry, 2), kCFStringEncodingUTF8);
+			if (tmpString != NULL) {
+				principal = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@@%@"), tmpString, realmString);
+				CFRelease(tmpString);
+			}
+			CFRelease(realmString);
+			CFRelease(authData);
 			return principal;
 		}
 	 }
     // no id, get the user's short name
     tmpArray = (CFArrayRef) CFDictionaryGetValue(inUserRecord, CFSTR(kDSNAttrRecordName));
+    if (tmpArray == NULL || CFGetTypeID(tmpArray) != CFArrayGetTypeID() || CFArrayGetCount(tmpArray) == 0) {
+		CFRelease(realmString);
+		CFRelease(authData);
+		return NULL;
+    }
     tmpString = CFArrayGetValueAtIndex(tmpArray, 0);
 
-    realmString = (CFStringRef) CFArrayGetValueAtIndex(tokens, 4);
     principal = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@@%@"), tmpString, realmString);
-    CFRelease(tokens);
+    CFRelease(realmString);
+    CFRelease(authData);
     return principal;
 }
-
-
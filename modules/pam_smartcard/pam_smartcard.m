@@ -164,6 +164,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     CFStringRef cf_pin = NULL;
     OSStatus status;
     ODRecordRef od_record = NULL;
+    CFMutableArrayRef od_attributes = NULL;
     CFDataRef *token_context = NULL;
     CFDataRef pub_key_hash = NULL;
     CFDataRef pub_key_hash_wrap = NULL;
@@ -202,7 +203,22 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
         return retval;
     }
     
-    retval = od_record_create_cstring(pamh, &od_record, (const char*)user);
+    // everything read from the record below: the attribute cacloginconfig.plist matches on and,
+    // for the Kerberos principal, the authentication authorities (the original one of cached
+    // users) and the record name it falls back to
+    od_attributes = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+    if (od_attributes) {
+        CFStringRef config_attribute = copyConfigDSAttribute();
+        if (config_attribute) {
+            CFArrayAppendValue(od_attributes, config_attribute);
+            CFRelease(config_attribute);
+        }
+        CFArrayAppendValue(od_attributes, CFSTR(kDSNativeAttrTypePrefix "original_authentication_authority"));
+        CFArrayAppendValue(od_attributes, kODAttributeTypeAuthenticationAuthority);
+        CFArrayAppendValue(od_attributes, kODAttributeTypeRecordName);
+    }
+
+    retval = od_record_create_cstring_attrs(pamh, &od_record, (const char*)user, od_attributes);
     if (retval != PAM_SUCCESS) {
         _LOG_ERROR("%s - Unable to get user record %d.", PM_DISPLAY_NAME, retval);
         goto cleanup;
@@ -216,15 +232,11 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
         }
     } else {
         _LOG_DEBUG("%s - Trying to get kerbPrincipal from OD", PM_DISPLAY_NAME);
-        CFArrayRef records = find_user_record_by_attr_value(kDSNAttrRecordName, user);
-        if (records) {
-            for (CFIndex i = 0; i < CFArrayGetCount(records); ++i) {
-                CFTypeRef userRecord = CFArrayGetValueAtIndex(records, i);
-                kerberos_principal = GetPrincipalFromUser(userRecord);
-                if (kerberos_principal) {
-                    break;
-                }
-            }
+        // the record was loaded with both authentication authority attributes and its name
+        CFDictionaryRef details = ODRecordCopyDetails(od_record, od_attributes, NULL);
+        if (details) {
+            kerberos_principal = GetPrincipalFromUser(details);
+            CFRelease(details);
         }
     }
     if (kerberos_principal) {
@@ -404,6 +416,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 
 cleanup:
 	CFReleaseSafe(od_record);
+	CFReleaseSafe(od_attributes);
 	CFReleaseSafe(token_id);
 	CFReleaseSafe(pub_key_hash);
 	CFReleaseSafe(pub_key_hash_wrap);
@@ -156,7 +156,7 @@ cleanup:
     return NULL;
 }
 
-SecKeychainRef copySmartCardKeychainForUser(ODRecordRef odRecord, const char* username, SecIdentityRef* copiedIdentity)
+SecKeychainRef copySmartCardKeychainForUser(pam_handle_t *pamh, ODRecordRef odRecord, const char* username, SecIdentityRef* copiedIdentity)
 {
     if (odRecord == NULL || username == NULL)
         return NULL;
@@ -164,9 +164,9 @@ SecKeychainRef copySmartCardKeychainForUser(ODRecordRef odRecord, const char* us
     CFArrayRef identities = copyCardIdentities();
     if (identities)
     {
-        SecKeychainRef result = copyHashMatchedKeychain(odRecord, identities, copiedIdentity);
+        SecKeychainRef result = copyHashMatchedKeychain(pamh, odRecord, identities, copiedIdentity);
         if (result == NULL)
-            result = copyAttributeMatchedKeychain(odRecord, identities, copiedIdentity);
+            result = copyAttributeMatchedKeychain(pamh, odRecord, identities, copiedIdentity);
 
         if (copiedIdentity && *copiedIdentity)
             CFRetain(*copiedIdentity);
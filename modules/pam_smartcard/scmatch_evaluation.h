@@ -1,14 +1,20 @@
 #ifndef scmatch_evaluation_h
 #define scmatch_evaluation_h
+#include <security/pam_appl.h>
 #include <Security/Security.h>
 #include <CoreFoundation/CFArray.h>
 #include <OpenDirectory/OpenDirectory.h>
 
-SecKeychainRef copyAttributeMatchedKeychain(ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity);
-SecKeychainRef copyHashMatchedKeychain(ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity);
+// pamh, which may be NULL, tells which attributes odRecord was loaded with
+SecKeychainRef copyAttributeMatchedKeychain(pam_handle_t *pamh, ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity);
+// pamh, which may be NULL, keeps the parsed authentication authorities for the transaction
+SecKeychainRef copyHashMatchedKeychain(pam_handle_t *pamh, ODRecordRef odRecord, CFArrayRef identities, SecIdentityRef* returnedIdentity);
+
+// directory attribute named by cacloginconfig.plist, NULL without a valid config
+CFStringRef copyConfigDSAttribute(void);
 
 // caller is responsible for releasing copiedIdentity
-SecKeychainRef copySmartCardKeychainForUser(ODRecordRef odRecord, const char* username, SecIdentityRef* copiedIdentity);
+SecKeychainRef copySmartCardKeychainForUser(pam_handle_t *pamh, ODRecordRef odRecord, const char* username, SecIdentityRef* copiedIdentity);
 
 OSStatus verifySmartCardSigning(SecKeyRef publicKey, SecKeyRef privateKey);
 OSStatus validateCertificate(SecCertificateRef certificate, SecKeychainRef keychain);
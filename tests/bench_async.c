@@ -0,0 +1,205 @@
+/*
+ * Start many logins at once from a single thread through the asynchronous
+ * engine and wait for them with poll(), the way an event-driven daemon
+ * would.  A share of them carry a wrong password; those must not complete
+ * before the blinding window has passed, yet must not hold a thread while
+ * they wait.  With a file backend this builds and runs without
+ * OpenDirectory, e.g. on Linux:
+ *
+ * cc -O2 -DDIR_FILE_BACKEND -I../common -o bench_async bench_async.c ../common/AsyncAuth.c \
+ *	../common/Backend.c ../common/FileBackend.c ../common/AuthAuthority.c -lpthread
+ *
+ * Usage: bench_async <backend> <user name> <password> <# logins> <% wrong> <# workers> <window ms>
+ *
+ * e.g. bench_async 'file:backend_users?lookup_latency=2000&verify_latency=5000' jdoe secret 5000 20 16 250
+ */
+
+#include <sys/cdefs.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "AsyncAuth.h"
+#include "Backend.h"
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+enum {
+	kBatch = 64
+};
+
+struct login {
+	uint64_t	start;
+	int		wrong;
+};
+
+static uint64_t window;
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t
+fixed_window(__unused void *ctx)
+{
+	return window;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t *v, long n, int p)
+{
+	return n ? v[(n - 1) * p / 100] : 0;
+}
+
+/* only meaningful where /proc lists the threads */
+static long
+thread_count(void)
+{
+	DIR *dir = opendir("/proc/self/task");
+	struct dirent *entry = NULL;
+	long count = 0;
+
+	if (NULL == dir)
+		return -1;
+	while (NULL != (entry = readdir(dir))) {
+		if ('.' != entry->d_name[0])
+			++count;
+	}
+	closedir(dir);
+
+	return count;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct od_async_params params = { 0 };
+	struct od_async_stats stats;
+	struct od_async_auth *batch[kBatch];
+	struct dir_backend *backend = NULL;
+	struct od_async *engine = NULL;
+	struct login *logins = NULL;
+	struct pollfd pfd;
+	uint64_t *ok = NULL, *failed = NULL, start, elapsed;
+	long n, wrong, i, done = 0, nok = 0, nfailed = 0, early = 0, mismatched = 0, threads = -1;
+	size_t got, j;
+
+	if (argc != 8) {
+		fprintf(stderr, "Usage: %s <backend> <user name> <password> <# logins> <%% wrong> <# workers> <window ms>\n", argv[0]);
+		return 1;
+	}
+
+	n = strtol(argv[4], NULL, 10);
+	wrong = strtol(argv[5], NULL, 10);
+	params.workers = (unsigned int)strtoul(argv[6], NULL, 10);
+	window = strtoull(argv[7], NULL, 10) * 1000;
+	params.window = fixed_window;
+	if (n <= 0 || wrong < 0 || wrong > 100) {
+		fprintf(stderr, "invalid count or share of wrong passwords\n");
+		return 1;
+	}
+
+	if (NULL == (backend = dir_backend_open(argv[1]))) {
+		fprintf(stderr, "unable to open backend %s\n", argv[1]);
+		return 1;
+	}
+	if (NULL == (engine = od_async_create(backend, &params))) {
+		fprintf(stderr, "unable to start the engine\n");
+		dir_backend_close(backend);
+		return 1;
+	}
+
+	logins = calloc(n, sizeof(*logins));
+	ok = calloc(n, sizeof(*ok));
+	failed = calloc(n, sizeof(*failed));
+	if (NULL == logins || NULL == ok || NULL == failed) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	start = now_usec();
+	for (i = 0; i < n; ++i) {
+		logins[i].wrong = (i * 100 / n) < wrong ? 1 : 0;
+		logins[i].start = now_usec();
+		if (NULL == od_async_start(engine, argv[2], logins[i].wrong ? "not-the-password" : argv[3], NULL, &logins[i])) {
+			fprintf(stderr, "unable to start login %ld\n", i);
+			return 1;
+		}
+	}
+
+	pfd.fd = od_async_fd(engine);
+	pfd.events = POLLIN;
+	while (done < n) {
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+		if (threads < 0 || done < n / 2)
+			threads = thread_count();
+
+		while (0 != (got = od_async_collect(engine, batch, kBatch))) {
+			for (j = 0; j < got; ++j) {
+				struct login *login = od_async_context(batch[j]);
+				int result = od_async_result(batch[j]);
+
+				elapsed = now_usec() - login->start;
+				if (PAM_SUCCESS == result) {
+					ok[nok++] = elapsed;
+					if (login->wrong)
+						++mismatched;
+				} else {
+					failed[nfailed++] = elapsed;
+					if (!login->wrong)
+						++mismatched;
+					if (elapsed < window)
+						++early;
+				}
+				od_async_release(batch[j]);
+				++done;
+			}
+		}
+	}
+	elapsed = now_usec() - start;
+
+	od_async_get_stats(engine, &stats);
+	od_async_destroy(engine);
+
+	qsort(ok, nok, sizeof(*ok), compare);
+	qsort(failed, nfailed, sizeof(*failed), compare);
+
+	printf("Logins             : %ld in %.2f s (%.0f/s), %s workers, blinding window %s ms\n", n,
+	       (double)elapsed / 1000000, n * 1000000.0 / elapsed, argv[6], argv[7]);
+	printf("Threads            : %ld in the process, %u logins in flight at most\n", threads, stats.peak_in_flight);
+	printf("Successes          : %ld, p50 %.1f ms, p95 %.1f ms\n", nok,
+	       percentile(ok, nok, 50) / 1000.0, percentile(ok, nok, 95) / 1000.0);
+	printf("Failures           : %ld, p50 %.1f ms, p95 %.1f ms, %llu held by the timer\n", nfailed,
+	       percentile(failed, nfailed, 50) / 1000.0, percentile(failed, nfailed, 95) / 1000.0,
+	       (unsigned long long)stats.blinded);
+	printf("Inside the window  : %ld failures returned early\n", early);
+	printf("Wrong results      : %ld\n", mismatched);
+
+	free(logins);
+	free(ok);
+	free(failed);
+
+	return (0 == early && 0 == mismatched) ? 0 : 1;
+}
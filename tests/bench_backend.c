@@ -0,0 +1,206 @@
+/*
+ * Drive a directory backend the way a login does: look the user up
+ * (through the record cache when a TTL is given), run the account checks of
+ * pam_sm_acct_mgmt(), copy the home directory and Kerberos principal and
+ * verify the password, from several threads at once.  The checks and
+ * copies are the UserRecord.c code the modules run.  With a file backend
+ * this builds and runs without OpenDirectory, e.g. on Linux:
+ *
+ * cc -O2 -DDIR_FILE_BACKEND -I../common -o bench_backend bench_backend.c ../common/Backend.c \
+ *	../common/FileBackend.c ../common/AuthAuthority.c ../common/UserRecord.c -lpthread
+ *
+ * Usage: bench_backend <backend> <user name> <password> <# logins per thread> <# threads> [cache ttl s]
+ *
+ * e.g. bench_backend 'file:backend_users?lookup_latency=2000&verify_latency=20000' jdoe secret 1000 8
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+
+#include "Backend.h"
+#include "UserRecord.h"
+
+static struct dir_backend *backend;
+static struct dir_cache *cache;
+static const char *user, *password;
+static struct od_account_rules rules;
+static uint64_t ttl;
+static long logins;
+
+struct worker {
+	pthread_t	thread;
+	uint64_t	lookup;
+	uint64_t	account;
+	uint64_t	copy;
+	uint64_t	verify;
+	long		failures;
+};
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void *
+cache_retain(void *record)
+{
+	return backend->ops->retain(backend, record);
+}
+
+static void
+cache_release(void *record)
+{
+	backend->ops->release(backend, record);
+}
+
+static int
+cache_fetch(__attribute__((unused)) void *ctx, const char *key, void **record)
+{
+	return backend->ops->lookup(backend, key, record);
+}
+
+static int
+login(struct worker *w)
+{
+	void *record = NULL;
+	char *server_URL = NULL, *path = NULL, *homedir = NULL, *principal = NULL;
+	uint64_t start = now_usec(), t;
+	int retval;
+
+	if (NULL != cache)
+		retval = dir_cache_lookup(cache, user, ttl, cache_fetch, NULL, &record);
+	else
+		retval = backend->ops->lookup(backend, user, &record);
+	t = now_usec();
+	w->lookup += t - start;
+	if (PAM_SUCCESS != retval)
+		return retval;
+
+	start = t;
+	retval = dir_check_account(backend, record, &rules);
+	t = now_usec();
+	w->account += t - start;
+
+	if (PAM_SUCCESS == retval) {
+		start = t;
+		retval = dir_copy_home(backend, record, &server_URL, &path, &homedir);
+		/* not every user has a Kerberos principal */
+		if (PAM_SUCCESS == retval)
+			(void)dir_copy_principal(backend, record, &principal);
+		t = now_usec();
+		w->copy += t - start;
+	}
+
+	if (PAM_SUCCESS == retval) {
+		start = t;
+		retval = backend->ops->verify_password(backend, record, password);
+		w->verify += now_usec() - start;
+	}
+
+	free(server_URL);
+	free(path);
+	free(homedir);
+	free(principal);
+	backend->ops->release(backend, record);
+
+	return retval;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	long i;
+
+	for (i = 0; i < logins; ++i) {
+		if (PAM_SUCCESS != login(w))
+			++w->failures;
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct worker *workers = NULL;
+	struct dir_cache_stats stats;
+	uint64_t start, elapsed, lookup = 0, account = 0, copy = 0, verify = 0;
+	long i, nthreads, failures = 0, total;
+
+	if (argc != 6 && argc != 7) {
+		fprintf(stderr, "Usage: %s <backend> <user name> <password> <# logins per thread> <# threads> [cache ttl s]\n", argv[0]);
+		return 1;
+	}
+
+	user = argv[2];
+	password = argv[3];
+	logins = strtol(argv[4], NULL, 10);
+	nthreads = strtol(argv[5], NULL, 10);
+	ttl = (argc == 7) ? strtoull(argv[6], NULL, 10) * 1000000 : 0;
+	if (logins <= 0 || nthreads <= 0) {
+		fprintf(stderr, "invalid login or thread count\n");
+		return 1;
+	}
+
+	backend = dir_backend_open(argv[1]);
+	if (NULL == backend) {
+		fprintf(stderr, "cannot open backend %s\n", argv[1]);
+		return 1;
+	}
+	if (0 != ttl && NULL == (cache = dir_cache_create(256, cache_retain, cache_release))) {
+		fprintf(stderr, "cannot create record cache\n");
+		return 1;
+	}
+
+	dir_account_rules_init(&rules, true, NULL, true, NULL);
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (NULL == workers)
+		return 1;
+
+	start = now_usec();
+	for (i = 0; i < nthreads; ++i) {
+		if (0 != pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		lookup += workers[i].lookup;
+		account += workers[i].account;
+		copy += workers[i].copy;
+		verify += workers[i].verify;
+		failures += workers[i].failures;
+	}
+	elapsed = now_usec() - start;
+	total = logins * nthreads;
+
+	printf("Backend            : %s\n", backend->ops->name);
+	printf("Logins             : %ld (%ld failed) on %ld threads\n", total, failures, nthreads);
+	printf("Throughput         : %.1f logins/s\n", (double)total * 1000000 / (double)elapsed);
+	printf("Lookup             : %llu us/login\n", (unsigned long long)(lookup / total));
+	printf("Account checks     : %llu us/login\n", (unsigned long long)(account / total));
+	printf("Home, principal    : %llu us/login\n", (unsigned long long)(copy / total));
+	printf("Verify             : %llu us/login\n", (unsigned long long)(verify / total));
+	if (NULL != cache) {
+		dir_cache_get_stats(cache, &stats);
+		printf("Cache              : %llu hits, %llu misses, %llu coalesced\n",
+		       (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+		       (unsigned long long)stats.coalesced);
+	}
+
+	dir_backend_close(backend);
+	free(workers);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Replay how pam_krb5 hands credentials from authenticate to setcred, to
+ * count the file system calls one login makes.  "file" is the old way: a
+ * temporary FILE cache is created, chowned and filled, then read back in
+ * setcred and copied ticket by ticket into the permanent cache before it
+ * is destroyed.  "memory" keeps the temporary cache in a MEMORY cache and
+ * fills the permanent one with krb5_cc_copy_cache().  No KDC is needed;
+ * the two tickets are made up.
+ *
+ * cc -O2 -o bench_krb5_ccache bench_krb5_ccache.c -F/System/Library/PrivateFrameworks -framework Heimdal
+ *
+ * Usage: bench_krb5_ccache <file|memory> <# logins> <permanent cache path>
+ *
+ * e.g. sudo dtruss -c ./bench_krb5_ccache memory 100 /tmp/krb5cc_bench
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Heimdal/krb5.h>
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static krb5_error_code
+make_creds(krb5_context context, const char *client, const char *server, krb5_creds *creds)
+{
+	static char ticket[1024];
+	krb5_error_code ret;
+
+	memset(creds, 0, sizeof(*creds));
+	if (0 != (ret = krb5_parse_name(context, client, &creds->client)))
+		return ret;
+	if (0 != (ret = krb5_parse_name(context, server, &creds->server)))
+		return ret;
+	creds->times.authtime = creds->times.starttime = time(NULL);
+	creds->times.endtime = creds->times.authtime + 10 * 60 * 60;
+	creds->ticket.data = ticket;
+	creds->ticket.length = sizeof(ticket);
+
+	return 0;
+}
+
+static void
+free_creds(krb5_context context, krb5_creds *creds)
+{
+	krb5_free_principal(context, creds->client);
+	krb5_free_principal(context, creds->server);
+}
+
+/* authenticate: the TGT, then the host ticket verify_krb_v5_tgt() adds */
+static krb5_error_code
+authenticate(krb5_context context, const char *type, krb5_creds *tgt, krb5_creds *host, char **name)
+{
+	krb5_ccache ccache;
+	krb5_error_code ret;
+
+	if (0 != (ret = krb5_cc_new_unique(context, type, NULL, &ccache)))
+		return ret;
+	if (0 != (ret = krb5_cc_initialize(context, ccache, tgt->client)) ||
+	    0 != (ret = krb5_cc_store_cred(context, ccache, tgt))) {
+		krb5_cc_destroy(context, ccache);
+		return ret;
+	}
+	if (0 == strcmp("FILE", type))
+		chown(krb5_cc_get_name(context, ccache), getuid(), getgid());
+	if (0 != (ret = krb5_cc_store_cred(context, ccache, host))) {
+		krb5_cc_destroy(context, ccache);
+		return ret;
+	}
+	asprintf(name, "%s:%s", type, krb5_cc_get_name(context, ccache));
+	krb5_cc_close(context, ccache);
+
+	return (NULL != *name) ? 0 : ENOMEM;
+}
+
+static krb5_error_code
+setcred(krb5_context context, int memory, const char *name, const char *perm_name)
+{
+	krb5_ccache temp, perm;
+	krb5_principal princ;
+	krb5_cc_cursor cursor;
+	krb5_creds creds;
+	krb5_error_code ret;
+
+	if (0 != (ret = krb5_cc_resolve(context, name, &temp)))
+		return ret;
+	if (0 != (ret = krb5_cc_resolve(context, perm_name, &perm))) {
+		krb5_cc_destroy(context, temp);
+		return ret;
+	}
+
+	if (memory) {
+		ret = krb5_cc_copy_cache(context, temp, perm);
+	} else if (0 == (ret = krb5_cc_get_principal(context, temp, &princ))) {
+		ret = krb5_cc_initialize(context, perm, princ);
+		krb5_free_principal(context, princ);
+		if (0 == ret)
+			ret = krb5_cc_start_seq_get(context, temp, &cursor);
+		if (0 == ret) {
+			while (0 == krb5_cc_next_cred(context, temp, &cursor, &creds)) {
+				ret = krb5_cc_store_cred(context, perm, &creds);
+				krb5_free_cred_contents(context, &creds);
+				if (0 != ret)
+					break;
+			}
+			krb5_cc_end_seq_get(context, temp, &cursor);
+		}
+	}
+
+	krb5_cc_destroy(context, temp);
+	krb5_cc_close(context, perm);
+
+	return ret;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	krb5_context context;
+	krb5_creds tgt, host;
+	char *name = NULL, *perm_name = NULL;
+	uint64_t start, elapsed;
+	long logins, i, failures = 0;
+	int memory;
+
+	if (argc != 4 || (0 != strcmp(argv[1], "file") && 0 != strcmp(argv[1], "memory"))) {
+		fprintf(stderr, "Usage: %s <file|memory> <# logins> <permanent cache path>\n", argv[0]);
+		return 1;
+	}
+	memory = (0 == strcmp(argv[1], "memory"));
+	logins = strtol(argv[2], NULL, 10);
+	if (logins <= 0) {
+		fprintf(stderr, "invalid count\n");
+		return 1;
+	}
+
+	if (0 != krb5_init_context(&context)) {
+		fprintf(stderr, "unable to create a krb5 context\n");
+		return 1;
+	}
+	asprintf(&perm_name, "FILE:%s", argv[3]);
+	if (NULL == perm_name ||
+	    0 != make_creds(context, "jdoe@EXAMPLE.COM", "krbtgt/EXAMPLE.COM@EXAMPLE.COM", &tgt) ||
+	    0 != make_creds(context, "jdoe@EXAMPLE.COM", "host/localhost@EXAMPLE.COM", &host)) {
+		fprintf(stderr, "unable to set up credentials\n");
+		return 1;
+	}
+
+	start = now_usec();
+	for (i = 0; i < logins; ++i) {
+		if (0 != authenticate(context, memory ? "MEMORY" : "FILE", &tgt, &host, &name) ||
+		    0 != setcred(context, memory, name, perm_name))
+			++failures;
+		free(name);
+		name = NULL;
+	}
+	elapsed = now_usec() - start;
+
+	printf("Handoff            : %s\n", memory ? "MEMORY cache, one copy" : "FILE cache, ticket by ticket");
+	printf("Logins             : %ld in %.3f s, %.1f us each, %ld failed\n", logins,
+	       (double)elapsed / 1000000, (double)elapsed / logins, failures);
+
+	free_creds(context, &tgt);
+	free_creds(context, &host);
+	free(perm_name);
+	krb5_free_context(context);
+
+	return failures ? 1 : 0;
+}
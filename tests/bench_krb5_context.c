@@ -0,0 +1,143 @@
+/*
+ * Measure what setting up krb5 contexts costs a pam_krb5 login, which
+ * needs one in authenticate, setcred and acct_mgmt.  Each login is run
+ * first with a fresh context per call and then with contexts from the
+ * pool.  With a configuration file path given, the file is touched every
+ * 100 logins so the pool has to notice and start over.
+ *
+ * cc -O2 -I../common -o bench_krb5_context bench_krb5_context.c ../common/Krb5ContextPool.c \
+ *	../common/SharedTable.c -F/System/Library/PrivateFrameworks -framework Heimdal
+ *
+ * or against MIT Kerberos, e.g. on Linux:
+ *
+ * cc -O2 -I../common -o bench_krb5_context bench_krb5_context.c ../common/Krb5ContextPool.c \
+ *	../common/SharedTable.c -lkrb5 -lpthread -ldl
+ *
+ * Usage: bench_krb5_context <# logins> <# threads> [krb5.conf to touch]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <utime.h>
+
+#include "Krb5ContextPool.h"
+
+enum {
+	kCallsPerLogin = 3,
+	kTouchEvery    = 100
+};
+
+static long logins;
+static const char *touch;
+static int pooled;
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void *
+worker(void *arg)
+{
+	long *failures = arg;
+	krb5_context context;
+	long i;
+	int call;
+
+	for (i = 0; i < logins; ++i) {
+		if (NULL != touch && 0 == i % kTouchEvery)
+			utime(touch, NULL);
+
+		for (call = 0; call < kCallsPerLogin; ++call) {
+			if (pooled) {
+				if (0 != od_krb5_context_get(&context)) {
+					++*failures;
+					continue;
+				}
+				od_krb5_context_put(context);
+			} else {
+				if (0 != krb5_init_context(&context)) {
+					++*failures;
+					continue;
+				}
+				krb5_free_context(context);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static double
+run(long nthreads)
+{
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	long *failures = calloc(nthreads, sizeof(*failures));
+	uint64_t start, elapsed;
+	long t, failed = 0;
+
+	if (NULL == threads || NULL == failures) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	start = now_usec();
+	for (t = 0; t < nthreads; ++t)
+		pthread_create(&threads[t], NULL, worker, &failures[t]);
+	for (t = 0; t < nthreads; ++t) {
+		pthread_join(threads[t], NULL);
+		failed += failures[t];
+	}
+	elapsed = now_usec() - start;
+
+	if (failed)
+		fprintf(stderr, "%ld context setups failed\n", failed);
+	free(threads);
+	free(failures);
+
+	/* us of wall time per login, all threads together */
+	return (double)elapsed / (logins * nthreads);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct od_krb5_pool_stats stats;
+	double fresh, reused;
+	long nthreads;
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s <# logins> <# threads> [krb5.conf to touch]\n", argv[0]);
+		return 1;
+	}
+
+	logins = strtol(argv[1], NULL, 10);
+	nthreads = strtol(argv[2], NULL, 10);
+	touch = (argc == 4) ? argv[3] : NULL;
+	if (logins <= 0 || nthreads <= 0) {
+		fprintf(stderr, "invalid count\n");
+		return 1;
+	}
+
+	pooled = 0;
+	fresh = run(nthreads);
+	pooled = 1;
+	reused = run(nthreads);
+	od_krb5_pool_copy_stats(&stats);
+
+	printf("Logins             : %ld on %ld threads, %d contexts each\n", logins * nthreads, nthreads, kCallsPerLogin);
+	printf("Fresh contexts     : %.1f us per login\n", fresh);
+	printf("Pooled contexts    : %.1f us per login (%.1fx)\n", reused, reused > 0 ? fresh / reused : 0);
+	printf("Pool               : %llu created, %llu reused, %llu flushes, %llu discarded, %u idle\n",
+	       (unsigned long long)stats.created, (unsigned long long)stats.reused,
+	       (unsigned long long)stats.flushes, (unsigned long long)stats.discarded, stats.idle);
+
+	return 0;
+}
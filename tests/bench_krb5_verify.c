@@ -0,0 +1,189 @@
+/*
+ * Verify a TGT the way pam_krb5 does, from many threads at once: build an
+ * AP-REQ for the host principal and read it back against the keytab.  In
+ * "rcache" mode krb5_rd_req() is left to its defaults, which may record
+ * every authenticator in the on-disk replay cache; in "norcache" mode the
+ * auth context is set up as pam_krb5 now does, without one.  The TGT is
+ * fetched once and the host ticket is then served from the memory cache,
+ * so after the first round only local work is timed.  Needs the host key
+ * in the default keytab, so run it as root.
+ *
+ * cc -O2 -o bench_krb5_verify bench_krb5_verify.c -F/System/Library/PrivateFrameworks -framework Heimdal
+ *
+ * Usage: bench_krb5_verify <rcache|norcache> <principal> <password> <# verifications> <# threads>
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <Heimdal/krb5.h>
+
+static char *ccache_name;
+static krb5_principal host;
+static long verifications;
+static int use_rcache;
+
+struct worker {
+	pthread_t	thread;
+	uint64_t	slowest;
+	long		failures;
+};
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static krb5_error_code
+verify(krb5_context context, krb5_ccache ccache)
+{
+	krb5_auth_context auth_context = NULL;
+	krb5_data packet = { 0 };
+	krb5_int32 flags = 0;
+	krb5_error_code ret;
+
+	ret = krb5_mk_req_exact(context, &auth_context, 0, host, NULL, ccache, &packet);
+	if (auth_context) {
+		krb5_auth_con_free(context, auth_context);
+		auth_context = NULL;
+	}
+	if (ret)
+		return ret;
+
+	if (!use_rcache) {
+		ret = krb5_auth_con_init(context, &auth_context);
+		if (ret == 0) {
+			krb5_auth_con_getflags(context, auth_context, &flags);
+			krb5_auth_con_setflags(context, auth_context, flags & ~KRB5_AUTH_CONTEXT_DO_TIME);
+			krb5_auth_con_setrcache(context, auth_context, NULL);
+		}
+	}
+	if (ret == 0)
+		ret = krb5_rd_req(context, &auth_context, &packet, host, NULL, NULL, NULL);
+
+	if (auth_context)
+		krb5_auth_con_free(context, auth_context);
+	krb5_data_free(&packet);
+
+	return ret;
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *w = arg;
+	krb5_context context;
+	krb5_ccache ccache;
+	uint64_t start, elapsed;
+	long i;
+
+	/* a context is not shared between threads; a memory cache can be */
+	if (0 != krb5_init_context(&context)) {
+		w->failures = verifications;
+		return NULL;
+	}
+	if (0 != krb5_cc_resolve(context, ccache_name, &ccache)) {
+		w->failures = verifications;
+		krb5_free_context(context);
+		return NULL;
+	}
+
+	for (i = 0; i < verifications; ++i) {
+		start = now_usec();
+		if (0 != verify(context, ccache))
+			++w->failures;
+		elapsed = now_usec() - start;
+		if (elapsed > w->slowest)
+			w->slowest = elapsed;
+	}
+
+	krb5_cc_close(context, ccache);
+	krb5_free_context(context);
+
+	return NULL;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	krb5_context context;
+	krb5_ccache ccache;
+	krb5_get_init_creds_opt *opts = NULL;
+	krb5_principal client = NULL;
+	krb5_creds creds;
+	struct worker *workers = NULL;
+	uint64_t start, elapsed, slowest = 0;
+	long nthreads, t, failures = 0;
+
+	if (argc != 6 || (0 != strcmp(argv[1], "rcache") && 0 != strcmp(argv[1], "norcache"))) {
+		fprintf(stderr, "Usage: %s <rcache|norcache> <principal> <password> <# verifications> <# threads>\n", argv[0]);
+		return 1;
+	}
+	use_rcache = (0 == strcmp(argv[1], "rcache"));
+	verifications = strtol(argv[4], NULL, 10);
+	nthreads = strtol(argv[5], NULL, 10);
+	if (verifications <= 0 || nthreads <= 0) {
+		fprintf(stderr, "invalid count\n");
+		return 1;
+	}
+
+	memset(&creds, 0, sizeof(creds));
+	if (0 != krb5_init_context(&context) ||
+	    0 != krb5_parse_name(context, argv[2], &client) ||
+	    0 != krb5_get_init_creds_opt_alloc(context, &opts) ||
+	    0 != krb5_get_init_creds_password(context, &creds, client, argv[3], NULL, NULL, 0, NULL, opts) ||
+	    0 != krb5_cc_new_unique(context, "MEMORY", NULL, &ccache) ||
+	    0 != krb5_cc_initialize(context, ccache, client) ||
+	    0 != krb5_cc_store_cred(context, ccache, &creds) ||
+	    0 != krb5_sname_to_principal(context, NULL, "host", KRB5_NT_SRV_HST, &host) ||
+	    asprintf(&ccache_name, "MEMORY:%s", krb5_cc_get_name(context, ccache)) < 0) {
+		fprintf(stderr, "unable to get a TGT for %s\n", argv[2]);
+		return 1;
+	}
+
+	/* the host ticket lands in the cache here, outside the timing */
+	if (0 != verify(context, ccache)) {
+		fprintf(stderr, "unable to verify against the host key; is it in the keytab?\n");
+		return 1;
+	}
+
+	if (NULL == (workers = calloc(nthreads, sizeof(*workers)))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	start = now_usec();
+	for (t = 0; t < nthreads; ++t)
+		pthread_create(&workers[t].thread, NULL, run, &workers[t]);
+	for (t = 0; t < nthreads; ++t) {
+		pthread_join(workers[t].thread, NULL);
+		failures += workers[t].failures;
+		if (workers[t].slowest > slowest)
+			slowest = workers[t].slowest;
+	}
+	elapsed = now_usec() - start;
+
+	printf("Replay cache       : %s\n", use_rcache ? "library default" : "none");
+	printf("Verifications      : %ld on %ld threads in %.2f s (%.0f/s), %ld failed\n",
+	       verifications * nthreads, nthreads, (double)elapsed / 1000000,
+	       verifications * nthreads * 1000000.0 / elapsed, failures);
+	printf("Slowest            : %.1f ms\n", slowest / 1000.0);
+
+	krb5_free_cred_contents(context, &creds);
+	krb5_get_init_creds_opt_free(context, opts);
+	krb5_free_principal(context, client);
+	krb5_free_principal(context, host);
+	krb5_cc_destroy(context, ccache);
+	krb5_free_context(context);
+	free(ccache_name);
+	free(workers);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Compare per-lookup latency of a user record fetch when the
+ * authentication search node is opened for every lookup (the old
+ * od_record_create behaviour) and when one node is reused.
+ *
+ * cc -o bench_od_node bench_od_node.c -framework CoreFoundation \
+ *	-framework OpenDirectory -framework DirectoryService
+ *
+ * Usage: bench_od_node <user name> <# lookups>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <DirectoryService/DirectoryService.h>
+#include <OpenDirectory/OpenDirectory.h>
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static ODNodeRef
+open_search_node(void)
+{
+	return ODNodeCreateWithNodeType(kCFAllocatorDefault, kODSessionDefault,
+					eDSAuthenticationSearchNodeName, NULL);
+}
+
+static int
+lookup(ODNodeRef node, CFStringRef user, CFArrayRef attrs)
+{
+	ODRecordRef record = ODNodeCopyRecord(node, kODRecordTypeUsers, user, attrs, NULL);
+
+	if (NULL == record)
+		return -1;
+	CFRelease(record);
+	return 0;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	CFStringRef user = NULL;
+	CFArrayRef attrs = NULL;
+	ODNodeRef node = NULL;
+	CFTypeRef vals[] = {
+		kODAttributeTypeAuthenticationAuthority,
+		kODAttributeTypeHomeDirectory,
+		kODAttributeTypeNFSHomeDirectory,
+		kODAttributeTypeUserShell,
+		kODAttributeTypeUniqueID,
+	};
+	uint64_t start, per_call, reused;
+	long i, count;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <user name> <# lookups>\n", argv[0]);
+		return 1;
+	}
+
+	count = strtol(argv[2], NULL, 10);
+	if (count <= 0) {
+		fprintf(stderr, "invalid lookup count\n");
+		return 1;
+	}
+
+	user = CFStringCreateWithCString(kCFAllocatorDefault, argv[1], kCFStringEncodingUTF8);
+	attrs = CFArrayCreate(kCFAllocatorDefault, vals, sizeof(vals) / sizeof(vals[0]), &kCFTypeArrayCallBacks);
+	if (NULL == user || NULL == attrs)
+		return 1;
+
+	start = now_usec();
+	for (i = 0; i < count; ++i) {
+		node = open_search_node();
+		if (NULL == node || 0 != lookup(node, user, attrs)) {
+			fprintf(stderr, "lookup of %s failed\n", argv[1]);
+			return 1;
+		}
+		CFRelease(node);
+	}
+	per_call = (now_usec() - start) / count;
+
+	node = open_search_node();
+	if (NULL == node)
+		return 1;
+	start = now_usec();
+	for (i = 0; i < count; ++i) {
+		if (0 != lookup(node, user, attrs)) {
+			fprintf(stderr, "lookup of %s failed\n", argv[1]);
+			return 1;
+		}
+	}
+	reused = (now_usec() - start) / count;
+	CFRelease(node);
+
+	printf("Lookups            : %ld\n", count);
+	printf("Node per lookup    : %llu us/lookup\n", per_call);
+	printf("Reused search node : %llu us/lookup\n", reused);
+
+	CFRelease(attrs);
+	CFRelease(user);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Authenticate through a PAM service with a scripted conversation that
+ * answers the password prompt only after a typing delay, and report how
+ * long each login still takes once the password is in.  Run it against a
+ * service whose pam_opendirectory line carries no_prefetch and one whose
+ * line does not: with the record lookup overlapped with the typing, the
+ * time after the password drops by about one directory round trip.
+ *
+ * cc -o bench_prefetch bench_prefetch.c -lpam
+ *
+ * Usage: bench_prefetch <service> <user name> <password> <typing delay ms> <# logins>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+struct script {
+	const char	*user;
+	const char	*password;
+	useconds_t	typing;
+	uint64_t	answered;	/* when the password went back to PAM */
+};
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int
+scripted_conv(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata)
+{
+	struct script *script = appdata;
+	struct pam_response *replies = NULL;
+	int i;
+
+	replies = calloc(num_msg, sizeof(*replies));
+	if (NULL == replies)
+		return PAM_BUF_ERR;
+
+	for (i = 0; i < num_msg; ++i) {
+		switch (msg[i]->msg_style) {
+			case PAM_PROMPT_ECHO_OFF:
+				usleep(script->typing);
+				replies[i].resp = strdup(script->password);
+				script->answered = now_usec();
+				break;
+			case PAM_PROMPT_ECHO_ON:
+				replies[i].resp = strdup(script->user);
+				break;
+			default:
+				break;
+		}
+	}
+
+	*resp = replies;
+	return PAM_SUCCESS;
+}
+
+static int
+compare_usec(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct script script;
+	struct pam_conv conv = { scripted_conv, &script };
+	pam_handle_t *pamh = NULL;
+	uint64_t *after = NULL, start, end, total = 0, sum = 0;
+	long i, logins, failures = 0;
+	int retval;
+
+	if (argc != 6) {
+		fprintf(stderr, "Usage: %s <service> <user name> <password> <typing delay ms> <# logins>\n", argv[0]);
+		return 1;
+	}
+
+	script.user = argv[2];
+	script.password = argv[3];
+	script.typing = (useconds_t)strtoul(argv[4], NULL, 10) * 1000;
+	logins = strtol(argv[5], NULL, 10);
+	if (logins <= 0) {
+		fprintf(stderr, "invalid login count\n");
+		return 1;
+	}
+
+	after = calloc(logins, sizeof(*after));
+	if (NULL == after)
+		return 1;
+
+	for (i = 0; i < logins; ++i) {
+		script.answered = 0;
+		start = now_usec();
+		retval = pam_start(argv[1], script.user, &conv, &pamh);
+		if (PAM_SUCCESS == retval)
+			retval = pam_authenticate(pamh, 0);
+		end = now_usec();
+		if (NULL != pamh)
+			pam_end(pamh, retval);
+		pamh = NULL;
+
+		if (PAM_SUCCESS != retval)
+			++failures;
+		/* no prompt means the password came from elsewhere; count it all */
+		after[i] = end - (0 != script.answered ? script.answered : start);
+		total += end - start;
+		sum += after[i];
+	}
+
+	qsort(after, logins, sizeof(*after), compare_usec);
+
+	printf("Service            : %s\n", argv[1]);
+	printf("Logins             : %ld (%ld failed)\n", logins, failures);
+	printf("Typing delay       : %s ms\n", argv[4]);
+	printf("Login              : %llu us mean\n", (unsigned long long)(total / logins));
+	printf("After the password : %llu us mean, %llu us p50, %llu us p95\n",
+	       (unsigned long long)(sum / logins), (unsigned long long)after[logins / 2],
+	       (unsigned long long)after[logins * 95 / 100]);
+
+	free(after);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Simulate a password spray against the failed-attempt tracker and count
+ * how many attempts would still reach the directory.  Attacking hosts try
+ * one wrong password against every user in turn while office hosts log
+ * their own users in, mistyping now and then; a refused office login is a
+ * false positive.  Counters decay in real time, so run it for a few
+ * half-lives.
+ *
+ * cc -I../common -o bench_spray bench_spray.c ../common/AttemptTracker.c ../common/SharedTable.c -lm
+ *
+ * Usage: bench_spray <attempt_limit> <attempt_source_limit> <halflife ms> <seconds> <attempts/s>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "AttemptTracker.h"
+
+enum {
+	kUsers        = 2000,
+	kAttackers    = 64,
+	kOffices      = 8,
+	kOfficeShare  = 10,	/* % of attempts that are office logins */
+	kTypoPercent  = 10
+};
+
+struct tally {
+	uint64_t	attempts;
+	uint64_t	directory;	/* attempts the tracker let through */
+	uint64_t	shed;
+	uint64_t	office;
+	uint64_t	office_refused;
+};
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void
+attempt(struct od_attempt_tracker *tracker, const struct od_attempt_params *params,
+	const char *user, const char *rhost, int correct, int is_office, struct tally *t)
+{
+	++t->attempts;
+	if (is_office)
+		++t->office;
+
+	if (od_attempt_blocked(tracker, user, rhost, params)) {
+		++t->shed;
+		if (is_office)
+			++t->office_refused;
+		return;
+	}
+
+	/* the directory would have been asked here */
+	++t->directory;
+	if (correct)
+		od_attempt_succeeded(tracker, user, rhost);
+	else
+		od_attempt_failed(tracker, user, rhost, params);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct od_attempt_params params;
+	struct od_attempt_tracker *tracker = NULL;
+	struct od_attempt_stats stats;
+	struct tally t;
+	char path[] = "/tmp/bench_spray.XXXXXX";
+	char user[32], rhost[32];
+	uint64_t start, end, interval, next;
+	unsigned int spray = 0;
+	int fd;
+
+	if (argc != 6) {
+		fprintf(stderr, "Usage: %s <attempt_limit> <attempt_source_limit> <halflife ms> <seconds> <attempts/s>\n", argv[0]);
+		return 1;
+	}
+
+	od_attempt_default_params(&params);
+	params.user_limit = strtod(argv[1], NULL);
+	params.source_limit = strtod(argv[2], NULL);
+	params.halflife = strtoull(argv[3], NULL, 10) * 1000;
+	end = strtoull(argv[4], NULL, 10) * 1000000;
+	interval = strtoull(argv[5], NULL, 10);
+	if (0 == interval || 0 == end) {
+		fprintf(stderr, "invalid duration or rate\n");
+		return 1;
+	}
+	interval = 1000000 / interval;
+
+	/* a fresh file, so the run starts from an empty table */
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	tracker = od_attempt_open(path);
+	if (NULL == tracker) {
+		fprintf(stderr, "unable to open a tracker\n");
+		unlink(path);
+		return 1;
+	}
+
+	memset(&t, 0, sizeof(t));
+	start = now_usec();
+	end += start;
+	for (next = start; next < end; next += interval) {
+		uint64_t now = now_usec();
+
+		if (now < next)
+			usleep((useconds_t)(next - now));
+
+		if (arc4random_uniform(100) < kOfficeShare) {
+			unsigned int office = arc4random_uniform(kOffices);
+
+			/* each office has its own handful of users */
+			snprintf(user, sizeof(user), "staff%u", office * 8 + arc4random_uniform(8));
+			snprintf(rhost, sizeof(rhost), "10.0.0.%u", office + 1);
+			attempt(tracker, &params, user, rhost, arc4random_uniform(100) >= kTypoPercent, 1, &t);
+		} else {
+			/* attackers take turns walking the user list */
+			snprintf(user, sizeof(user), "user%u", spray / kAttackers % kUsers);
+			snprintf(rhost, sizeof(rhost), "203.0.113.%u", spray % kAttackers + 1);
+			++spray;
+			attempt(tracker, &params, user, rhost, 0, 0, &t);
+		}
+	}
+
+	od_attempt_copy_stats(tracker, &stats);
+
+	printf("Limits             : %s per user and host, %s per host, halflife %s ms\n", argv[1], argv[2], argv[3]);
+	printf("Attempts           : %llu in %.1f s\n", (unsigned long long)t.attempts,
+	       (double)(now_usec() - start) / 1000000);
+	printf("Directory calls    : %llu (%.1f%% of attempts)\n", (unsigned long long)t.directory,
+	       t.attempts ? 100.0 * t.directory / t.attempts : 0);
+	printf("Refused locally    : %llu\n", (unsigned long long)t.shed);
+	printf("Office logins      : %llu, %llu refused\n", (unsigned long long)t.office,
+	       (unsigned long long)t.office_refused);
+	printf("Tracker            : %u slots in use, %llu failures, %llu blocked, %llu evictions\n",
+	       stats.tracked, (unsigned long long)stats.failures, (unsigned long long)stats.blocked,
+	       (unsigned long long)stats.evictions);
+
+	od_attempt_close(tracker);
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Check od_scrypt() against the test vectors of RFC 7914 section 12.  Every
+ * stored verifier depends on it, so a change to the Salsa20/8 or BlockMix
+ * code that alters its output must fail here first.
+ *
+ * cc -I../common -o test_scrypt test_scrypt.c ../common/Scrypt.c -lcrypto
+ *
+ * Usage: test_scrypt
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Scrypt.h"
+
+static const struct {
+	const char	*password;
+	const char	*salt;
+	unsigned int	log2_n;
+	uint32_t	r;
+	uint32_t	p;
+	const char	*expected;
+} vectors[] = {
+	{ "", "", 4, 1, 1,
+	  "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442"
+	  "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906" },
+	{ "password", "NaCl", 10, 8, 16,
+	  "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162"
+	  "2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640" },
+};
+
+int
+main(void)
+{
+	uint8_t out[64];
+	char hex[2 * sizeof(out) + 1];
+	size_t i, j;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+		if (0 != od_scrypt(vectors[i].password, strlen(vectors[i].password),
+				   (const uint8_t *)vectors[i].salt, strlen(vectors[i].salt),
+				   vectors[i].log2_n, vectors[i].r, vectors[i].p, out, sizeof(out))) {
+			perror("od_scrypt");
+			return 1;
+		}
+		for (j = 0; j < sizeof(out); ++j)
+			snprintf(&hex[2 * j], 3, "%02x", out[j]);
+
+		if (0 == strcmp(hex, vectors[i].expected)) {
+			printf("vector %zu: ok\n", i + 1);
+		} else {
+			printf("vector %zu: FAILED\n  got      %s\n  expected %s\n", i + 1, hex, vectors[i].expected);
+			failed = 1;
+		}
+	}
+
+	return failed;
+}